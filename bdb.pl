@@ -39,28 +39,81 @@
             bdb_close_environment/1,    % +Environment
             bdb_current_environment/1,  % -Environment
             bdb_environment_property/2, % ?Environment, ?Property
+            bdb_env_statistics/2,       % +Environment, -Stats
+            bdb_env_statistics/3,       % +Environment, -Stats, +Options
+            bdb_maintenance/3,          % +Environment, +Task, +Action
+            bdb_maintenance_status/2,   % +Environment, -Status
 
             bdb_open/4,                 % +File, +Mode, -Handle, +Options
             bdb_close/1,                % +Handle
             bdb_closeall/0,             %
             bdb_current/1,              % -DB
+            bdb_db_statistics/2,        % +DB, -Stats
+            bdb_db_statistics/3,        % +DB, -Stats, +Options
+            bdb_enable_metrics/1,       % +Boolean
+            bdb_handle_metrics/2,       % +Handle, -Metrics
+            bdb_handle_metrics/3,       % +Handle, -Metrics, +Options
 
             bdb_put/3,                  % +DB, +Key, +Value
+            bdb_put/4,                  % +DB, +Key, +Value, +Options
+            bdb_put_many/3,             % +DB, +Pairs, +Options
             bdb_del/3,                  % +DB, +Key, ?Value
+            bdb_del/4,                  % +DB, +Key, ?Value, +Options
             bdb_delall/3,               % +DB, +Key, +Value
             bdb_enum/3,                 % +DB, -Key, -Value
+            bdb_enum_keys/2,            % +DB, -Key
             bdb_get/3,                  % +DB, +Key, -Value
+            bdb_get/4,                  % +DB, +Key, -Value, +Options
             bdb_getall/3,               % +DB, +Key, -ValueList
+            bdb_get_many/3,             % +DB, +Keys, -Pairs
+            bdb_partition_keys/3,       % +DB, +Count, -Ranges
+            bdb_enum_range/4,           % +DB, +Range, -Key, -Value
+            bdb_concurrent_forall/5,    % +DB, ?Key, ?Value, :Goal, +Options
+            bdb_exists/2,               % +DB, +Key
+            bdb_count/3,                % +DB, +Key, -Count
+            bdb_get_partial/5,          % +DB, +Key, +Offset, +Length, -Bytes
+            bdb_put_partial/5,          % +DB, +Key, +Offset, +Length, +Bytes
+            bdb_associate/3,            % +Primary, +Secondary, +Extractor
+            bdb_compact/2,              % +DB, +Options
+            bdb_compact/3,              % +DB, -Stats, +Options
+            bdb_truncate/2,             % +DB, -Count
+            bdb_append/3,               % +DB, +Value, -RecNo
+            bdb_enqueue/3,              % +DB, +Value, -RecNo
+            bdb_dequeue/3,              % +DB, -RecNo, -Value
+            bdb_dequeue/4,              % +DB, -RecNo, -Value, +Options
+            bdb_sequence_open/4,        % +DB, +Key, -Sequence, +Options
+            bdb_sequence_next/2,        % +Sequence, -Value
+            bdb_sequence_next/3,        % +Sequence, -Value, +Options
+            bdb_sequence_close/1,       % +Sequence
+            bdb_pget/4,                 % +Secondary, +SKey, -PKey, -Value
+
+            bdb_cursor_open/3,          % +DB, -Cursor, +Options
+            bdb_cursor_close/1,         % +Cursor
+            bdb_cursor_seek/4,          % +Cursor, +How, -Key, -Value
+            bdb_cursor_next/3,          % +Cursor, -Key, -Value
+            bdb_cursor_prev/3,          % +Cursor, -Key, -Value
+            bdb_cursor_last/3,          % +Cursor, -Key, -Value
 
             bdb_transaction/1,          % :Goal
             bdb_transaction/2,          % :Goal, +Environment
+            bdb_transaction/3,          % +Environment, :Goal, +Options
+            bdb_txn_begin/3,            % +Environment, -Txn, +Options
+            bdb_txn_commit/1,           % +Txn
+            bdb_txn_commit/2,           % +Txn, +Options
+            bdb_txn_abort/1,            % +Txn
 
             bdb_version/1               % -Version
           ]).
 :- use_foreign_library(foreign(bdb4pl)).
+:- autoload(library(option), [option/3, select_option/4]).
+:- autoload(library(thread), [concurrent_forall/3]).
+:- autoload(library(lists), [member/2]).
+
 :- meta_predicate
     bdb_transaction(0),
-    bdb_transaction(+, 0).
+    bdb_transaction(+, 0),
+    bdb_transaction(+, 0, +),
+    bdb_concurrent_forall(+, ?, ?, 0, +).
 
 /** <module> Berkeley DB interface
 
@@ -147,13 +200,85 @@ following atom-typed codes are  defined: `lock_deadlock`, `runrecovery`,
 %       logic is not yet supported.
 %     - init_txn(+Bool)
 %       Init transactions.  Implies init_log(true).
+%     - group_commit(+Window)
+%       Commit top-level transactions using group commit: commits
+%       do not flush the log themselves.  Instead, the first
+%       committing thread waits Window seconds (a float), after
+%       which it flushes the log for all transactions that committed
+%       meanwhile.  All these transactions are durable when their
+%       commit returns.  This trades latency for throughput if many
+%       threads commit concurrently.
+%     - lk_detect(+Policy)
+%       Run the deadlock detector whenever a lock conflict occurs
+%       and use Policy to select the transaction that is aborted.
+%       Policy is one of `default`, `expire`, `maxlocks`,
+%       `maxwrite`, `minlocks`, `minwrite`, `oldest`, `random` or
+%       `youngest`.  See =|DB_ENV->set_lk_detect()|=.  Without this
+%       option, deadlocks are only resolved by timeouts.
+%     - lock_timeout(+Seconds)
+%     - txn_timeout(+Seconds)
+%       Set the default timeout for acquiring a lock and for the
+%       lifetime of a transaction.  Seconds may be a float.  See
+%       =|DB_ENV->set_timeout()|=.
 %     - lockdown(+Bool)
+%     - mp_max_openfd(+Integer)
+%       Limit the number of file descriptors the memory pool keeps
+%       open.  See =|DB_ENV->set_mp_max_openfd()|=.
+%     - multiversion(+Bool)
+%       Open all databases in the environment with support for
+%       multiversion concurrency control (=DB_MULTIVERSION=).
 %     - mp_size(+Integer)
 %     - mp_mmapsize(+Integer)
 %       Control memory pool handling (=DB_INIT_MPOOL=). The
 %       `mp_size` option sets the memory-pool used for
 %       caching, while the `mp_mmapsize` controls the maximum size
-%       of a DB file mapped entirely into memory.
+%       of a DB file mapped entirely into memory.  The cache may be
+%       larger than 4Gb.  This is the most important tuning parameter:
+%       ideally the cache holds the working set of the databases.
+%       See bdb_env_statistics/2 for the cache hit ratio.
+%     - mp_ncache(+Count)
+%       Split the cache into Count regions.  This is required if the
+%       system cannot allocate a single region of mp_size(Bytes).
+%       See =|DB_ENV->set_cachesize()|=.
+%     - lg_bsize(+Bytes)
+%       Size of the in-memory log buffer.  A larger buffer reduces the
+%       number of log writes for large transactions.
+%     - lg_max(+Bytes)
+%       Maximum size of a single log file.
+%     - lk_max_locks(+Count)
+%     - lk_max_lockers(+Count)
+%     - lk_max_objects(+Count)
+%       Size of the lock table.  Large transactions and many
+%       concurrent threads may need more locks, lockers and locked
+%       objects than the default.
+%     - tx_max(+Count)
+%       Maximum number of concurrently active transactions.
+%     - checkpoint(+Seconds)
+%       Start a thread that checkpoints the transaction log every
+%       Seconds (=|DB_ENV->txn_checkpoint()|=).  Checkpoints bound
+%       the time needed for recovery and allow for removing old log
+%       files.  This option, trickle(Seconds) and log_archive(Seconds)
+%       imply thread(true).  The threads are stopped when the
+%       environment is closed.  See bdb_maintenance/3.
+%     - checkpoint_kbytes(+KBytes)
+%     - checkpoint_minutes(+Minutes)
+%       Only write a checkpoint if at least KBytes of log was written
+%       or Minutes passed since the last checkpoint.
+%     - trickle(+Seconds)
+%       Start a thread that writes dirty pages from the cache every
+%       Seconds such that trickle_percent(Percent) of the pages is
+%       clean (=|DB_ENV->memp_trickle()|=).  This avoids that threads
+%       reading pages have to write a dirty page to make room.
+%     - trickle_percent(+Percent)
+%       Percentage of clean pages maintained by trickle(Seconds).
+%       Default is 10.
+%     - log_archive(+Seconds)
+%       Start a thread that removes log files that are no longer
+%       needed for recovery every Seconds (=DB_ARCH_REMOVE=).  Note
+%       that this makes catastrophic recovery impossible.
+%     - log_auto_remove(+Bool)
+%       Let Berkeley DB remove log files that are no longer needed
+%       (=DB_LOG_AUTO_REMOVE=).
 %     - private(+Bool)
 %     - recover(+Bool)
 %       Perform recovery before opening the database.
@@ -174,6 +299,17 @@ following atom-typed codes are  defined: `lock_deadlock`, `runrecovery`,
 %         Specify the time the client waits for the server to
 %         handle a request.
 %     - system_mem(+Bool)
+%     - txn_snapshot(+Bool)
+%       Make isolation(snapshot) the default for transactions
+%       (=DB_TXN_SNAPSHOT=).
+%     - txn_nosync(+Bool)
+%       Do not flush the log on commit (=DB_TXN_NOSYNC=).  Committed
+%       transactions may be lost on a crash, but the database remains
+%       consistent.
+%     - txn_write_nosync(+Bool)
+%       Write, but do not flush the log on commit
+%       (=DB_TXN_WRITE_NOSYNC=).  Committed transactions may be lost
+%       if the operating system crashes.
 %     - transactions(+Bool)
 %       Enable transactions, providing atomicy of changes and
 %       security. Implies logging and locking. See
@@ -187,7 +323,9 @@ following atom-typed codes are  defined: `lock_deadlock`, `runrecovery`,
 %     - use_environ_root(+Bool)
 %     - config(+ListOfConfig)
 %       Specify a list of configuration options, each option is of
-%       the form Name(Value).  Currently unused.
+%       the form Name(Value).  Currently unused.  The settings of
+%       =DB_CONFIG= that affect performance are available as the
+%       options above.
 
 %!  bdb_close_environment(+Environment) is det.
 %
@@ -262,6 +400,188 @@ env_property(register(_)).
 env_property(system_mem(_)).
 env_property(thread(_)).
 
+%!  bdb_env_statistics(+Environment, -Stats:dict) is det.
+%!  bdb_env_statistics(+Environment, -Stats:dict, +Options) is det.
+%
+%   Stats is a dict holding the statistics of the subsystems that are
+%   initialised in Environment.  The keys are
+%
+%     - mpool
+%       Statistics of the memory pool (=|DB_ENV->memp_stat()|=).  This
+%       includes `cache_hit`, `cache_miss` and `hit_ratio`, the evictions
+%       `ro_evict` and `rw_evict`, the number of `pages` in the cache and
+%       `page_dirty`.  The key `files` is a list of dicts holding the
+%       same counters per database file.  If `hit_ratio` is low and
+%       there are many evictions, mp_size(Bytes) of bdb_init/2 is too
+%       small.
+%     - lock
+%       Statistics of the lock subsystem (=|DB_ENV->lock_stat()|=),
+%       including `nrequests`, `lock_wait` (requests that had to wait),
+%       `ndeadlocks` and the timeout counters.
+%     - txn
+%       Statistics of the transaction subsystem (=|DB_ENV->txn_stat()|=)
+%       such as `nbegins`, `ncommits`, `naborts` and `nactive`.
+%     - log
+%       Statistics of the logging subsystem (=|DB_ENV->log_stat()|=),
+%       including the bytes written and the number of writes and
+%       flushes (`scount`).
+%
+%   Options:
+%
+%     - clear(+Boolean)
+%       If `true`, reset the counters after reading them
+%       (=DB_STAT_CLEAR=).  This is useful for exporting the numbers
+%       to a monitoring system at fixed intervals.
+%
+%   The counters are those of Berkeley DB, without the =|st_|= prefix.
+%   See the Berkeley DB documentation for their meaning.
+
+%!  bdb_compact(+DB, +Options) is det.
+%!  bdb_compact(+DB, -Stats:dict, +Options) is det.
+%
+%   Compact a B-tree or recno database  (=|DB->compact()|=).  Deleting
+%   many records, for example using bdb_delall/3, leaves pages that are
+%   mostly empty.  Compaction merges  these   pages,  which  makes scans
+%   faster, and can return the freed pages to the file system.  Options:
+%
+%     - fill_percent(+Percent)
+%       Try to fill pages up to Percent.  Default is the fill factor
+%       of Berkeley DB.
+%     - pages(+Count)
+%       Stop after freeing Count pages.
+%     - batch(+Count)
+%       Compact incrementally, freeing at most Count pages per step.
+%       If the environment is transactional and there is no current
+%       transaction, each step runs in its own transaction such that
+%       concurrent access is blocked only briefly.
+%     - timeout(+Seconds)
+%       Lock timeout for the compaction.
+%     - free_space(+Bool)
+%       If `true`, return freed pages at the end of the file to the
+%       file system (=DB_FREE_SPACE=).
+%     - freelist_only(+Bool)
+%       Do not compact, only return the pages on the free list to the
+%       file system (=DB_FREELIST_ONLY=).
+%
+%   Stats is a dict holding `pages_free`, `pages_examine`,
+%   `pages_truncated` (pages returned to the file system), `levels`
+%   (B-tree levels removed), `deadlock` and the number of `steps`.
+
+%!  bdb_truncate(+DB, -Count) is det.
+%
+%   Remove all records from DB (=|DB->truncate()|=).  Count is unified
+%   with the number of removed records.  This is much faster than
+%   deleting the records one by one.  There may be no open cursors on
+%   DB.
+
+%!  bdb_append(+DB, +Value, -RecNo) is det.
+%
+%   Add Value to a `recno`, `queue` or  `heap` database and unify RecNo
+%   with the record number or record  id   assigned  by Berkeley DB
+%   (=DB_APPEND=).  RecNo can be used as key for bdb_get/3, bdb_del/3
+%   and cursors.  Compared to a btree   keyed by a counter, appending
+%   does not need to maintain a counter and stores no keys.
+
+%!  bdb_enqueue(+DB, +Value, -RecNo) is det.
+%
+%   Append Value to DB, which must be  opened using type(queue). RecNo
+%   is unified with the record number assigned by Berkeley DB.  Value
+%   must fit in the record_length(Bytes) of the queue.
+
+%!  bdb_dequeue(+DB, -RecNo, -Value) is det.
+%!  bdb_dequeue(+DB, -RecNo, -Value, +Options) is semidet.
+%
+%   Remove the record at the head of the  queue DB and unify RecNo and
+%   Value with it (=DB_CONSUME=).  If the  queue   is  empty, the calling
+%   thread waits until a record is available.  While waiting, the queue
+%   is polled at an interval that grows  to   0.1 seconds and the thread
+%   processes signals, so it can be interrupted using thread_signal/2.
+%   Queues lock individual records, which allows many threads to
+%   consume concurrently.  Options:
+%
+%     - wait(+Bool)
+%       If `false`, fail if the queue is empty.  Default is `true`.
+%     - timeout(+Seconds)
+%       Fail if no record becomes available within Seconds.
+%     - txn(+Txn)
+%       Dequeue in the transaction Txn.  If Txn is aborted, the
+%       record is restored.
+%
+%   Values are returned including the padding of the record, which
+%   is harmless for the types `term`, `c_string`, `c_long`, `int64`
+%   and `float`.
+
+%!  bdb_sequence_open(+DB, +Key, -Sequence, +Options) is det.
+%
+%   Open the sequence stored under Key   in DB (=DB_SEQUENCE=), creating
+%   it if it does not exist.   A sequence allocates unique integers
+%   without the need for a transaction that reads and updates a
+%   counter.  Options:
+%
+%     - initial(+Integer)
+%       First value of a new sequence.  Default is 0.
+%     - min(+Integer)
+%     - max(+Integer)
+%       Range of the sequence.
+%     - decrement(+Bool)
+%       If `true`, the sequence counts down.
+%     - wrap(+Bool)
+%       If `true`, wrap around when reaching the end of the range.
+%       Otherwise bdb_sequence_next/2 raises an exception.
+%     - cache(+Count)
+%       Reserve Count values at a time in the handle.  Most calls to
+%       bdb_sequence_next/2 then do not access the database, which
+%       allows many threads to allocate values concurrently.  Values
+%       that are cached when the sequence is closed are lost.
+%
+%   Sequence is a blob that  is   subject  to  atom garbage collection.
+%   Sequences must be closed before DB is closed.
+
+%!  bdb_sequence_next(+Sequence, -Value) is det.
+%!  bdb_sequence_next(+Sequence, -Value, +Options) is det.
+%
+%   Value is the next value of Sequence.  Options:
+%
+%     - delta(+Count)
+%       Allocate Count values.  Value is the first of them.
+%     - txn(+Txn)
+%       Update the sequence record in the transaction Txn.  Not
+%       allowed for sequences with a cache.
+%
+%   Without a cache, the update uses the current transaction of
+%   bdb_transaction/1, if any.
+
+%!  bdb_sequence_close(+Sequence) is det.
+%
+%   Close Sequence.
+
+%!  bdb_maintenance(+Environment, +Task, +Action) is det.
+%
+%   Control the maintenance thread Task of Environment.  Task is one
+%   of `checkpoint`, `trickle` or `log_archive`.  Action is one of
+%
+%     - interval(+Seconds)
+%       Run Task every Seconds.  Starts the thread if it is not
+%       running.
+%     - run
+%       Run Task now.
+%     - stop
+%       Stop the thread.
+%
+%   Environment must have been created with thread(true).  See the
+%   checkpoint(Seconds) option of bdb_init/2 for a description of the
+%   tasks.
+
+%!  bdb_maintenance_status(+Environment, -Status:dict) is det.
+%
+%   Status is a dict with a key for each running maintenance task.
+%   The value is a dict holding the `interval`, the number of `runs`
+%   and the Berkeley DB error code of the last run in `last_error`
+%   (0 on success).  The `trickle` task also reports the `percent`
+%   and the total number of `pages_written`; the `checkpoint` task
+%   reports `kbytes` and `minutes`.
+
+
 
 %!  bdb_open(+File, +Mode, -DB, +Options) is det.
 %
@@ -281,13 +601,20 @@ env_property(thread(_)).
 %     - dup(+Boolean)
 %       Do/do not allow for duplicate values on the same key.
 %       Default is not to allow for duplicates.
+%     - dupsort(+Boolean)
+%       Allow for duplicates and keep the values of a key sorted.
+%       A key/value pair can only appear once; bdb_put/3 of an
+%       existing pair succeeds without changing the database.  If
+%       the value type is not `term`, bdb_get/3 and bdb_del/3 with
+%       a bound value find the pair directly rather than walking
+%       all values of the key.
 %     - excl(+Boolean)
 %       Combined with create(true), fail if the database already
 %       exists.
 %     - multiversion(+Boolean)
 %       Open the database with support for multiversion concurrency
-%       control.  The flag is passed, but no further support is
-%       provided yet.
+%       control (MVCC).  This is required for transactions that use
+%       isolation(snapshot).  See bdb_transaction/3.
 %     - nommap(+Boolean)
 %       Do not map this database into process memory.
 %     - rdonly(+Boolean)
@@ -305,6 +632,71 @@ env_property(thread(_)).
 %     - truncate(+Boolean)
 %       When specified, truncate the underlying file, i.e., start
 %       with an empty database.
+%     - type(+Type)
+%       Access method of a new database.  One of `btree` (default),
+%       `hash`, `recno`, `queue`, `heap` or `unknown`.  Use `unknown`
+%       to open an existing database of any type.  The keys of
+%       `recno` and `queue` databases are record numbers and those
+%       of `heap` databases are record ids.  Both are represented
+%       as integers and the key(Type) option is ignored.  Records
+%       are added using bdb_append/3.  The `heap` type requires
+%       Berkeley DB 5.2 or later.
+%     - pagesize(+Bytes)
+%       Page size of a new database, a power of two between 512 and
+%       65536.  Larger pages reduce the depth of btrees and the number
+%       of overflow pages for large values.  Ignored for existing
+%       databases.  See bdb_db_statistics/2.
+%     - bt_minkey(+Count)
+%       Minimum number of keys on a btree page.  Values that do not
+%       fit are moved to overflow pages.
+%     - h_ffactor(+Count)
+%       Desired number of items in a hash bucket.
+%     - h_nelem(+Count)
+%       Estimate of the final number of keys of a hash database,
+%       which avoids growing the hash table while loading.
+%     - record_length(+Bytes)
+%       Length of the records of a queue.  This is required for
+%       a new queue.  Shorter values are padded.
+%     - record_pad(+Byte)
+%       Byte used to pad queue records.  Default is 0.
+%     - extent_size(+Pages)
+%       Store a queue in extent files of Pages pages, such that the
+%       space of consumed records is returned to the file system.
+%     - cache(+Bytes)
+%       Keep up to Bytes of recently read records in memory.
+%       bdb_get/3 on a key that is in the cache does not access
+%       Berkeley DB.  The least recently used records are evicted.
+%       Writes through DB update the cache; writes through other
+%       handles or processes are not seen.  The cache is used only
+%       outside transactions and is cleared when a transaction that
+%       modified DB commits.  Not allowed for databases with
+%       duplicates or secondary databases.  See
+%       bdb_handle_metrics/2 for the hit ratio.
+%     - compress(+Method)
+%       Compress the pages of a btree database.  This works for all
+%       key and value types and requires Berkeley DB 4.8 or later.
+%       Method is one of
+%       - none
+%         Do not compress (default).
+%       - prefix
+%         Use the default compression of Berkeley DB, which stores
+%         the part of a key that is shared with the previous key
+%         (and of a value shared with the previous duplicate) once.
+%       - zlib(+MinSize)
+%         Compress keys as `prefix` and compress values of at least
+%         MinSize bytes using zlib.  `zlib` is the same as
+%         zlib(128).  Only available if the package was built
+%         with zlib.
+%       A database must always be opened with the same Method.
+%       See bdb_handle_metrics/2 for the achieved compression.
+%     - cache_cursors(+Boolean)
+%       If `true`, each thread keeps a cursor on the database open
+%       for bdb_get/3, bdb_del/3, bdb_getall/3 and bdb_enum/3 rather
+%       than opening a new one for every call.  This notably speeds
+%       up bdb_get/3 on databases with dup(true).  Idle cursors may
+%       hold locks and are therefore only cached outside
+%       transactions in environments that do not use locking.
+%       Default is `false`.
 %     - database(+Name)
 %       If File contains multiple databases, address the named
 %       database in the file. A DB file can only consist of multiple
@@ -339,6 +731,35 @@ env_property(thread(_)).
 %       - c_long
 %         Key/Value is an integer. The value is represented as a
 %         native C long in machine byte-order.
+%       - int64
+%         Key/Value is a 64-bit integer.  The value is represented
+%         big-endian with the sign bit flipped, such that the default
+%         btree order is the numeric order.
+%       - float
+%         Key/Value is a float.  The value is represented as a
+%         big-endian IEEE double, modified such that the default
+%         btree order is the numeric order.
+%       - term_ordered
+%         Key/Value is a ground term that consists of integers
+%         (that fit in 64 bits), floats, atoms, strings and
+%         compounds.  The encoding is designed such that the
+%         default btree order is the standard order of terms (see
+%         compare/3).  This makes range and prefix queries using
+%         cursors (see bdb_cursor_seek/4) and sorted bulk loading
+%         using bdb_put_many/3 effective for structured keys.  Note
+%         that the atom '[]' is stored as [].
+%       - term_dict
+%         Key/Value is an arbitrary Prolog term, stored compactly.
+%         Atoms and the name and arity of compounds are replaced
+%         by an id in a dictionary shared by all records of the
+%         database and small integers use a variable-length
+%         encoding.  The dictionary is stored in the database
+%         Name$dict of the same file, and this type therefore
+%         requires the option database(Name).  Terms that cannot
+%         be encoded this way (big integers, rationals, blobs,
+%         dicts and cyclic terms) use the representation of the
+%         type `term`.  Like `term`, the encoding does not follow
+%         the standard order of terms.
 %
 %   @arg DB is unified with a _blob_ of type `db`. Database handles
 %   are subject to atom garbage collection.
@@ -354,18 +775,48 @@ env_property(thread(_)).
 %   exception.
 
 %!  bdb_put(+DB, +Key, +Value) is det.
+%!  bdb_put(+DB, +Key, +Value, +Options) is det.
 %
 %   Add a new key-value pair to the   database. If the database does
 %   not allow for duplicates the   possible previous associated with
-%   Key is replaced by Value.
+%   Key is replaced by Value.  Options:
+%
+%     - txn(+Txn)
+%       Perform the operation in the transaction Txn, created by
+%       bdb_txn_begin/3, rather than in the current transaction.
+%       The same option is processed by bdb_get/4, bdb_del/4 and
+%       bdb_cursor_open/3.
+
+%!  bdb_put_many(+DB, +Pairs, +Options) is det.
+%
+%   Add all Key-Value pairs from  the  list   Pairs  to  DB. This is
+%   semantically the same as calling bdb_put/3   for each pair, but all
+%   pairs are encoded into a single buffer that is written using one
+%   =|DB->put()|= call with =DB_MULTIPLE_KEY=   (Berkeley DB 4.8 and
+%   later).  Options:
+%
+%     - sort(+Boolean)
+%       If `true` (default for btree databases), sort the pairs on the
+%       encoded key before writing, such that the insertion fills
+%       pages in order. The sort is stable, so the order of values
+%       for the same key is preserved.
+%     - chunk(+Count)
+%       Write Count pairs at a time.  If the environment is
+%       transactional and there is no current transaction, each
+%       chunk is written in its own transaction.  Default is to
+%       write all pairs in one chunk.
+%
+%   If there is a current transaction (see bdb_transaction/1), all
+%   pairs are written inside this transaction.
 
 %!  bdb_del(+DB, ?Key, ?Value) is nondet.
+%!  bdb_del(+DB, ?Key, ?Value, +Options) is nondet.
 %
 %   Delete the first matching key-value pair   from the database. If
 %   the  database  allows  for   duplicates,    this   predicate  is
 %   non-deterministic, otherwise it is   _semidet_.  The enumeration
 %   performed by this predicate is the   same  as for bdb_get/3. See
-%   also bdb_delall/3.
+%   also bdb_delall/3.  Options are the same as for bdb_put/4.
 
 %!  bdb_delall(+DB, +Key, ?Value) is det.
 %
@@ -383,6 +834,7 @@ bdb_delall(DB, Key, Value) :-
     ).
 
 %!  bdb_get(+DB, ?Key, -Value) is nondet.
+%!  bdb_get(+DB, ?Key, -Value, +Options) is nondet.
 %
 %   Query the database. If the database   allows for duplicates this
 %   predicate is non-deterministic, otherwise it  is _semidet_. Note
@@ -396,6 +848,8 @@ bdb_delall(DB, Key, Value) :-
 %     - bdb_enum(DB, f(a), V) succeeds, but does not perform any
 %       indexing, i.e., it enumerates all key-value pairs and
 %       performs the unification.
+%
+%   Options are the same as for bdb_put/4.
 
 %!  bdb_enum(+DB, -Key, -Value)
 %
@@ -404,11 +858,276 @@ bdb_delall(DB, Key, Value) :-
 %   instantiated Key to enumerate only the   keys unifying with Key,
 %   no indexing is used by bdb_enum/3.
 
+%!  bdb_enum_keys(+DB, -Key) is nondet.
+%
+%   Enumerate the keys of DB.  Unlike bdb_enum/3, the values are not
+%   read and each key is enumerated only once, also if the database
+%   has duplicates.
+
 %!  bdb_getall(+DB, +Key, -Values) is semidet.
 %
 %   Get all values associated with Key. Fails   if  the key does not
 %   exist (as bagof/3).
 
+%!  bdb_exists(+DB, +Key) is semidet.
+%
+%   True if Key appears in  DB.  The   value  is  not retrieved, so
+%   this is cheaper than bdb_get/3 if the values are large.
+
+%!  bdb_count(+DB, +Key, -Count:nonneg) is det.
+%
+%   Count is the number of values   associated with Key.  This is 0
+%   if Key does not exist and at most 1 if the database does not
+%   allow for duplicates.  The values are not retrieved.
+
+%!  bdb_get_partial(+DB, +Key, +Offset, +Length, -Bytes) is semidet.
+%
+%   Bytes is a string holding at most   Length bytes of the value of
+%   Key, starting at byte Offset.  Only the requested part of the
+%   value is read.  This requires  the   database  to have values of
+%   type `c_blob`.  On a database with duplicates this reads from the
+%   first value of Key.
+
+%!  bdb_put_partial(+DB, +Key, +Offset, +Length, +Bytes) is det.
+%
+%   Replace Length bytes of the value   of Key, starting at Offset, by
+%   Bytes. If Bytes is longer or  shorter   than  Length the value
+%   grows or shrinks.  If the key does   not  exist or the value is
+%   shorter than Offset, the value is padded with zero bytes.  This
+%   requires the database to have values of type `c_blob`.
+
+%!  bdb_associate(+Primary, +Secondary, +Extractor) is det.
+%
+%   Make Secondary a secondary index of  Primary. After this call,
+%   Berkeley DB maintains Secondary on  every   update  of Primary,
+%   mapping the key computed by Extractor from the value to the key of
+%   the primary.  If Secondary is empty, it is filled from the
+%   current content of Primary.  Extractor is one of
+%
+%     - value
+%       The value of the primary is the secondary key.  This is the
+%       classical inverse database.
+%     - arg(+N)
+%       The N-th argument of the value is the secondary key.
+%     - path(+List)
+%       As arg(N), for the nested argument described by List.  For
+%       example, path([2,1]) uses `X` from a value f(_, g(X)).
+%     - bytes(+Offset, +Length)
+%       The secondary key is the byte range of a `c_blob` value,
+%       used as the encoded key.
+%
+%   The key is computed in C, without calling Prolog.  Values that
+%   have no such argument or are shorter than Offset are not
+%   indexed.  Secondary typically allows for duplicates (dupsort(true)),
+%   and its key type determines how the extracted key is stored.
+%   Secondary must be opened in the same environment as Primary and
+%   must be closed before Primary.  The association is not stored in
+%   the database files; it must be re-established after each
+%   bdb_open/4.  Secondary cannot be updated directly.  Use bdb_pget/4
+%   to access it.  Deleting from Secondary using bdb_del/3 deletes
+%   the record from Primary.
+
+%!  bdb_pget(+Secondary, +SKey, -PKey, -Value) is nondet.
+%
+%   True when PKey-Value is a record of the  primary database that has
+%   the secondary key SKey in Secondary.  Secondary must be associated
+%   using bdb_associate/3.
+
+%!  bdb_get_many(+DB, +Keys, -Pairs) is det.
+%
+%   Fetch the values for all keys in the list Keys in a single call.
+%   Pairs is a list of Key-Value pairs, one  for each value found. If
+%   the database allows for  duplicates,   Pairs  contains a pair for
+%   each duplicate value. Keys that are not in the database are
+%   omitted.
+%
+%   The keys are sorted on their  encoded representation and fetched
+%   using Berkeley DB's bulk retrieval (=DB_MULTIPLE_KEY= for btree
+%   databases, =DB_MULTIPLE= otherwise).  For   btree  databases this
+%   reads neighbouring keys from the same  page without additional
+%   database access. As a result, Pairs   is  ordered by the encoded
+%   key rather than by the order in  Keys and keys that appear more
+%   than once in Keys are reported   only  once. The lookup is
+%   performed in the current transaction.
+
+%!  bdb_cursor_open(+DB, -Cursor, +Options) is det.
+%
+%   Open a cursor on DB.  A cursor  is   a  position in the database
+%   that can be moved using bdb_cursor_seek/4, bdb_cursor_next/3,
+%   bdb_cursor_prev/3 and bdb_cursor_last/3. For btree databases
+%   this provides range and prefix  queries   that  only  visit the
+%   matching records.  Options:
+%
+%     - read_committed(+Boolean)
+%       Release read locks after reading a record (degree 2
+%       isolation).
+%     - read_uncommitted(+Boolean)
+%       Read modified data that is not yet committed.  The database
+%       must be opened using read_uncommitted(true).
+%     - txn(+Txn)
+%       Open the cursor in the transaction Txn.  See bdb_txn_begin/3.
+%
+%   If there is a current transaction or the txn(Txn) option is used,
+%   the cursor is bound to this transaction and is closed
+%   automatically when the transaction is committed or aborted.  The
+%   cursor is also closed by bdb_close/1 on DB.
+%
+%   @arg Cursor is a blob of type `bdb_cursor`. Cursors are subject
+%   to atom garbage collection, which closes the cursor if this
+%   was not done explicitly.
+
+%!  bdb_cursor_close(+Cursor) is det.
+%
+%   Close Cursor.  Subsequent operations on Cursor raise a
+%   permission_error.
+
+%!  bdb_cursor_seek(+Cursor, +How, -Key, -Value) is semidet.
+%
+%   Position Cursor and unify Key and   Value with the record at the
+%   new position. How is one of
+%
+%     - exact(+Key)
+%       Position at Key.  Fails if Key is not in the database.
+%     - range(+Key)
+%       Position at the smallest key that is greater than or equal
+%       to Key.
+%     - prefix(+Prefix)
+%       As range(Prefix), but fail if the found key does not start
+%       with Prefix.  Subsequent calls to bdb_cursor_next/3 and
+%       bdb_cursor_prev/3 fail if they leave the keys that start
+%       with Prefix.  Only supported for keys of type `atom`,
+%       `c_blob`, `c_string` and `term_ordered`.  For `term_ordered`
+%       keys, an atom or string Prefix matches atoms or strings that
+%       start with Prefix, while any other term only matches itself.
+%
+%   Note that ordering uses the  bytes   of  the encoded keys, which
+%   only corresponds to Prolog ordering for  text keys (atom, c_blob,
+%   c_string) and the types `int64`, `float` and `term_ordered`.
+
+%!  bdb_cursor_next(+Cursor, -Key, -Value) is semidet.
+%!  bdb_cursor_prev(+Cursor, -Key, -Value) is semidet.
+%
+%   Move Cursor to the next/previous record and unify Key and Value
+%   with it.  Fails if there is no next/previous record. If Cursor
+%   is not positioned, bdb_cursor_next/3 moves to the first record
+%   and bdb_cursor_prev/3 to the last.
+
+%!  bdb_cursor_last(+Cursor, -Key, -Value) is semidet.
+%
+%   Move Cursor to the last record of the database. Fails if the
+%   database is empty.
+
+%!  bdb_partition_keys(+DB, +Count, -Ranges) is det.
+%
+%   Split the keys of DB into at most  Count ranges that hold about the
+%   same number of records.  Each  element  of   Ranges  is  a term
+%   range(From, To) that can be passed to bdb_enum_range/4. The split
+%   points are computed using the  btree   statistics  of Berkeley DB
+%   and reading a few keys, i.e., without scanning the database.
+%   Ranges for a non-btree database  consist   of  a single range that
+%   covers all keys.
+
+%!  bdb_enum_range(+DB, +Range, -Key, -Value) is nondet.
+%
+%   As bdb_enum/3, but only enumerate the   records  in Range, where
+%   Range is an element of the  list   produced  by bdb_partition_keys/3.
+%   Bounds are either the atoms `min` and   `max` or bytes(Encoded),
+%   where Encoded is a string holding an  encoded key. A range includes
+%   its lower bound and excludes its upper bound.
+
+%!  bdb_concurrent_forall(+DB, ?Key, ?Value, :Goal, +Options) is semidet.
+%
+%   True when Goal is true for all  Key-Value   pairs  in DB. The key
+%   space is split using bdb_partition_keys/3  and   the  ranges are
+%   scanned by concurrent threads  using   concurrent_forall/3.  The
+%   database must be accessible from  multiple   threads,  i.e., its
+%   environment must be initialised with thread(true). Each thread
+%   scans using its own cursor outside   a  transaction.  Options:
+%
+%     - threads(+Count)
+%       Number of threads to use.  Default is the Prolog flag
+%       `cpu_count`.
+%     - partitions(+Count)
+%       Number of ranges. Default is four times the number of
+%       threads, which balances ranges that turn out to be slower.
+
+bdb_concurrent_forall(DB, Key, Value, Goal, Options) :-
+    current_prolog_flag(cpu_count, CPUs),
+    option(threads(Threads), Options, CPUs),
+    Partitions0 is Threads*4,
+    option(partitions(Partitions), Options, Partitions0),
+    bdb_partition_keys(DB, Partitions, Ranges),
+    concurrent_forall(member(Range, Ranges),
+                      \+ ( bdb_enum_range(DB, Range, Key, Value),
+                           \+ Goal
+                         ),
+                      [threads(Threads)]).
+
+%!  bdb_db_statistics(+DB, -Stats:dict) is det.
+%!  bdb_db_statistics(+DB, -Stats:dict, +Options) is det.
+%
+%   Stats is a dict holding the statistics  of DB as provided by
+%   =|DB->stat()|=. The keys depend on the access method. For btree
+%   and recno databases they include `nkeys`, `ndata`, `pagesize`,
+%   `levels` (the depth of the tree), the page counts `int_pg`,
+%   `leaf_pg`, `dup_pg` and `over_pg` and the free bytes on these
+%   pages.  Many overflow pages (`over_pg`) suggest that the page
+%   size is too small for the values.  Options:
+%
+%     - fast(+Boolean)
+%       If `true`, only return the values that can be obtained
+%       without traversing the database (=DB_FAST_STAT=).  Notably,
+%       `nkeys` and `ndata` may be inaccurate and the page counts
+%       are zero.
+
+%!  bdb_enable_metrics(+Boolean) is det.
+%
+%   Enable or disable collecting latency metrics (default `false`).
+%   If enabled, the time spent in Berkeley DB is recorded for each
+%   get, put, delete and cursor step on a database and for each
+%   commit in an environment.  This costs two clock readings per
+%   operation.  If disabled, the overhead is a single test.  See
+%   bdb_handle_metrics/2.
+
+%!  bdb_handle_metrics(+Handle, -Metrics:dict) is det.
+%!  bdb_handle_metrics(+Handle, -Metrics:dict, +Options) is det.
+%
+%   Metrics is a dict holding the latency metrics collected for
+%   Handle since it was opened or since the metrics were cleared.
+%   If Handle is a database, the keys are `get`, `put`, `del` and
+%   `cursor`. If Handle is an environment, the only key is `commit`.
+%   Each value is a dict with the keys below.  Times are in seconds.
+%
+%     - count
+%       Number of operations.
+%     - total, mean, max
+%       Total, average and longest time of the operations.
+%     - p50, p90, p99
+%       Percentiles.  These are upper bounds: the histogram uses
+%       buckets whose bounds are powers of two in microseconds.
+%     - buckets
+%       List of 32 counts.  Element I (0-based) counts the operations
+%       that took less than 2^I microseconds and, for I > 0, at least
+%       2^(I-1) microseconds.
+%
+%   If the database was opened with cache(Bytes), the key `cache`
+%   holds a dict with the `hits`, `misses`, `hit_ratio` and
+%   `evictions` of the cache, the number of `entries`, their memory
+%   usage in `bytes` and `max_bytes`.  The metrics of the cache are
+%   collected regardless of bdb_enable_metrics/1.
+%
+%   If the database was opened with compress(zlib(MinSize)), the key
+%   `compress` holds a dict with the number of zlib compressed
+%   `values`, their `raw_bytes` and compressed `bytes` and the
+%   compression `ratio`.  As Berkeley DB recompresses a group of
+%   records when one of them is modified, these count compressions
+%   rather than stored records.
+%
+%   Options:
+%
+%     - clear(+Boolean)
+%       If `true`, reset the metrics of Handle after reading them.
+
 %!  bdb_current(?DB) is nondet.
 %
 %   True when DB is a handle to a currently open database.
@@ -454,37 +1173,136 @@ terminate_bdb :-
 %   Only if Goal succeeds, the  transaction   is  commited.  If Goal
 %   fails or raises an exception,  the   transaction  is aborted and
 %   bdb_transaction/1 either fails or  rethrows   the  exception. Of
-%   special interest is the exception
+%   special interest are the exceptions
 %
 %     ==
-%     error(package(db, deadlock), _)
+%     error(bdb(lock_deadlock, _, _), _)
+%     error(bdb(lock_notgranted, _, _), _)
 %     ==
 %
-%   This exception indicates a deadlock was raised  by one of the DB
-%   predicates. Deadlocks may arise if multiple processes or threads
-%   access  the  same  keys   in   a    different   order.   The  DB
-%   infra-structure causes one of  the   processes  involved  in the
-%   deadlock to abort its transaction. This   process  may choose to
-%   restart the transaction.
+%   These exceptions indicate that the transaction was selected by
+%   the deadlock detector (see the lk_detect(Policy) option of
+%   bdb_init/2) or that a lock could not be obtained within the lock
+%   timeout.  Deadlocks may arise if multiple processes or threads
+%   access the same keys in a different order.  The transaction may
+%   be restarted, which is what bdb_transaction/3 does.
 %
-%   For example, a DB application  may   define  `{Goal}` to realise
-%   transactions and restart these automatically   is  a deadlock is
-%   raised:
+%   @arg Environment defines the environment to which the
+%   transaction applies.  If omitted, the default environment
+%   is used.  See bdb_init/1 and bdb_init/2.
+
+%!  bdb_transaction(+Environment, :Goal, +Options) is semidet.
+%
+%   As bdb_transaction/2, but restart  the   transaction  if it is
+%   aborted because of a deadlock  or   lock  timeout. Before each
+%   restart, the thread sleeps for a random time up to the current
+%   backoff, which doubles after each attempt. Options:
+%
+%     - retry(+MaxAttempts)
+%       Maximum number of times Goal is started.  Default is 10.
+%       If the last attempt deadlocks, the exception is re-raised.
+%     - backoff(+Seconds)
+%       Initial backoff.  Default is 0.001.
+%     - max_backoff(+Seconds)
+%       Maximum backoff.  Default is 1.0.
+%     - sync(+Mode)
+%       Durability of the commit.  Mode is one of `sync` (flush the
+%       log to disk, =DB_TXN_SYNC=), `write_nosync` (write the log
+%       to the operating system, =DB_TXN_WRITE_NOSYNC=) or `nosync`
+%       (do not write the log, =DB_TXN_NOSYNC=).  By default the
+%       environment settings apply, including group_commit(Window).
+%     - isolation(+Level)
+%       Isolation level of the transaction.  Level is one of
+%       `serializable` (default), `snapshot`, `read_committed` or
+%       `read_uncommitted`.  See below.
+%
+%   A transaction that uses isolation(snapshot) reads the database as
+%   it was when the transaction started and does not take read locks.
+%   Readers and writers therefore do  not   block  each  other. This
+%   requires the database to be opened using multiversion(true) or the
+%   environment to be initialised with multiversion(true). Snapshot
+%   transactions are intended for reading; a snapshot transaction that
+%   updates a record changed by a concurrent transaction is aborted
+%   with a lock_deadlock error.  Multiversion concurrency control keeps
+%   copies of modified pages in the cache while older snapshots are
+%   alive, so the cache (mp_size(Bytes) of bdb_init/2) must be large
+%   enough to hold the pages modified during the longest snapshot
+%   transaction.  If many databases are used, mp_max_openfd(N) limits
+%   the file descriptors used for writing these pages.  For example:
 %
 %     ==
-%     {Goal} :-
-%         catch(bdb_transaction(Goal), E, true),
-%         (   var(E)
-%         ->  true
-%         ;   E = error(package(db, deadlock), _)
-%         ->  {Goal}
-%         ;   throw(E)
-%         ).
+%     report(Env, DB, Count) :-
+%         bdb_transaction(Env,
+%                         aggregate_all(count, bdb_enum(DB, _, _), Count),
+%                         [ isolation(snapshot) ]).
 %     ==
 %
-%   @arg Environment defines the environment to which the
-%   transaction applies.  If omitted, the default environment
-%   is used.  See bdb_init/1 and bdb_init/2.
+%   Note that Goal is re-executed from scratch, so it should not have
+%   side effects outside the database.
+
+bdb_transaction(Env, Goal, Options) :-
+    select_option(retry(MaxAttempts), Options, Options1, 10),
+    select_option(backoff(Backoff), Options1, Options2, 0.001),
+    select_option(max_backoff(MaxBackoff), Options2, TxnOptions, 1.0),
+    transaction_loop(Env, Goal, TxnOptions,
+                     1, MaxAttempts, Backoff, MaxBackoff).
+
+transaction_loop(Env, Goal, Options,
+                 Attempt, MaxAttempts, Backoff, MaxBackoff) :-
+    catch('$bdb_transaction'(Env, Goal, Options), E, true),
+    (   var(E)
+    ->  true
+    ;   Attempt < MaxAttempts,
+        retry_transaction_error(E)
+    ->  Sleep is random_float*Backoff,
+        sleep(Sleep),
+        Attempt1 is Attempt+1,
+        Backoff1 is min(MaxBackoff, Backoff*2),
+        transaction_loop(Env, Goal, Options,
+                         Attempt1, MaxAttempts, Backoff1, MaxBackoff)
+    ;   throw(E)
+    ).
+
+retry_transaction_error(error(bdb(Code, _, _), _)) :-
+    retry_transaction_code(Code).
+
+retry_transaction_code(lock_deadlock).
+retry_transaction_code(lock_notgranted).
+
+%!  bdb_txn_begin(+Environment, -Txn, +Options) is det.
+%
+%   Start an explicit transaction.  Unlike bdb_transaction/1, the
+%   transaction does not become the current transaction of the
+%   calling thread.  Instead, it  is  used   by  passing  the  option
+%   txn(Txn) to bdb_put/4, bdb_get/4, bdb_del/4 and
+%   bdb_cursor_open/3.  This allows a thread to interleave multiple
+%   independent transactions and allows passing a transaction to
+%   another thread, for example to overlap the I/O of multiple
+%   transactions.  An explicit transaction is always a top-level
+%   transaction, also if bdb_txn_begin/3 is called inside
+%   bdb_transaction/1.  Options are sync(Mode) and isolation(Level)
+%   as described with bdb_transaction/3.
+%
+%   Using a transaction from multiple threads requires the environment
+%   to be initialised using thread(true).  A transaction may be used
+%   by only one thread at a time.
+%
+%   @arg Txn is a blob of type `bdb_txn`.  If the blob is garbage
+%   collected while the transaction is still open, the transaction
+%   is aborted.
+
+%!  bdb_txn_commit(+Txn) is det.
+%!  bdb_txn_commit(+Txn, +Options) is det.
+%
+%   Commit a transaction  created  by   bdb_txn_begin/3  and close  the
+%   cursors opened in it.  Options is a list holding sync(Mode), which
+%   overrules the durability given to bdb_txn_begin/3.  After this
+%   call, Txn can no longer be used.
+
+%!  bdb_txn_abort(+Txn) is det.
+%
+%   Abort a transaction created by  bdb_txn_begin/3 and close the
+%   cursors opened in it.  After this call, Txn can no longer be used.
 
 %!  bdb_version(-Version:integer) is det.
 %
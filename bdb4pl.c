@@ -49,6 +49,10 @@
 #include <string.h>
 #include <assert.h>
 #include <signal.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #ifdef O_DEBUG
 #define DEBUG(g) g
@@ -56,37 +60,106 @@
 #define DEBUG(g) (void)0
 #endif
 
+static atom_t ATOM_arg;
 static atom_t ATOM_atom;
+static atom_t ATOM_batch;
+static atom_t ATOM_bt_minkey;
 static atom_t ATOM_btree;
+static atom_t ATOM_bytes;
 static atom_t ATOM_c_blob;
+static atom_t ATOM_cache;
+static atom_t ATOM_cache_cursors;
+static atom_t ATOM_checkpoint;
+static atom_t ATOM_checkpoint_kbytes;
+static atom_t ATOM_checkpoint_minutes;
+static atom_t ATOM_chunk;
 static atom_t ATOM_c_long;
 static atom_t ATOM_c_string;
+static atom_t ATOM_clear;
 static atom_t ATOM_client_timeout;
+static atom_t ATOM_compress;
 static atom_t ATOM_config;
 static atom_t ATOM_database;
+static atom_t ATOM_decrement;
 static atom_t ATOM_default;
+static atom_t ATOM_delta;
 static atom_t ATOM_environment;
+static atom_t ATOM_exact;
+static atom_t ATOM_extent_size;
 static atom_t ATOM_false;
+static atom_t ATOM_fast;
+static atom_t ATOM_fill_percent;
+static atom_t ATOM_float;
+static atom_t ATOM_free_space;
+static atom_t ATOM_freelist_only;
+static atom_t ATOM_group_commit;
+static atom_t ATOM_h_ffactor;
+static atom_t ATOM_h_nelem;
 static atom_t ATOM_hash;
+static atom_t ATOM_heap;
 static atom_t ATOM_home;
+static atom_t ATOM_initial;
+static atom_t ATOM_int64;
+static atom_t ATOM_interval;
+static atom_t ATOM_isolation;
 static atom_t ATOM_key;
+static atom_t ATOM_lg_bsize;
+static atom_t ATOM_lg_max;
+static atom_t ATOM_lk_detect;
+static atom_t ATOM_lk_max_lockers;
+static atom_t ATOM_lk_max_locks;
+static atom_t ATOM_lk_max_objects;
+static atom_t ATOM_lock_timeout;
+static atom_t ATOM_log_archive;
+static atom_t ATOM_log_auto_remove;
+static atom_t ATOM_max;
+static atom_t ATOM_min;
+static atom_t ATOM_mp_max_openfd;
 static atom_t ATOM_mp_mmapsize;
+static atom_t ATOM_mp_ncache;
 static atom_t ATOM_mp_size;
+static atom_t ATOM_none;
+static atom_t ATOM_pages;
+static atom_t ATOM_pagesize;
+static atom_t ATOM_path;
+static atom_t ATOM_prefix;
+static atom_t ATOM_queue;
+static atom_t ATOM_range;
 static atom_t ATOM_read;
 static atom_t ATOM_recno;
+static atom_t ATOM_record_length;
+static atom_t ATOM_record_pad;
+static atom_t ATOM_run;
 static atom_t ATOM_server;
 static atom_t ATOM_server_timeout;
+static atom_t ATOM_sort;
+static atom_t ATOM_stop;
+static atom_t ATOM_sync;
 static atom_t ATOM_term;
+static atom_t ATOM_term_dict;
+static atom_t ATOM_term_ordered;
+static atom_t ATOM_timeout;
+static atom_t ATOM_trickle;
+static atom_t ATOM_trickle_percent;
 static atom_t ATOM_true;
+static atom_t ATOM_tx_max;
+static atom_t ATOM_txn;
+static atom_t ATOM_txn_timeout;
 static atom_t ATOM_type;
 static atom_t ATOM_type;
 static atom_t ATOM_unknown;
 static atom_t ATOM_update;
 static atom_t ATOM_value;
+static atom_t ATOM_wait;
+static atom_t ATOM_wrap;
+static atom_t ATOM_zlib;
 static atom_t ATOM_thread_count;
 
 static functor_t FUNCTOR_error2;
 static functor_t FUNCTOR_bdb3;
+static functor_t FUNCTOR_minus2;
+static functor_t FUNCTOR_range2;
+static functor_t FUNCTOR_bytes1;
 
 #define F_ERROR       ((u_int32_t)-1)
 #define F_UNPROCESSED ((u_int32_t)-2)
@@ -128,41 +201,118 @@ static DB_TXN *current_transaction(void);
 
 static void
 initConstants(void)
-{ ATOM_atom	      =	PL_new_atom("atom");
+{ ATOM_arg	      =	PL_new_atom("arg");
+  ATOM_atom	      =	PL_new_atom("atom");
+  ATOM_batch	      =	PL_new_atom("batch");
+  ATOM_bt_minkey      =	PL_new_atom("bt_minkey");
   ATOM_btree	      =	PL_new_atom("btree");
+  ATOM_bytes	      =	PL_new_atom("bytes");
   ATOM_c_blob	      =	PL_new_atom("c_blob");
+  ATOM_cache	      =	PL_new_atom("cache");
+  ATOM_cache_cursors  =	PL_new_atom("cache_cursors");
+  ATOM_checkpoint     =	PL_new_atom("checkpoint");
+  ATOM_checkpoint_kbytes =	PL_new_atom("checkpoint_kbytes");
+  ATOM_checkpoint_minutes =	PL_new_atom("checkpoint_minutes");
+  ATOM_chunk	      =	PL_new_atom("chunk");
   ATOM_c_long	      =	PL_new_atom("c_long");
   ATOM_c_string	      =	PL_new_atom("c_string");
+  ATOM_clear	      =	PL_new_atom("clear");
   ATOM_client_timeout =	PL_new_atom("client_timeout");
+  ATOM_compress	      =	PL_new_atom("compress");
   ATOM_config	      =	PL_new_atom("config");
   ATOM_database	      =	PL_new_atom("database");
+  ATOM_decrement      =	PL_new_atom("decrement");
   ATOM_default	      = PL_new_atom("default");
+  ATOM_delta	      =	PL_new_atom("delta");
   ATOM_environment    = PL_new_atom("environment");
+  ATOM_exact	      =	PL_new_atom("exact");
+  ATOM_extent_size    =	PL_new_atom("extent_size");
   ATOM_false	      =	PL_new_atom("false");
+  ATOM_fast	      =	PL_new_atom("fast");
+  ATOM_fill_percent   =	PL_new_atom("fill_percent");
+  ATOM_float	      =	PL_new_atom("float");
+  ATOM_free_space     =	PL_new_atom("free_space");
+  ATOM_freelist_only  =	PL_new_atom("freelist_only");
+  ATOM_group_commit   =	PL_new_atom("group_commit");
+  ATOM_h_ffactor      =	PL_new_atom("h_ffactor");
+  ATOM_h_nelem	      =	PL_new_atom("h_nelem");
   ATOM_hash	      =	PL_new_atom("hash");
+  ATOM_heap	      =	PL_new_atom("heap");
   ATOM_home	      =	PL_new_atom("home");
+  ATOM_initial	      =	PL_new_atom("initial");
+  ATOM_int64	      =	PL_new_atom("int64");
+  ATOM_interval	      =	PL_new_atom("interval");
+  ATOM_isolation      =	PL_new_atom("isolation");
   ATOM_key	      =	PL_new_atom("key");
+  ATOM_lg_bsize	      =	PL_new_atom("lg_bsize");
+  ATOM_lg_max	      =	PL_new_atom("lg_max");
+  ATOM_lk_detect      =	PL_new_atom("lk_detect");
+  ATOM_lk_max_lockers =	PL_new_atom("lk_max_lockers");
+  ATOM_lk_max_locks   =	PL_new_atom("lk_max_locks");
+  ATOM_lk_max_objects =	PL_new_atom("lk_max_objects");
+  ATOM_lock_timeout   =	PL_new_atom("lock_timeout");
+  ATOM_log_archive    =	PL_new_atom("log_archive");
+  ATOM_log_auto_remove =	PL_new_atom("log_auto_remove");
+  ATOM_max	      =	PL_new_atom("max");
+  ATOM_min	      =	PL_new_atom("min");
+  ATOM_mp_max_openfd  =	PL_new_atom("mp_max_openfd");
   ATOM_mp_mmapsize    =	PL_new_atom("mp_mmapsize");
+  ATOM_mp_ncache      =	PL_new_atom("mp_ncache");
   ATOM_mp_size	      =	PL_new_atom("mp_size");
+  ATOM_none	      =	PL_new_atom("none");
+  ATOM_pages	      =	PL_new_atom("pages");
+  ATOM_pagesize	      =	PL_new_atom("pagesize");
+  ATOM_path	      =	PL_new_atom("path");
+  ATOM_prefix	      =	PL_new_atom("prefix");
+  ATOM_queue	      =	PL_new_atom("queue");
+  ATOM_range	      =	PL_new_atom("range");
   ATOM_read	      =	PL_new_atom("read");
   ATOM_recno	      =	PL_new_atom("recno");
+  ATOM_record_length  =	PL_new_atom("record_length");
+  ATOM_record_pad     =	PL_new_atom("record_pad");
+  ATOM_run	      =	PL_new_atom("run");
   ATOM_server	      =	PL_new_atom("server");
   ATOM_server_timeout =	PL_new_atom("server_timeout");
+  ATOM_sort	      =	PL_new_atom("sort");
+  ATOM_stop	      =	PL_new_atom("stop");
+  ATOM_sync	      =	PL_new_atom("sync");
   ATOM_term	      =	PL_new_atom("term");
+  ATOM_term_dict      =	PL_new_atom("term_dict");
+  ATOM_term_ordered   =	PL_new_atom("term_ordered");
+  ATOM_timeout	      =	PL_new_atom("timeout");
+  ATOM_trickle	      =	PL_new_atom("trickle");
+  ATOM_trickle_percent =	PL_new_atom("trickle_percent");
   ATOM_true	      =	PL_new_atom("true");
+  ATOM_tx_max	      =	PL_new_atom("tx_max");
+  ATOM_txn	      =	PL_new_atom("txn");
+  ATOM_txn_timeout    =	PL_new_atom("txn_timeout");
   ATOM_type	      =	PL_new_atom("type");
   ATOM_type	      = PL_new_atom("type");
   ATOM_unknown	      =	PL_new_atom("unknown");
   ATOM_update	      =	PL_new_atom("update");
   ATOM_value	      =	PL_new_atom("value");
+  ATOM_wait	      =	PL_new_atom("wait");
+  ATOM_wrap	      =	PL_new_atom("wrap");
+  ATOM_zlib	      =	PL_new_atom("zlib");
   ATOM_thread_count   = PL_new_atom("thread_count");
 
   FUNCTOR_error2      = PL_new_functor(PL_new_atom("error"), 2);
   FUNCTOR_bdb3        = PL_new_functor(PL_new_atom("bdb"),   3);
+  FUNCTOR_minus2      = PL_new_functor(PL_new_atom("-"),     2);
+  FUNCTOR_range2      = PL_new_functor(PL_new_atom("range"), 2);
+  FUNCTOR_bytes1      = PL_new_functor(PL_new_atom("bytes"), 1);
 }
 
 static int bdb_close_env(dbenvh *env, int silent);
 static int bdb_close(dbh *db);
+static void release_association(dbh *db);
+static void stop_maint_tasks(dbenvh *env);
+static int db_status(int rval, term_t obj);
+static struct value_cache *new_value_cache(size_t max_bytes);
+static void free_value_cache(struct value_cache *vc);
+static void free_term_dict(struct term_dict *d);
+static int get_compress_method(term_t t, dbh *db);
+static int set_compression(dbh *db);
 
 		 /*******************************
 		 *     DB_ENV SYMBOL WRAPPER	*
@@ -279,6 +429,11 @@ release_db(atom_t symbol)
   { db->db = NULL;
     d->close(d, 0);
   }
+  release_association(db);
+  if ( db->vcache )
+    free_value_cache(db->vcache);
+  if ( db->dict )
+    free_term_dict(db->dict);
 
   PL_free(db);
 
@@ -342,1067 +497,7790 @@ unify_db(term_t t, dbh *db)
 }
 
 		 /*******************************
-		 *	   DATA EXCHANGE	*
+		 *     ORDER PRESERVING KEYS	*
 		 *******************************/
 
-static int
-unify_dbt(term_t t, dtype type, DBT *dbt)
-{ switch( type )
-  { case D_TERM:
-    { term_t r = PL_new_term_ref();
-
-      PL_recorded_external(dbt->data, r);
-      return PL_unify(t, r);
-    }
-    case D_ATOM:
-      return PL_unify_chars(t, PL_ATOM|REP_UTF8, dbt->size, dbt->data);
-    case D_CBLOB:
-      return PL_unify_chars(t, PL_STRING|REP_ISO_LATIN_1, dbt->size, dbt->data);
-    case D_CSTRING:
-      return PL_unify_chars(t, PL_ATOM|REP_UTF8, (size_t)-1, dbt->data);
-    case D_CLONG:
-    { long *v = dbt->data;
-      return PL_unify_integer(t, *v);
-    }
-  }
-  assert(0);
-  return FALSE;
-}
-
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The types int64, float and term_ordered   use  an encoding for which the
+bytewise comparison used by  the  default   btree  comparison  function
+follows the Prolog standard order of terms.
+
+  - Integers are stored as 8 bytes big-endian with the sign bit flipped.
+  - Floats are stored as the big-endian IEEE double.  The sign bit is
+    flipped for positive numbers and all bits are flipped for negative
+    numbers.
+  - term_ordered starts each term with a tag that follows the standard
+    order (Number < Atom < String < Compound):
+      - Numbers are compared by value, where Float < Int if they
+	compare equal. We store the float encoding, a subtag and the
+	int64 encoding for integers.  Integers above 2^53 may round
+	to the same double as a float.  If the integer is smaller than
+	its rounded value it uses a subtag that sorts before floats.
+      - Text is stored as UTF-8, where a 0-byte is escaped as 0x00 0xff,
+	followed by 0x00 0x01 (0x00 0x02 for the reserved symbol []).
+      - Compounds store the arity as 4 byte big-endian, the name as
+	text and the arguments.
+    As the encoding of a term is never a prefix of another term, the
+    bytewise order of a compound equals the standard order.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static int
-get_dbt(term_t t, dtype type, DBT *dbt)
-{ memset(dbt, 0, sizeof(*dbt));
+#define OT_NUMBER	0x10
+#define OT_ATOM		0x20
+#define OT_STRING	0x30
+#define OT_COMPOUND	0x40
 
-  switch(type)
-  { case D_TERM:
-    { size_t len;
+#define OT_INT_BELOW	0x00		/* subtags of OT_NUMBER */
+#define OT_FLOAT	0x01
+#define OT_INTEGER	0x02
 
-      dbt->data = PL_record_external(t, &len);
-      dbt->size = len;
-      return TRUE;
-    }
-    case D_ATOM:
-    { size_t len;
-      char *s;
+#define OT_TEXT_END	0x01		/* 0x00 0x01 ends text */
+#define OT_NIL_END	0x02		/* 0x00 0x02 ends [] */
+#define OT_ESC_NUL	0xff		/* 0x00 0xff is a 0-byte */
 
-      if ( PL_get_nchars(t, &len, &s,
-			 CVT_ATOM|CVT_EXCEPTION|REP_UTF8|BUF_MALLOC) )
-      { dbt->data = s;
-	dbt->size = len;
+#define SIGN_BIT ((uint64_t)1<<63)
 
-	return TRUE;
-      } else
-	return FALSE;
-    }
-    case D_CBLOB:
-    { size_t len;
-      char *s;
+typedef struct charbuf
+{ char *base;				/* malloc()ed buffer */
+  size_t size;				/* used size */
+  size_t allocated;			/* allocated size */
+} charbuf;
 
-      if ( PL_get_nchars(t, &len, &s,
-			 CVT_ATOM|CVT_STRING|CVT_EXCEPTION|
-			 REP_ISO_LATIN_1|BUF_MALLOC) )
-      { dbt->data = s;
-	dbt->size = len;
+static int
+init_charbuf(charbuf *b)
+{ b->size = 0;
+  b->allocated = 256;
+  if ( (b->base = malloc(b->allocated)) )
+    return TRUE;
 
-	return TRUE;
-      } else
-	return FALSE;
-    }
-    case D_CSTRING:
-    { size_t len;
-      char *s;
+  return PL_resource_error("memory");
+}
 
-      if ( PL_get_nchars(t, &len, &s,
-			 CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_UTF8|BUF_MALLOC) )
-      { dbt->data = s;
-	dbt->size = len+1;		/* account for terminator */
+static int
+ensure_charbuf(charbuf *b, size_t extra)
+{ if ( b->size + extra > b->allocated )
+  { size_t newsize = b->allocated ? b->allocated*2 : 256;
+    char *p;
+
+    while( b->size + extra > newsize )
+      newsize *= 2;
+    if ( !(p = realloc(b->base, newsize)) )
+      return PL_resource_error("memory");
+    b->base = p;
+    b->allocated = newsize;
+  }
 
-	return TRUE;
-      } else
-	return FALSE;
-    }
-    case D_CLONG:
-    { long v;
+  return TRUE;
+}
 
-      if ( PL_get_long_ex(t, &v) )
-      {	long *d = malloc(sizeof(long));
+static int
+add_charbuf(charbuf *b, const void *data, size_t len)
+{ if ( !ensure_charbuf(b, len) )
+    return FALSE;
+  memcpy(b->base+b->size, data, len);
+  b->size += len;
 
-	*d = v;
-	dbt->data = d;
-	dbt->size = sizeof(long);
+  return TRUE;
+}
 
-	return TRUE;
-      } else
-	return FALSE;
-    }
+static void
+free_charbuf(charbuf *b)
+{ if ( b->base )
+  { free(b->base);
+    b->base = NULL;
   }
-  assert(0);
-  return FALSE;
 }
 
 
 static void
-free_dbt(DBT *dbt, dtype type)
-{ switch ( type )
-  { case D_TERM:
-      PL_erase_external(dbt->data);
-      break;
-    case D_ATOM:
-    case D_CBLOB:
-    case D_CSTRING:
-      PL_free(dbt->data);
-      break;
-    case D_CLONG:
-      free(dbt->data);
+put_uint64_be(unsigned char *p, uint64_t v)
+{ int i;
+
+  for(i=7; i>=0; i--)
+  { p[i] = (unsigned char)(v&0xff);
+    v >>= 8;
   }
 }
 
+static uint64_t
+get_uint64_be(const unsigned char *p)
+{ uint64_t v = 0;
+  int i;
+
+  for(i=0; i<8; i++)
+    v = (v<<8) | p[i];
+
+  return v;
+}
 
 static void
-free_result_dbt(DBT *dbt)
-{ if ( dbt->flags & DB_DBT_MALLOC )
-    free(dbt->data);
+encode_int64(unsigned char *p, int64_t i)
+{ put_uint64_be(p, (uint64_t)i ^ SIGN_BIT);
 }
 
+static int64_t
+decode_int64(const unsigned char *p)
+{ return (int64_t)(get_uint64_be(p) ^ SIGN_BIT);
+}
 
-typedef struct
-{ int id;
-  const char *str;
-} err_def;
+static void
+encode_double(unsigned char *p, double f)
+{ uint64_t u;
 
-static const err_def errors[] =
-{ { DB_LOCK_DEADLOCK,	"lock_deadlock" },
-  { DB_RUNRECOVERY,	"runrecovery" },
-  { DB_NOTFOUND,	"notfound" },
-  { DB_KEYEMPTY,	"keyempty" },
-  { DB_KEYEXIST,	"keyexist" },
-  { DB_LOCK_NOTGRANTED,	"lock_notgranted" },
-  { DB_SECONDARY_BAD,	"secondary_bad" },
-  { 0,			NULL }
-};
+  memcpy(&u, &f, sizeof(u));
+  if ( (u&SIGN_BIT) )
+    u = ~u;
+  else
+    u |= SIGN_BIT;
+  put_uint64_be(p, u);
+}
 
+static double
+decode_double(const unsigned char *p)
+{ uint64_t u = get_uint64_be(p);
+  double f;
 
-static int
-db_status(int rval, term_t obj)
-{ if ( rval == 0 )
-    return TRUE;
+  if ( (u&SIGN_BIT) )
+    u ^= SIGN_BIT;
+  else
+    u = ~u;
+  memcpy(&f, &u, sizeof(f));
 
-  if ( rval < 0 )
-  { DEBUG(Sdprintf("DB error: %s\n", db_strerror(rval)));
-    return FALSE;			/* normal failure */
-  } else
-  { const char *id_str = NULL;
-    const err_def *ed;
-    term_t ex, id=0;
+  return f;
+}
 
-    for(ed=errors; ed->id; ed++)
-    { if ( ed->id == rval )
-      { id_str = ed->str;
-	break;
-      }
-    }
 
-    if ( (ex = PL_new_term_ref()) &&
-	 (id = PL_new_term_ref()) &&
-	 (id_str ? PL_unify_atom_chars(id, id_str)
-		 : PL_unify_integer(id, rval)),
-	 PL_unify_term(ex,
-		       PL_FUNCTOR, FUNCTOR_error2,
-			 PL_FUNCTOR, FUNCTOR_bdb3,
-			   PL_TERM, id,
-			   PL_CHARS, db_strerror(rval),
-			   PL_TERM, obj,
-		         PL_VARIABLE) )
-      return PL_raise_exception(ex);
+static int
+add_ordered_text(charbuf *b, const char *s, size_t len, int end)
+{ size_t i;
 
+  if ( !ensure_charbuf(b, len*2+2) )
     return FALSE;
+  for(i=0; i<len; i++)
+  { if ( s[i] == 0 )
+    { b->base[b->size++] = 0;
+      b->base[b->size++] = (char)OT_ESC_NUL;
+    } else
+      b->base[b->size++] = s[i];
   }
+  b->base[b->size++] = 0;
+  b->base[b->size++] = (char)end;
+
+  return TRUE;
 }
 
 
 static int
-db_status_db(int rval, dbh *dbh)
-{ term_t db;
-
-  if ( (db = PL_new_term_ref()) &&
-       unify_db(db, dbh) )
-    return db_status(rval, db);
+add_ordered_number(charbuf *b, term_t t)
+{ unsigned char buf[17];
+  int64_t i;
+  double f;
+
+  if ( PL_get_int64(t, &i) )
+  { f = (double)i;
+    encode_double(buf, f);
+    buf[8] = ( f >= 9223372036854775808.0 || i < (int64_t)f
+	       ? OT_INT_BELOW : OT_INTEGER );
+    encode_int64(buf+9, i);
+    return add_charbuf(b, buf, 17);
+  } else if ( PL_is_integer(t) )
+  { return PL_representation_error("int64");
+  } else if ( PL_is_float(t) && PL_get_float(t, &f) )
+  { encode_double(buf, f);
+    buf[8] = OT_FLOAT;
+    return add_charbuf(b, buf, 9);
+  }
 
-  return FALSE;
+  return PL_type_error("ordered_key", t);
 }
 
+
 static int
-db_status_env(int rval, dbenvh *db_env)
-{ term_t env;
+add_ordered_term(charbuf *b, term_t t)
+{ term_t t0 = PL_copy_term_ref(t);
+  term_t a  = PL_new_term_ref();
+  int rc = TRUE;
 
-  if ( (env = PL_new_term_ref()) &&
-       unify_dbenv(env, db_env) )
-    return db_status(rval, env);
+  for(;;)
+  { atom_t name;
+    size_t arity, len, i;
+    char *s;
+    char tag;
 
-  return FALSE;
+    if ( PL_is_variable(t0) )
+    { rc = PL_instantiation_error(t0);
+      break;
+    } else if ( PL_is_number(t0) )
+    { tag = OT_NUMBER;
+      rc = ( add_charbuf(b, &tag, 1) &&
+	     add_ordered_number(b, t0) );
+      break;
+    } else if ( PL_get_nil(t0) )
+    { tag = OT_ATOM;
+      rc = ( add_charbuf(b, &tag, 1) &&
+	     add_ordered_text(b, "[]", 2, OT_NIL_END) );
+      break;
+    } else if ( PL_is_atom(t0) || PL_is_string(t0) )
+    { tag = PL_is_atom(t0) ? OT_ATOM : OT_STRING;
+      if ( !PL_get_nchars(t0, &len, &s, CVT_ATOM|CVT_STRING|REP_UTF8) )
+      { rc = PL_type_error("ordered_key", t0);
+	break;
+      }
+      rc = ( add_charbuf(b, &tag, 1) &&
+	     add_ordered_text(b, s, len, OT_TEXT_END) );
+      break;
+    } else if ( !PL_is_dict(t0) &&
+		PL_get_compound_name_arity(t0, &name, &arity) )
+    { unsigned char ar[4];
+
+      tag = OT_COMPOUND;
+      ar[0] = (unsigned char)(arity>>24); ar[1] = (unsigned char)(arity>>16);
+      ar[2] = (unsigned char)(arity>>8);  ar[3] = (unsigned char)arity;
+      if ( !PL_atom_mbchars(name, &len, &s, REP_UTF8) )
+      { rc = PL_type_error("ordered_key", t0);
+	break;
+      }
+      if ( !add_charbuf(b, &tag, 1) ||
+	   !add_charbuf(b, ar, 4) ||
+	   !add_ordered_text(b, s, len, OT_TEXT_END) )
+      { rc = FALSE;
+	break;
+      }
+      for(i=1; i<arity; i++)
+      { _PL_get_arg(i, t0, a);
+	if ( !(rc=add_ordered_term(b, a)) )
+	  break;
+      }
+      if ( !rc )
+	break;
+      _PL_get_arg(arity, t0, t0);	/* last argument: iterate */
+    } else
+    { rc = PL_type_error("ordered_key", t0);
+      break;
+    }
+  }
+
+  PL_reset_term_refs(t0);
+  return rc;
 }
 
-static int
-db_preoptions(term_t t, dbenvh **db_env, int *type)
-{ term_t tail = PL_copy_term_ref(t);
-  term_t head = PL_new_term_ref();
 
-  while( PL_get_list(tail, head, tail) )
-  { atom_t name;
-    size_t arity;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Decoding. get_ordered_text() unescapes text into tmp and returns the end
+marker or -1 if the data is corrupt.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    if ( PL_get_name_arity(head, &name, &arity) )
-    { if ( name == ATOM_type )
-      { term_t a0 = PL_new_term_ref();
-	atom_t tp;
+static int
+get_ordered_text(const char **pp, const char *e, charbuf *tmp)
+{ const char *p = *pp;
+
+  tmp->size = 0;
+  while( p+1 < e )
+  { if ( *p == 0 )
+    { unsigned char c = (unsigned char)p[1];
+
+      if ( c == OT_ESC_NUL )
+      { if ( !add_charbuf(tmp, "", 1) )
+	  return -1;
+	p += 2;
+	continue;
+      }
+      *pp = p+2;
+      return c;
+    }
+    if ( !add_charbuf(tmp, p, 1) )
+      return -1;
+    p++;
+  }
 
-	_PL_get_arg(1, head, a0);
+  return -1;
+}
 
-	if ( !PL_get_atom_ex(a0, &tp) )
-	  return FALSE;
-	if ( tp == ATOM_btree )
-	  *type = DB_BTREE;
-	else if ( tp == ATOM_hash )
-	  *type = DB_HASH;
-	else if ( tp == ATOM_recno )
-	  *type = DB_RECNO;
-	else if ( tp == ATOM_unknown )
-	  *type = DB_UNKNOWN;
-	else
-	  return PL_domain_error("db_type", a0);
 
-	return TRUE;
-      } else if ( name == ATOM_environment )
-      { term_t a0 = PL_new_term_ref();
-	_PL_get_arg(1, head, a0);
+static int
+unify_ordered_term(const char **pp, const char *e, term_t t, charbuf *tmp)
+{ term_t t0 = PL_copy_term_ref(t);
+  term_t a  = PL_new_term_ref();
+  const char *p = *pp;
+  int rc = FALSE;
 
-	if ( !get_dbenv(a0, db_env) )
-	  return FALSE;
+  for(;;)
+  { int tag, end;
+
+    if ( p >= e )
+      break;
+    tag = (unsigned char)*p++;
+
+    switch(tag)
+    { case OT_NUMBER:
+      { const unsigned char *u = (const unsigned char*)p;
+
+	if ( p+9 <= e && u[8] == OT_FLOAT )
+	{ rc = PL_unify_float(t0, decode_double(u));
+	  p += 9;
+	} else if ( p+17 <= e &&
+		    (u[8] == OT_INTEGER || u[8] == OT_INT_BELOW) )
+	{ rc = PL_unify_int64(t0, decode_int64(u+9));
+	  p += 17;
+	}
+	goto out;
+      }
+      case OT_ATOM:
+      case OT_STRING:
+	if ( (end=get_ordered_text(&p, e, tmp)) < 0 )
+	  goto out;
+	if ( end == OT_NIL_END )
+	  rc = PL_unify_nil(t0);
+	else
+	  rc = PL_unify_chars(t0, (tag == OT_ATOM ? PL_ATOM : PL_STRING)|REP_UTF8,
+			      tmp->size, tmp->base);
+	goto out;
+      case OT_COMPOUND:
+      { const unsigned char *u = (const unsigned char*)p;
+	size_t arity, i;
+	atom_t name;
+	functor_t f;
+
+	if ( p+4 > e )
+	  goto out;
+	arity = ((size_t)u[0]<<24)|((size_t)u[1]<<16)|((size_t)u[2]<<8)|u[3];
+	p += 4;
+	if ( arity == 0 ||
+	     get_ordered_text(&p, e, tmp) != OT_TEXT_END )
+	  goto out;
+	if ( !(name = PL_new_atom_mbchars(REP_UTF8, tmp->size, tmp->base)) )
+	  goto out;
+	f = PL_new_functor(name, arity);
+	PL_unregister_atom(name);
+	if ( !PL_unify_functor(t0, f) )
+	  goto out;
+	for(i=1; i<arity; i++)
+	{ _PL_get_arg(i, t0, a);
+	  if ( !unify_ordered_term(&p, e, a, tmp) )
+	    goto out;
+	}
+	_PL_get_arg(arity, t0, t0);
+	continue;
       }
+      default:
+	goto out;
     }
   }
 
-  return TRUE;
+out:
+  *pp = p;
+  PL_reset_term_refs(t0);
+  return rc;
 }
 
 
 static int
-get_dtype(term_t t, dtype *type)
-{ atom_t a;
+unify_ordered_dbt(term_t t, const DBT *dbt)
+{ const char *p = dbt->data;
+  charbuf tmp;
+  int rc;
 
-  if ( !PL_get_atom_ex(t, &a) )
+  if ( !init_charbuf(&tmp) )
     return FALSE;
-  if ( a == ATOM_term )
-    *type = D_TERM;
-  else if ( a == ATOM_atom )
-    *type = D_ATOM;
+  rc = unify_ordered_term(&p, p+dbt->size, t, &tmp);
+  free_charbuf(&tmp);
+
+  return rc;
+}
+
+
+static int
+get_ordered_dbt(term_t t, DBT *dbt)
+{ charbuf b;
+
+  if ( !init_charbuf(&b) )
+    return FALSE;
+  if ( add_ordered_term(&b, t) )
+  { dbt->data = b.base;
+    dbt->size = (u_int32_t)b.size;
+    return TRUE;
+  }
+
+  free_charbuf(&b);
+  return FALSE;
+}
+
+
+		 /*******************************
+		 *	  TERM DICTIONARIES	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The type term_dict stores terms in  a   compact  format. Atoms and the
+name/arity of compounds are replaced by  an   id  in a dictionary that is
+shared by all records of  the   database,  integers  use a variable-length
+encoding and floats are stored as 8 bytes.  The dictionary lives in the
+sub-database Name$dict of the file holding the database Name and is kept
+in memory while the database is open.  Entries are never removed.
+
+New entries are added using their own transaction, so ids remain valid if
+the transaction of the caller  is   aborted.  Ids are allocated in order.
+If another process added the same  id,   the  put fails with DB_KEYEXIST
+and we reload the dictionary and try again.
+
+  - An entry has a 4 byte big-endian id as key.  The value is 'a'
+    followed by the UTF-8 name for atoms and 'f', the arity as a varint
+    and the UTF-8 name for compounds.
+  - A record starts with TD_FORMAT, followed by the tagged term.  Lists
+    are encoded as a sequence of cells and variables as the index of
+    their first occurrence.
+  - Terms that cannot be encoded this  way (big integers, rationals,
+    blobs, dicts and cyclic terms) start with TD_EXTERNAL, followed by
+    the PL_record_external() representation.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define TD_SUFFIX	"$dict"
+
+#define TD_FORMAT	0x01		/* tagged term */
+#define TD_EXTERNAL	0x02		/* PL_record_external() */
+
+#define TD_VAR		0x01		/* varint index */
+#define TD_ATOM		0x02		/* varint id */
+#define TD_NIL		0x03
+#define TD_INT		0x04		/* zigzag varint */
+#define TD_FLOAT	0x05		/* 8 bytes */
+#define TD_STRING	0x06		/* varint length, UTF-8 */
+#define TD_LIST		0x07		/* head, tail */
+#define TD_COMPOUND	0x08		/* varint id, arguments */
+
+#define TD_ATOM_ARITY	((size_t)-1)	/* arity of an atom entry */
+
+#define TD_INTERN	0		/* add unknown entries */
+#define TD_LOOKUP	1		/* fail on unknown entries */
+
+typedef struct td_entry
+{ atom_t	name;			/* name (registered) */
+  size_t	arity;			/* arity or TD_ATOM_ARITY */
+  functor_t	functor;		/* functor if compound */
+} td_entry;
+
+typedef struct term_dict
+{ DB	       *db;			/* Name$dict database */
+  pthread_mutex_t mutex;		/* guards the fields below */
+  td_entry     *entries;		/* entries by id */
+  size_t	count;			/* # entries */
+  size_t	allocated;		/* allocated entries */
+  u_int32_t    *table;			/* name/arity -> id+1 */
+  size_t	table_size;		/* power of 2 */
+} term_dict;
+
+typedef struct td_vars
+{ term_t       *refs;			/* variables by index */
+  size_t	count;			/* # variables */
+  size_t	allocated;		/* allocated refs */
+} td_vars;
+
+typedef struct td_encoder
+{ term_dict    *dict;			/* the dictionary */
+  charbuf      *buf;			/* output buffer */
+  td_vars	vars;			/* variables seen */
+  int		intern;			/* add unknown entries */
+  int		unknown;		/* found an unknown entry */
+  int		loaded;			/* reloaded the dictionary */
+} td_encoder;
+
+
+#define VARINT_MAX 10			/* max bytes for a 64-bit varint */
+
+static size_t
+put_varint(unsigned char *p, uint64_t v)
+{ size_t n = 0;
+
+  while( v >= 0x80 )
+  { p[n++] = (unsigned char)(v|0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+
+  return n;
+}
+
+
+static int
+add_varint(charbuf *b, uint64_t v)
+{ unsigned char buf[VARINT_MAX];
+
+  return add_charbuf(b, buf, put_varint(buf, v));
+}
+
+
+static int
+get_varint(const unsigned char **pp, const unsigned char *e, uint64_t *vp)
+{ const unsigned char *p = *pp;
+  uint64_t v = 0;
+  int shift;
+
+  for(shift=0; p < e && shift < 64; shift += 7)
+  { unsigned char c = *p++;
+
+    v |= (uint64_t)(c&0x7f) << shift;
+    if ( !(c&0x80) )
+    { *pp = p;
+      *vp = v;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+static int
+add_td_tag(charbuf *b, int tag)
+{ char c = (char)tag;
+
+  return add_charbuf(b, &c, 1);
+}
+
+
+static size_t
+td_hash(atom_t name, size_t arity)
+{ uint64_t h = ((uint64_t)name ^ ((uint64_t)arity<<7)) * 0x9e3779b97f4a7c15ULL;
+
+  return (size_t)(h>>32);
+}
+
+
+static int
+td_table_add(term_dict *d, u_int32_t id)
+{ if ( (d->count+1)*2 > d->table_size )
+  { size_t size = d->table_size ? d->table_size*2 : 256;
+    u_int32_t *t = calloc(size, sizeof(*t));
+    size_t i;
+
+    if ( !t )
+      return FALSE;
+    free(d->table);
+    d->table = t;
+    d->table_size = size;
+    for(i=0; i<d->count; i++)		/* rehash existing entries */
+    { size_t h = td_hash(d->entries[i].name, d->entries[i].arity)&(size-1);
+
+      while( t[h] )
+	h = (h+1)&(size-1);
+      t[h] = (u_int32_t)i+1;
+    }
+    if ( id < d->count )		/* already added by the rehash */
+      return TRUE;
+  }
+
+  { size_t mask = d->table_size-1;
+    size_t h = td_hash(d->entries[id].name, d->entries[id].arity)&mask;
+
+    while( d->table[h] )
+      h = (h+1)&mask;
+    d->table[h] = id+1;
+  }
+
+  return TRUE;
+}
+
+
+static int
+td_find(term_dict *d, atom_t name, size_t arity, u_int32_t *id)
+{ if ( d->table_size )
+  { size_t mask = d->table_size-1;
+    size_t h = td_hash(name, arity)&mask;
+    u_int32_t i;
+
+    while( (i=d->table[h]) )
+    { td_entry *e = &d->entries[i-1];
+
+      if ( e->name == name && e->arity == arity )
+      { *id = i-1;
+	return TRUE;
+      }
+      h = (h+1)&mask;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/* td_add_entry() takes over the reference to name */
+
+static int
+td_add_entry(term_dict *d, atom_t name, size_t arity)
+{ td_entry *e;
+
+  if ( d->count == d->allocated )
+  { size_t n = d->allocated ? d->allocated*2 : 256;
+    td_entry *p = realloc(d->entries, n*sizeof(*p));
+
+    if ( !p )
+      return FALSE;
+    d->entries = p;
+    d->allocated = n;
+  }
+
+  e = &d->entries[d->count];
+  e->name    = name;
+  e->arity   = arity;
+  e->functor = arity == TD_ATOM_ARITY ? 0 : PL_new_functor(name, arity);
+  d->count++;
+
+  return td_table_add(d, (u_int32_t)d->count-1);
+}
+
+
+static void
+td_id_key(unsigned char *k, u_int32_t id)
+{ k[0] = (unsigned char)(id>>24); k[1] = (unsigned char)(id>>16);
+  k[2] = (unsigned char)(id>>8);  k[3] = (unsigned char)id;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+td_load() reads the entries  from  the   database  that  are not in the
+dictionary.  It must be called with the mutex locked.  Returns 0 or the
+Berkeley DB error.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+td_load(term_dict *d)
+{ unsigned char kbuf[4];
+  DBC *c;
+  DBT k, v;
+  int rval;
+  u_int32_t flag = DB_SET_RANGE;
+
+  if ( (rval=d->db->cursor(d->db, NULL, &c, 0)) )
+    return rval;
+
+  td_id_key(kbuf, (u_int32_t)d->count);
+  memset(&k, 0, sizeof(k));
+  memset(&v, 0, sizeof(v));
+  k.data = kbuf;
+  k.size = sizeof(kbuf);
+  k.ulen = sizeof(kbuf);
+  k.flags = DB_DBT_USERMEM;
+  v.flags = DB_DBT_MALLOC;
+
+  while( (rval=c->c_get(c, &k, &v, flag)) == 0 )
+  { const unsigned char *p = v.data;
+    const unsigned char *e = p+v.size;
+    size_t arity = TD_ATOM_ARITY;
+    atom_t name;
+
+    flag = DB_NEXT;
+    rval = DB_NOTFOUND;			/* a hole or corrupt: stop */
+    if ( k.size == 4 &&
+	 ((u_int32_t)kbuf[0]<<24|(u_int32_t)kbuf[1]<<16|
+	  (u_int32_t)kbuf[2]<<8|kbuf[3]) == d->count &&
+	 p < e )
+    { uint64_t a = TD_ATOM_ARITY;
+
+      if ( (*p++ != 'f' || get_varint(&p, e, &a)) &&
+	   (name = PL_new_atom_mbchars(REP_UTF8, e-p, (const char*)p)) )
+      { arity = (size_t)a;
+	if ( td_add_entry(d, name, arity) )
+	  rval = 0;
+	else
+	{ PL_unregister_atom(name);
+	  rval = ENOMEM;
+	}
+      }
+    }
+    free(v.data);
+    if ( rval )
+      break;
+  }
+  c->c_close(c);
+
+  return rval == DB_NOTFOUND ? 0 : rval;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+td_intern() finds or adds the entry for name/arity.  It must be called
+with the mutex locked and returns 0 or the Berkeley DB error.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+td_intern(term_dict *d, atom_t name, size_t arity, u_int32_t *id)
+{ for(;;)
+  { unsigned char kbuf[4];
+    charbuf vb;
+    size_t len;
+    char *s;
+    DBT k, v;
+    int rval;
+
+    if ( td_find(d, name, arity, id) )
+      return 0;
+    if ( d->count >= UINT32_MAX )
+      return ENOMEM;
+    if ( !PL_atom_mbchars(name, &len, &s, REP_UTF8) )
+      return EINVAL;
+
+    vb.base = NULL; vb.size = vb.allocated = 0;
+    if ( !add_td_tag(&vb, arity == TD_ATOM_ARITY ? 'a' : 'f') ||
+	 (arity != TD_ATOM_ARITY && !add_varint(&vb, arity)) ||
+	 !add_charbuf(&vb, s, len) )
+    { free(vb.base);
+      return ENOMEM;
+    }
+
+    td_id_key(kbuf, (u_int32_t)d->count);
+    memset(&k, 0, sizeof(k));
+    memset(&v, 0, sizeof(v));
+    k.data = kbuf;
+    k.size = sizeof(kbuf);
+    v.data = vb.base;
+    v.size = (u_int32_t)vb.size;
+    rval = d->db->put(d->db, NULL, &k, &v, DB_NOOVERWRITE);
+    free(vb.base);
+
+    if ( rval == 0 )
+    { PL_register_atom(name);
+      if ( !td_add_entry(d, name, arity) )
+      { PL_unregister_atom(name);
+	return ENOMEM;
+      }
+      *id = (u_int32_t)d->count-1;
+      return 0;
+    } else if ( rval == DB_KEYEXIST )	/* added by someone else */
+    { if ( (rval=td_load(d)) )
+	return rval;
+    } else
+      return rval;
+  }
+}
+
+
+static int
+td_get(term_dict *d, uint64_t id, td_entry *e)
+{ int rc = TRUE;
+
+  pthread_mutex_lock(&d->mutex);
+  if ( id >= d->count )
+    td_load(d);
+  if ( id < d->count )
+    *e = d->entries[id];
+  else
+    rc = FALSE;
+  pthread_mutex_unlock(&d->mutex);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+td_add_id() adds the id of name/arity.  If the encoder does not intern,
+an unknown entry sets enc->unknown and writes id 0.  Entries added by
+other processes are found by reloading the dictionary once per term.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+td_add_id(td_encoder *enc, int tag, term_t t, atom_t name, size_t arity)
+{ term_dict *d = enc->dict;
+  u_int32_t id = 0;
+  int rval = 0;
+
+  pthread_mutex_lock(&d->mutex);
+  if ( enc->intern )
+  { rval = td_intern(d, name, arity, &id);
+  } else if ( !td_find(d, name, arity, &id) )
+  { if ( !enc->loaded )
+    { enc->loaded = TRUE;
+      rval = td_load(d);
+    }
+    if ( rval == 0 && !td_find(d, name, arity, &id) )
+    { enc->unknown = TRUE;
+      id = 0;
+    }
+  }
+  pthread_mutex_unlock(&d->mutex);
+
+  if ( rval )
+    return db_status(rval, t);
+
+  return add_td_tag(enc->buf, tag) && add_varint(enc->buf, id);
+}
+
+
+static int
+td_add_var(td_vars *vars, term_t v)
+{ if ( vars->count == vars->allocated )
+  { size_t n = vars->allocated ? vars->allocated*2 : 16;
+    term_t *p = realloc(vars->refs, n*sizeof(*p));
+
+    if ( !p )
+      return PL_resource_error("memory");
+    vars->refs = p;
+    vars->allocated = n;
+  }
+  vars->refs[vars->count++] = PL_copy_term_ref(v);
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Encoding.  add_td_term() returns TRUE, FALSE with an exception or -1 if
+the term must be stored as TD_EXTERNAL.  The term references are kept if
+a variable was added, as enc->vars refers to them.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+add_td_term(td_encoder *enc, term_t t)
+{ term_t t0 = PL_copy_term_ref(t);
+  term_t a  = PL_new_term_ref();
+  td_vars *vars = &enc->vars;
+  charbuf *b = enc->buf;
+  size_t nvars = vars->count;
+  int rc;
+
+  for(;;)
+  { switch(PL_term_type(t0))
+    { case PL_VARIABLE:
+      { size_t i;
+
+	for(i=0; i<vars->count; i++)
+	{ if ( PL_compare(vars->refs[i], t0) == 0 )
+	    break;
+	}
+	rc = ( (i < vars->count || td_add_var(vars, t0)) &&
+	       add_td_tag(b, TD_VAR) &&
+	       add_varint(b, i) );
+	goto out;
+      }
+      case PL_ATOM:
+      { atom_t name;
+
+	PL_get_atom(t0, &name);
+	rc = td_add_id(enc, TD_ATOM, t0, name, TD_ATOM_ARITY);
+	goto out;
+      }
+      case PL_NIL:
+	rc = add_td_tag(b, TD_NIL);
+	goto out;
+      case PL_INTEGER:
+      { int64_t i;
+
+	if ( !PL_get_int64(t0, &i) )
+	{ rc = -1;			/* big integer */
+	  goto out;
+	}
+	rc = ( add_td_tag(b, TD_INT) &&
+	       add_varint(b, ((uint64_t)i<<1) ^ (uint64_t)(i>>63)) );
+	goto out;
+      }
+      case PL_FLOAT:
+      { unsigned char buf[8];
+	double f;
+
+	PL_get_float(t0, &f);
+	encode_double(buf, f);
+	rc = ( add_td_tag(b, TD_FLOAT) &&
+	       add_charbuf(b, buf, sizeof(buf)) );
+	goto out;
+      }
+      case PL_STRING:
+      { size_t len;
+	char *s;
+
+	if ( !PL_get_nchars(t0, &len, &s, CVT_STRING|REP_UTF8) )
+	{ rc = -1;
+	  goto out;
+	}
+	rc = ( add_td_tag(b, TD_STRING) &&
+	       add_varint(b, len) &&
+	       add_charbuf(b, s, len) );
+	goto out;
+      }
+      case PL_LIST_PAIR:
+	if ( !add_td_tag(b, TD_LIST) )
+	{ rc = FALSE;
+	  goto out;
+	}
+	_PL_get_arg(1, t0, a);
+	if ( (rc=add_td_term(enc, a)) != TRUE )
+	  goto out;
+	_PL_get_arg(2, t0, t0);		/* tail: iterate */
+	continue;
+      case PL_TERM:
+      { atom_t name;
+	size_t arity, i, len;
+	char *s;
+
+	if ( !PL_get_compound_name_arity(t0, &name, &arity) ||
+	     !PL_atom_mbchars(name, &len, &s, REP_UTF8) )
+	{ rc = -1;
+	  goto out;
+	}
+	if ( !td_add_id(enc, TD_COMPOUND, t0, name, arity) )
+	{ rc = FALSE;
+	  goto out;
+	}
+	if ( arity == 0 )
+	{ rc = TRUE;
+	  goto out;
+	}
+	for(i=1; i<arity; i++)
+	{ _PL_get_arg(i, t0, a);
+	  if ( (rc=add_td_term(enc, a)) != TRUE )
+	    goto out;
+	}
+	_PL_get_arg(arity, t0, t0);	/* last argument: iterate */
+	continue;
+      }
+      default:				/* blobs, dicts, rationals */
+	rc = -1;
+	goto out;
+    }
+  }
+
+out:
+  if ( vars->count == nvars )
+    PL_reset_term_refs(t0);
+  return rc;
+}
+
+
+static int
+add_td_external(charbuf *b, term_t t)
+{ size_t len;
+  char *rec = PL_record_external(t, &len);
+  int rc;
+
+  if ( !rec )
+    return FALSE;
+  rc = ( add_td_tag(b, TD_EXTERNAL) &&
+	 add_charbuf(b, rec, len) );
+  PL_erase_external(rec);
+
+  return rc;
+}
+
+
+static int
+encode_td_term(td_encoder *enc, term_t t)
+{ fid_t fid;
+  int rc;
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+  enc->vars.count = 0;
+  if ( add_td_tag(enc->buf, TD_FORMAT) )
+    rc = add_td_term(enc, t);
+  else
+    rc = FALSE;
+  PL_close_foreign_frame(fid);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+add_dict_term() first encodes without interning.  This finds terms that
+need TD_EXTERNAL before adding entries for them.  If there are unknown
+entries and mode is TD_INTERN, the term is encoded again, adding them.
+With TD_LOOKUP, used to encode keys and values we search for, an unknown
+entry cannot be in the database and we fail silently.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+add_dict_term(term_dict *d, charbuf *b, term_t t, int mode)
+{ size_t start = b->size;
+  int rc = -1;
+
+  if ( PL_is_acyclic(t) )
+  { td_encoder enc;
+
+    memset(&enc, 0, sizeof(enc));
+    enc.dict = d;
+    enc.buf  = b;
+    rc = encode_td_term(&enc, t);
+    if ( rc == TRUE && enc.unknown )
+    { b->size = start;
+      if ( mode == TD_INTERN )
+      { enc.intern = TRUE;
+	rc = encode_td_term(&enc, t);
+      } else
+	rc = FALSE;
+    }
+    free(enc.vars.refs);
+  }
+
+  if ( rc == -1 )
+  { b->size = start;
+    return add_td_external(b, t);
+  }
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Decoding.  The term is built in a fresh term reference that is unified
+with the target by unify_dict_dbt().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+unify_td_term(term_dict *d, const unsigned char **pp, const unsigned char *e,
+	      term_t t, td_vars *vars)
+{ term_t t0 = PL_copy_term_ref(t);
+  term_t a  = PL_new_term_ref();
+  size_t nvars = vars->count;
+  const unsigned char *p = *pp;
+  int rc = FALSE;
+
+  for(;;)
+  { uint64_t v;
+    td_entry te;
+    int tag;
+
+    if ( p >= e )
+      break;
+    tag = *p++;
+
+    switch(tag)
+    { case TD_VAR:
+	if ( !get_varint(&p, e, &v) || v > vars->count )
+	  goto out;
+	if ( v == vars->count )
+	  rc = td_add_var(vars, t0);
+	else
+	  rc = PL_unify(t0, vars->refs[v]);
+	goto out;
+      case TD_ATOM:
+      case TD_COMPOUND:
+	if ( !get_varint(&p, e, &v) )
+	  goto out;
+	if ( !td_get(d, v, &te) )
+	{ term_t ex;
+
+	  rc = ( (ex=PL_new_term_ref()) &&
+		 PL_unify_uint64(ex, v) &&
+		 PL_existence_error("term_dict_entry", ex) );
+	  goto out;
+	}
+	if ( tag == TD_ATOM )
+	{ rc = ( te.arity == TD_ATOM_ARITY &&
+		 PL_unify_atom(t0, te.name) );
+	  goto out;
+	} else
+	{ size_t i;
+
+	  if ( te.arity == TD_ATOM_ARITY ||
+	       !PL_unify_compound(t0, te.functor) )
+	    goto out;
+	  if ( te.arity == 0 )
+	  { rc = TRUE;
+	    goto out;
+	  }
+	  for(i=1; i<te.arity; i++)
+	  { _PL_get_arg(i, t0, a);
+	    if ( !unify_td_term(d, &p, e, a, vars) )
+	      goto out;
+	  }
+	  _PL_get_arg(te.arity, t0, t0);
+	  continue;
+	}
+      case TD_NIL:
+	rc = PL_unify_nil(t0);
+	goto out;
+      case TD_INT:
+	if ( !get_varint(&p, e, &v) )
+	  goto out;
+	rc = PL_unify_int64(t0, (int64_t)(v>>1) ^ -(int64_t)(v&1));
+	goto out;
+      case TD_FLOAT:
+	if ( p+8 > e )
+	  goto out;
+	rc = PL_unify_float(t0, decode_double(p));
+	p += 8;
+	goto out;
+      case TD_STRING:
+	if ( !get_varint(&p, e, &v) || v > (uint64_t)(e-p) )
+	  goto out;
+	rc = PL_unify_chars(t0, PL_STRING|REP_UTF8, (size_t)v, (const char*)p);
+	p += v;
+	goto out;
+      case TD_LIST:
+	if ( !PL_unify_list(t0, a, t0) ||
+	     !unify_td_term(d, &p, e, a, vars) )
+	  goto out;
+	continue;
+      default:
+	goto out;
+    }
+  }
+
+out:
+  *pp = p;
+  if ( vars->count == nvars )
+    PL_reset_term_refs(t0);
+  return rc;
+}
+
+
+static int
+unify_dict_dbt(term_dict *d, term_t t, const DBT *dbt)
+{ const unsigned char *p = dbt->data;
+  const unsigned char *e = p+dbt->size;
+
+  if ( dbt->size > 0 && p[0] == TD_EXTERNAL )
+  { term_t r = PL_new_term_ref();
+
+    return ( PL_recorded_external((const char*)p+1, r) &&
+	     PL_unify(t, r) );
+  } else if ( dbt->size > 0 && p[0] == TD_FORMAT )
+  { term_t r = PL_new_term_ref();
+    td_vars vars = {0};
+    int rc;
+
+    p++;
+    rc = ( unify_td_term(d, &p, e, r, &vars) &&
+	   PL_unify(t, r) );
+    free(vars.refs);
+
+    return rc;
+  }
+
+  return FALSE;
+}
+
+
+static int
+get_dict_dbt(term_dict *d, term_t t, int mode, DBT *dbt)
+{ charbuf b;
+
+  if ( !init_charbuf(&b) )
+    return FALSE;
+  if ( add_dict_term(d, &b, t, mode) )
+  { dbt->data = b.base;
+    dbt->size = (u_int32_t)b.size;
+    return TRUE;
+  }
+
+  free_charbuf(&b);
+  return FALSE;
+}
+
+
+static void
+free_term_dict(term_dict *d)
+{ size_t i;
+
+  if ( d->db )
+    d->db->close(d->db, 0);
+  for(i=0; i<d->count; i++)
+    PL_unregister_atom(d->entries[i].name);
+  free(d->entries);
+  free(d->table);
+  pthread_mutex_destroy(&d->mutex);
+  free(d);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+open_term_dict() opens  the  dictionary   of  the  database  subdb in
+fname.   It  is  opened  outside  the  current  transaction  such  that
+entries added later are  not  blocked   by  its  locks.  Returns 0 or the
+Berkeley DB error.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+open_term_dict(dbh *db, const char *fname, const char *subdb,
+	       u_int32_t flags, int mode)
+{ term_dict *d;
+  char *name;
+  int rval;
+
+  if ( !(d=calloc(1, sizeof(*d))) )
+    return ENOMEM;
+  pthread_mutex_init(&d->mutex, NULL);
+  if ( !(name=malloc(strlen(subdb)+sizeof(TD_SUFFIX))) )
+  { free_term_dict(d);
+    return ENOMEM;
+  }
+  strcpy(name, subdb);
+  strcat(name, TD_SUFFIX);
+
+#ifdef DB41
+  flags &= DB_CREATE|DB_RDONLY|DB_THREAD|DB_AUTO_COMMIT;
+#else
+  flags &= DB_CREATE|DB_RDONLY|DB_THREAD;
+#endif
+  if ( (rval=db_create(&d->db, db->env->env, 0)) == 0 )
+  {
+#ifdef DB41
+    rval = d->db->open(d->db, NULL, fname, name, DB_BTREE, flags, mode);
+#else
+    rval = d->db->open(d->db, fname, name, DB_BTREE, flags, mode);
+#endif
+  } else
+    d->db = NULL;
+  free(name);
+
+  if ( rval == 0 )
+  { pthread_mutex_lock(&d->mutex);
+    rval = td_load(d);
+    pthread_mutex_unlock(&d->mutex);
+  }
+  if ( rval )
+  { free_term_dict(d);
+    return rval;
+  }
+
+  db->dict = d;
+  return 0;
+}
+
+
+
+
+		 /*******************************
+		 *	   DATA EXCHANGE	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The keys of recno and queue databases are   record numbers and those of
+heap databases are record ids. They are  not selected using key(Type),
+but set by bdb_open/4 from the type   of the database. Heap record ids
+are represented in Prolog as the integer (Page<<16)+Index.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define HEAP_RID_SIZE (sizeof(db_pgno_t)+sizeof(db_indx_t))
+
+static void
+encode_heap_rid(unsigned char *d, uint64_t rid)
+{ db_pgno_t pgno = (db_pgno_t)(rid>>16);
+  db_indx_t indx = (db_indx_t)(rid&0xffff);
+
+  memcpy(d, &pgno, sizeof(pgno));
+  memcpy(d+sizeof(pgno), &indx, sizeof(indx));
+}
+
+
+static uint64_t
+decode_heap_rid(const unsigned char *d)
+{ db_pgno_t pgno;
+  db_indx_t indx;
+
+  memcpy(&pgno, d, sizeof(pgno));
+  memcpy(&indx, d+sizeof(pgno), sizeof(indx));
+
+  return ((uint64_t)pgno<<16) + indx;
+}
+
+
+static int
+get_recno_ex(term_t t, dtype type, unsigned char *d)
+{ if ( type == D_RECNO )
+  { db_recno_t v;
+    int64_t i;
+
+    if ( !PL_get_int64_ex(t, &i) )
+      return FALSE;
+    if ( i < 1 || i > UINT32_MAX )
+      return PL_domain_error("record_number", t);
+    v = (db_recno_t)i;
+    memcpy(d, &v, sizeof(v));
+  } else
+  { int64_t i;
+
+    if ( !PL_get_int64_ex(t, &i) )
+      return FALSE;
+    if ( i < 0 || i >= ((int64_t)1<<48) )
+      return PL_domain_error("heap_record_id", t);
+    encode_heap_rid(d, (uint64_t)i);
+  }
+
+  return TRUE;
+}
+
+
+static size_t
+recno_size(dtype type)
+{ return type == D_RECNO ? sizeof(db_recno_t) : HEAP_RID_SIZE;
+}
+
+static int
+unify_dbt(term_t t, dtype type, struct term_dict *dict, DBT *dbt)
+{ switch( type )
+  { case D_TERM:
+    { term_t r = PL_new_term_ref();
+
+      PL_recorded_external(dbt->data, r);
+      return PL_unify(t, r);
+    }
+    case D_ATOM:
+      return PL_unify_chars(t, PL_ATOM|REP_UTF8, dbt->size, dbt->data);
+    case D_CBLOB:
+      return PL_unify_chars(t, PL_STRING|REP_ISO_LATIN_1, dbt->size, dbt->data);
+    case D_CSTRING:
+      return PL_unify_chars(t, PL_ATOM|REP_UTF8, (size_t)-1, dbt->data);
+    case D_CLONG:
+    { long v;				/* may be unaligned in bulk buffers */
+
+      memcpy(&v, dbt->data, sizeof(v));
+      return PL_unify_integer(t, v);
+    }
+    case D_INT64:
+      return PL_unify_int64(t, decode_int64(dbt->data));
+    case D_FLOAT:
+      return PL_unify_float(t, decode_double(dbt->data));
+    case D_TERM_ORDERED:
+      return unify_ordered_dbt(t, dbt);
+    case D_TERM_DICT:
+      return unify_dict_dbt(dict, t, dbt);
+    case D_RECNO:
+    { db_recno_t v;
+
+      memcpy(&v, dbt->data, sizeof(v));
+      return PL_unify_uint64(t, v);
+    }
+    case D_HEAP_RID:
+      return PL_unify_uint64(t, decode_heap_rid(dbt->data));
+  }
+  assert(0);
+  return FALSE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+encode_dbt() encodes t as type.  Mode is TD_INTERN to encode data that is
+stored or TD_LOOKUP for data we only search for.   Using  TD_LOOKUP, the
+call fails silently if t uses an atom or functor that is not in the
+dictionary of a term_dict database, so lookups do not modify it.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+encode_dbt(term_t t, dtype type, struct term_dict *dict, int mode, DBT *dbt)
+{ memset(dbt, 0, sizeof(*dbt));
+
+  switch(type)
+  { case D_TERM:
+    { size_t len;
+
+      dbt->data = PL_record_external(t, &len);
+      dbt->size = len;
+      return TRUE;
+    }
+    case D_ATOM:
+    { size_t len;
+      char *s;
+
+      if ( PL_get_nchars(t, &len, &s,
+			 CVT_ATOM|CVT_EXCEPTION|REP_UTF8|BUF_MALLOC) )
+      { dbt->data = s;
+	dbt->size = len;
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_CBLOB:
+    { size_t len;
+      char *s;
+
+      if ( PL_get_nchars(t, &len, &s,
+			 CVT_ATOM|CVT_STRING|CVT_EXCEPTION|
+			 REP_ISO_LATIN_1|BUF_MALLOC) )
+      { dbt->data = s;
+	dbt->size = len;
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_CSTRING:
+    { size_t len;
+      char *s;
+
+      if ( PL_get_nchars(t, &len, &s,
+			 CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_UTF8|BUF_MALLOC) )
+      { dbt->data = s;
+	dbt->size = len+1;		/* account for terminator */
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_CLONG:
+    { long v;
+
+      if ( PL_get_long_ex(t, &v) )
+      {	long *d = malloc(sizeof(long));
+
+	*d = v;
+	dbt->data = d;
+	dbt->size = sizeof(long);
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_INT64:
+    { int64_t v;
+
+      if ( PL_get_int64_ex(t, &v) )
+      { unsigned char *d = malloc(sizeof(v));
+
+	encode_int64(d, v);
+	dbt->data = d;
+	dbt->size = sizeof(v);
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_FLOAT:
+    { double v;
+
+      if ( PL_get_float_ex(t, &v) )
+      { unsigned char *d = malloc(sizeof(v));
+
+	encode_double(d, v);
+	dbt->data = d;
+	dbt->size = sizeof(v);
+
+	return TRUE;
+      } else
+	return FALSE;
+    }
+    case D_TERM_ORDERED:
+      return get_ordered_dbt(t, dbt);
+    case D_TERM_DICT:
+      return get_dict_dbt(dict, t, mode, dbt);
+    case D_RECNO:
+    case D_HEAP_RID:
+    { unsigned char *d = malloc(HEAP_RID_SIZE);
+
+      if ( !d )
+	return PL_resource_error("memory");
+      if ( get_recno_ex(t, type, d) )
+      { dbt->data = d;
+	dbt->size = (u_int32_t)recno_size(type);
+
+	return TRUE;
+      }
+      free(d);
+      return FALSE;
+    }
+  }
+  assert(0);
+  return FALSE;
+}
+
+
+static int
+get_dbt(term_t t, dtype type, struct term_dict *dict, DBT *dbt)
+{ return encode_dbt(t, type, dict, TD_INTERN, dbt);
+}
+
+
+static int
+lookup_dbt(term_t t, dtype type, struct term_dict *dict, DBT *dbt)
+{ return encode_dbt(t, type, dict, TD_LOOKUP, dbt);
+}
+
+
+static void
+free_dbt(DBT *dbt, dtype type)
+{ switch ( type )
+  { case D_TERM:
+      PL_erase_external(dbt->data);
+      break;
+    case D_ATOM:
+    case D_CBLOB:
+    case D_CSTRING:
+      PL_free(dbt->data);
+      break;
+    case D_CLONG:
+    case D_INT64:
+    case D_FLOAT:
+    case D_TERM_ORDERED:
+    case D_TERM_DICT:
+    case D_RECNO:
+    case D_HEAP_RID:
+      free(dbt->data);
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+encode_dbt_buf() is encode_dbt() for deterministic calls. It encodes the
+term into the buffer b, which  is  reused   by  the  next call, so the
+steady state does not allocate memory.   The  DBT must be released using
+free_dbt_buf(), which only needs to do work for D_TERM.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+encode_dbt_buf(term_t t, dtype type, struct term_dict *dict, int mode,
+	       DBT *dbt, charbuf *b)
+{ b->size = 0;
+
+  switch(type)
+  { case D_TERM:
+      return encode_dbt(t, type, dict, mode, dbt);
+    case D_ATOM:
+    case D_CBLOB:
+    case D_CSTRING:
+    { size_t len;
+      char *s;
+      int flags;
+
+      if ( type == D_ATOM )
+	flags = CVT_ATOM|CVT_EXCEPTION|REP_UTF8;
+      else if ( type == D_CBLOB )
+	flags = CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_ISO_LATIN_1;
+      else
+	flags = CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_UTF8;
+
+      if ( !PL_get_nchars(t, &len, &s, flags|BUF_DISCARDABLE) ||
+	   !add_charbuf(b, s, type == D_CSTRING ? len+1 : len) )
+	return FALSE;
+      break;
+    }
+    case D_CLONG:
+    { long v;
+
+      if ( !PL_get_long_ex(t, &v) ||
+	   !add_charbuf(b, &v, sizeof(v)) )
+	return FALSE;
+      break;
+    }
+    case D_INT64:
+    { int64_t v;
+      unsigned char d[sizeof(v)];
+
+      if ( !PL_get_int64_ex(t, &v) )
+	return FALSE;
+      encode_int64(d, v);
+      if ( !add_charbuf(b, d, sizeof(d)) )
+	return FALSE;
+      break;
+    }
+    case D_FLOAT:
+    { double v;
+      unsigned char d[sizeof(v)];
+
+      if ( !PL_get_float_ex(t, &v) )
+	return FALSE;
+      encode_double(d, v);
+      if ( !add_charbuf(b, d, sizeof(d)) )
+	return FALSE;
+      break;
+    }
+    case D_TERM_ORDERED:
+      if ( !add_ordered_term(b, t) )
+	return FALSE;
+      break;
+    case D_TERM_DICT:
+      if ( !add_dict_term(dict, b, t, mode) )
+	return FALSE;
+      break;
+    case D_RECNO:
+    case D_HEAP_RID:
+    { unsigned char d[HEAP_RID_SIZE];
+
+      if ( !get_recno_ex(t, type, d) ||
+	   !add_charbuf(b, d, recno_size(type)) )
+	return FALSE;
+      break;
+    }
+  }
+
+  memset(dbt, 0, sizeof(*dbt));
+  dbt->data = b->base;
+  dbt->size = (u_int32_t)b->size;
+
+  return TRUE;
+}
+
+
+static int
+get_dbt_buf(term_t t, dtype type, struct term_dict *dict,
+	    DBT *dbt, charbuf *b)
+{ return encode_dbt_buf(t, type, dict, TD_INTERN, dbt, b);
+}
+
+
+static int
+lookup_dbt_buf(term_t t, dtype type, struct term_dict *dict,
+	       DBT *dbt, charbuf *b)
+{ return encode_dbt_buf(t, type, dict, TD_LOOKUP, dbt, b);
+}
+
+
+static void
+free_dbt_buf(DBT *dbt, dtype type)
+{ if ( type == D_TERM )
+    PL_erase_external(dbt->data);
+}
+
+
+static void
+free_result_dbt(DBT *dbt)
+{ if ( dbt->flags & DB_DBT_MALLOC )
+    free(dbt->data);
+}
+
+
+typedef struct
+{ int id;
+  const char *str;
+} err_def;
+
+static const err_def errors[] =
+{ { DB_LOCK_DEADLOCK,	"lock_deadlock" },
+  { DB_RUNRECOVERY,	"runrecovery" },
+  { DB_NOTFOUND,	"notfound" },
+  { DB_KEYEMPTY,	"keyempty" },
+  { DB_KEYEXIST,	"keyexist" },
+  { DB_LOCK_NOTGRANTED,	"lock_notgranted" },
+  { DB_SECONDARY_BAD,	"secondary_bad" },
+  { 0,			NULL }
+};
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Berkeley DB errors are negative and most of them, such as DB_NOTFOUND,
+simply mean  failure.   DB_LOCK_DEADLOCK   and  DB_LOCK_NOTGRANTED  are
+raised as an exception because  the   enclosing  transaction must be
+aborted and may be retried. See bdb_transaction/3.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+db_status(int rval, term_t obj)
+{ if ( rval == 0 )
+    return TRUE;
+
+  if ( rval < 0 && rval != DB_LOCK_DEADLOCK && rval != DB_LOCK_NOTGRANTED )
+  { DEBUG(Sdprintf("DB error: %s\n", db_strerror(rval)));
+    return FALSE;			/* normal failure */
+  } else
+  { const char *id_str = NULL;
+    const err_def *ed;
+    term_t ex, id=0;
+
+    for(ed=errors; ed->id; ed++)
+    { if ( ed->id == rval )
+      { id_str = ed->str;
+	break;
+      }
+    }
+
+    if ( (ex = PL_new_term_ref()) &&
+	 (id = PL_new_term_ref()) &&
+	 (id_str ? PL_unify_atom_chars(id, id_str)
+		 : PL_unify_integer(id, rval)),
+	 PL_unify_term(ex,
+		       PL_FUNCTOR, FUNCTOR_error2,
+			 PL_FUNCTOR, FUNCTOR_bdb3,
+			   PL_TERM, id,
+			   PL_CHARS, db_strerror(rval),
+			   PL_TERM, obj,
+		         PL_VARIABLE) )
+      return PL_raise_exception(ex);
+
+    return FALSE;
+  }
+}
+
+
+static int
+db_status_db(int rval, dbh *dbh)
+{ term_t db;
+
+  if ( (db = PL_new_term_ref()) &&
+       unify_db(db, dbh) )
+    return db_status(rval, db);
+
+  return FALSE;
+}
+
+static int
+db_status_env(int rval, dbenvh *db_env)
+{ term_t env;
+
+  if ( (env = PL_new_term_ref()) &&
+       unify_dbenv(env, db_env) )
+    return db_status(rval, env);
+
+  return FALSE;
+}
+
+static int
+db_preoptions(term_t t, dbenvh **db_env, int *type)
+{ term_t tail = PL_copy_term_ref(t);
+  term_t head = PL_new_term_ref();
+
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( PL_get_name_arity(head, &name, &arity) )
+    { if ( name == ATOM_type )
+      { term_t a0 = PL_new_term_ref();
+	atom_t tp;
+
+	_PL_get_arg(1, head, a0);
+
+	if ( !PL_get_atom_ex(a0, &tp) )
+	  return FALSE;
+	if ( tp == ATOM_btree )
+	  *type = DB_BTREE;
+	else if ( tp == ATOM_hash )
+	  *type = DB_HASH;
+	else if ( tp == ATOM_recno )
+	  *type = DB_RECNO;
+	else if ( tp == ATOM_queue )
+	  *type = DB_QUEUE;
+#ifdef DB52
+	else if ( tp == ATOM_heap )
+	  *type = DB_HEAP;
+#endif
+	else if ( tp == ATOM_unknown )
+	  *type = DB_UNKNOWN;
+	else
+	  return PL_domain_error("db_type", a0);
+
+	return TRUE;
+      } else if ( name == ATOM_environment )
+      { term_t a0 = PL_new_term_ref();
+	_PL_get_arg(1, head, a0);
+
+	if ( !get_dbenv(a0, db_env) )
+	  return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+
+/* Get a timeout in seconds as microseconds */
+
+static int
+get_timeout(term_t t, db_timeout_t *tmo)
+{ double secs;
+
+  if ( !PL_get_float_ex(t, &secs) )
+    return FALSE;
+  if ( secs < 0.0 || secs*1000000.0 > (double)UINT32_MAX )
+    return PL_domain_error("bdb_timeout", t),FALSE;
+
+  *tmo = (db_timeout_t)(secs*1000000.0);
+  return TRUE;
+}
+
+
+static int
+get_u32_ex(term_t t, u_int32_t *v)
+{ size_t sz;
+
+  if ( !PL_get_size_ex(t, &sz) )
+    return FALSE;
+  if ( sz > UINT32_MAX )
+    return PL_representation_error("uint32"),FALSE;
+
+  *v = (u_int32_t)sz;
+  return TRUE;
+}
+
+
+static int
+get_dtype(term_t t, dtype *type)
+{ atom_t a;
+
+  if ( !PL_get_atom_ex(t, &a) )
+    return FALSE;
+  if ( a == ATOM_term )
+    *type = D_TERM;
+  else if ( a == ATOM_atom )
+    *type = D_ATOM;
   else if ( a == ATOM_c_blob )
     *type = D_CBLOB;
   else if ( a == ATOM_c_string )
     *type = D_CSTRING;
   else if ( a == ATOM_c_long )
     *type = D_CLONG;
+  else if ( a == ATOM_int64 )
+    *type = D_INT64;
+  else if ( a == ATOM_float )
+    *type = D_FLOAT;
+  else if ( a == ATOM_term_ordered )
+    *type = D_TERM_ORDERED;
+  else if ( a == ATOM_term_dict )
+    *type = D_TERM_DICT;
+  else
+    return PL_domain_error("type", t);
+
+  return TRUE;
+}
+
+
+/* Flags for DB->open() */
+
+static db_flag db_open_flags[] =
+{ { "auto_commit",	DB_AUTO_COMMIT,	     0 },
+  { "create",		DB_CREATE,	     0 },
+  { "excl",		DB_EXCL,	     0 },
+  { "multiversion",	DB_MULTIVERSION,     0 },
+  { "nommap",		DB_NOMMAP,	     0 },
+  { "rdonly",		DB_RDONLY,	     0 },
+  { "read_uncommitted",	DB_READ_UNCOMMITTED, 0 },
+  { "thread",		DB_THREAD,	     0 },
+  { "truncate",		DB_TRUNCATE,	     0 },
+  { NULL,		0,		     0 },
+};
+
+/* Flags for DB->set_flags() */
+
+static db_flag db_flags[] =
+{ { "dup",		DB_DUP,		     0 },
+  { "duplicates",	DB_DUP,		     0 }, /* compatibility */
+  { "dupsort",		DB_DUPSORT,	     0 },
+  { NULL,		0,		     0 },
+};
+
+
+static int
+db_options(term_t t, dbh *dbh, char **subdb, u_int32_t *open_flags)
+{ term_t tail = PL_copy_term_ref(t);
+  term_t head = PL_new_term_ref();
+  int flags = 0;
+
+  dbh->key_type   = D_TERM;
+  dbh->value_type = D_TERM;
+
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( PL_get_name_arity(head, &name, &arity) )
+    { if ( arity == 1 )
+      { term_t a0 = PL_new_term_ref();
+
+	_PL_get_arg(1, head, a0);
+	if ( name == ATOM_database )
+	{ if ( !PL_get_chars(a0, subdb,
+			     CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_UTF8) )
+	    return FALSE;
+	} else if ( name == ATOM_key )
+	{ if ( !get_dtype(a0, &dbh->key_type) )
+	    return FALSE;
+	} else if ( name == ATOM_value )
+	{ if ( !get_dtype(a0, &dbh->value_type) )
+	    return FALSE;
+	} else if ( name == ATOM_cache )
+	{ int64_t v;
+
+	  if ( !PL_get_int64_ex(a0, &v) )
+	    return FALSE;
+	  if ( v < 0 )
+	    return PL_domain_error("not_less_than_zero", a0);
+	  if ( dbh->vcache )
+	  { free_value_cache(dbh->vcache);
+	    dbh->vcache = NULL;
+	  }
+	  if ( v > 0 && !(dbh->vcache=new_value_cache((size_t)v)) )
+	    return PL_resource_error("memory");
+	} else if ( name == ATOM_compress )
+	{ if ( !get_compress_method(a0, dbh) )
+	    return FALSE;
+	} else if ( name == ATOM_cache_cursors )
+	{ int v;
+
+	  if ( !PL_get_bool_ex(a0, &v) )
+	    return FALSE;
+	  dbh->cache_cursors = v;
+	} else if ( name == ATOM_pagesize || name == ATOM_bt_minkey ||
+		    name == ATOM_h_ffactor || name == ATOM_h_nelem ||
+		    name == ATOM_record_length || name == ATOM_record_pad ||
+		    name == ATOM_extent_size )
+	{ DB *db = dbh->db;
+	  u_int32_t v;
+	  int rval;
+
+	  if ( !get_u32_ex(a0, &v) )
+	    return FALSE;
+	  if ( name == ATOM_pagesize )
+	    rval = db->set_pagesize(db, v);
+	  else if ( name == ATOM_bt_minkey )
+	    rval = db->set_bt_minkey(db, v);
+	  else if ( name == ATOM_h_ffactor )
+	    rval = db->set_h_ffactor(db, v);
+	  else if ( name == ATOM_record_length )
+	    rval = db->set_re_len(db, v);
+	  else if ( name == ATOM_record_pad )
+	    rval = db->set_re_pad(db, (int)v);
+	  else if ( name == ATOM_extent_size )
+	    rval = db->set_q_extentsize(db, v);
+	  else
+	    rval = db->set_h_nelem(db, v);
+	  if ( rval )
+	    return db_status_db(rval, dbh);
+	} else if ( name == ATOM_type || name == ATOM_environment )
+	{  ;  /* type(_) and environment() are handled by db_preoptions */
+	} else
+	{ u_int32_t fv;
+
+	  if ( (fv=lookup_flag(db_open_flags, name, a0)) != F_UNPROCESSED )
+	  { if ( fv == F_ERROR )
+	      return FALSE;
+	    *open_flags |= fv;
+	    continue;
+	  }
+
+	  fv = lookup_flag(db_flags, name, a0);
+	  switch(fv)
+	  { case F_ERROR:
+	      return FALSE;
+	    case F_UNPROCESSED:
+	      return PL_domain_error("db_option", head);
+	    default:
+	      flags |= fv;
+	  }
+	}
+      } else
+	return PL_type_error("db_option", head);
+    }
+  }
+
+  if ( !PL_get_nil_ex(tail) )
+    return FALSE;
+
+  if ( flags )
+  { int rval;
+
+    if ( (rval=dbh->db->set_flags(dbh->db, flags)) )
+      return db_status_db(rval, dbh);
+    dbh->flags = flags;
+  }
+  if ( dbh->vcache && (flags&(DB_DUP|DB_DUPSORT)) )
+    return PL_permission_error("cache", "duplicate_database", t);
+  if ( dbh->compress != C_NONE )
+  { int rval;
+
+    if ( (rval=set_compression(dbh)) )
+      return db_status_db(rval, dbh);
+  }
+
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+verify that an environment that is not  initialized for threading is not
+accessed from multiple threads. Not sure whether or not an uninitialized
+default environment can be accessed from multiple threads.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+check_same_thread(dbenvh *env)
+{ if ( (env->flags&DB_THREAD) || env->thread == PL_thread_self() )
+  { return TRUE;
+  } else if ( env == &default_env && !env->thread )
+  { env->thread = PL_thread_self();
+    return TRUE;
+  } else
+  { term_t e;
+
+    if ( (e = PL_new_term_ref()) &&
+	 unify_dbenv(e, env) )
+      return PL_permission_error("access", "bdb_environment", e);
+    return FALSE;
+  }
+}
+
+
+static foreign_t
+pl_bdb_open(term_t file, term_t mode, term_t handle, term_t options)
+{ char *fname;
+  u_int32_t flags;
+  int m = 0666;
+  int type = DB_BTREE;
+  dbh *dbh;
+  atom_t a;
+  int rval;
+  char *subdb = NULL;
+  dbenvh *env = &default_env;
+
+  if ( !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
+    return FALSE;
+
+  if ( !PL_get_atom_ex(mode, &a) )		/* process mode */
+    return FALSE;
+  if ( a == ATOM_read )
+    flags = DB_RDONLY;
+  else if ( a == ATOM_update )
+    flags = DB_CREATE;
+  else
+    return PL_domain_error("io_mode", mode);
+
+  if ( !db_preoptions(options, &env, &type) ||
+       !check_same_thread(env) )
+    return FALSE;
+
+  dbh = calloc(1, sizeof(*dbh));
+  dbh->magic = DBH_MAGIC;
+  dbh->env   = env;
+  NOSIG(rval=db_create(&dbh->db, env->env, 0));
+  if ( rval )
+  { dbh->db = NULL;
+    dbh->symbol = 0;
+    return db_status(rval, file);
+  }
+
+  DEBUG(Sdprintf("New DB at %p\n", dbh->db));
+
+  if ( !db_options(options, dbh, &subdb, &flags) )
+  { bdb_close(dbh);
+    return FALSE;
+  }
+  if ( (dbh->key_type == D_TERM_DICT || dbh->value_type == D_TERM_DICT) &&
+       !subdb )
+  { term_t ex;
+
+    bdb_close(dbh);
+    return ( (ex=PL_new_term_ref()) &&
+	     PL_put_atom(ex, ATOM_database) &&
+	     PL_existence_error("option", ex) );
+  }
+
+#ifdef DB41
+  if ( (env->flags&DB_INIT_TXN) )
+    flags |= DB_AUTO_COMMIT;
+  NOSIG(rval=dbh->db->open(dbh->db, TheTXN, fname, subdb, type, flags, m));
+#else
+  NOSIG(rval=dbh->db->open(dbh->db, fname, subdb, type, flags, m));
+#endif
+
+  if ( rval )
+  { bdb_close(dbh);
+    return db_status_db(rval, dbh);
+  }
+
+  if ( type == DB_UNKNOWN )		/* opened existing database */
+  { DBTYPE t;
+
+#ifdef DB43
+    if ( dbh->db->get_type(dbh->db, &t) == 0 )
+      type = t;
+#else
+    type = t = dbh->db->get_type(dbh->db);
+#endif
+  }
+  dbh->type = type;
+  switch(type)				/* keys are record numbers */
+  { case DB_RECNO:
+    case DB_QUEUE:
+      dbh->key_type = D_RECNO;
+      break;
+#ifdef DB52
+    case DB_HEAP:
+      dbh->key_type = D_HEAP_RID;
+      break;
+#endif
+    default:
+      break;
+  }
+
+  if ( dbh->key_type == D_TERM_DICT || dbh->value_type == D_TERM_DICT )
+  { if ( (rval=open_term_dict(dbh, fname, subdb, flags, m)) )
+    { bdb_close(dbh);
+      return db_status(rval, file);
+    }
+  }
+
+  return unify_db(handle, dbh);
+}
+
+
+static void close_db_cursors(dbh *db);
+static void close_cached_cursors(dbh *db);
+
+static int
+bdb_close(dbh *db)
+{ int rval;
+
+  close_db_cursors(db);
+  close_cached_cursors(db);
+  DEBUG(Sdprintf("Close DB at %p\n", db->db));
+  NOSIG(rval = db->db->close(db->db, 0);
+	db->db = NULL;
+	db->symbol = 0);
+  release_association(db);
+  if ( db->vcache )
+  { free_value_cache(db->vcache);
+    db->vcache = NULL;
+  }
+  if ( db->dict )
+  { free_term_dict(db->dict);
+    db->dict = NULL;
+  }
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_close(term_t handle)
+{ dbh *db;
+
+  if ( get_db(handle, &db) )
+  { if ( !db->db || !db->symbol )
+      return PL_existence_error("db", handle);
+    return db_status(bdb_close(db), handle);
+  }
+
+  return FALSE;
+}
+
+static foreign_t
+pl_bdb_is_open(term_t t)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &db_blob)
+  { dbh *p = data;
+
+    if ( p->db && p->symbol )
+      return TRUE;
+
+    return FALSE;
+  }
+
+  return PL_type_error("db", t);
+}
+
+
+		 /*******************************
+		 *	      METRICS		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If metrics are enabled using bdb_enable_metrics/1, the calls to Berkeley
+DB wrapped in METERED() record their latency in an op_metrics structure
+of the database or, for commits,   the environment. The latency is added
+to a histogram with log2  buckets  in   microseconds.  The  counters are
+updated using relaxed atomic additions; the maximum is updated without
+synchronization and may miss a concurrent  update. If metrics are
+disabled, METERED() only tests metrics_enabled.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int metrics_enabled = FALSE;
+
+#ifdef __GNUC__
+#define ATOMIC_ADD(ptr, v) __atomic_fetch_add(ptr, v, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_ADD(ptr, v) (*(ptr) += (v))
+#endif
+
+#define METERED(m, code) \
+	{ uint64_t t0_ = metrics_enabled ? now_ns() : 0; \
+	  code; \
+	  if ( t0_ ) record_latency(m, t0_); \
+	}
+
+static uint64_t
+now_ns(void)
+{ struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+static void
+record_latency(op_metrics *m, uint64_t t0)
+{ uint64_t ns = now_ns() - t0;
+  uint64_t us = ns/1000;
+  int b = 0;
+
+  while( us && b < METRIC_BUCKETS-1 )
+  { us >>= 1;
+    b++;
+  }
+
+  ATOMIC_ADD(&m->count, 1);
+  ATOMIC_ADD(&m->total, ns);
+  ATOMIC_ADD(&m->buckets[b], 1);
+  if ( ns > m->max )
+    m->max = ns;
+}
+
+
+static foreign_t
+pl_bdb_enable_metrics(term_t enable)
+{ int v;
+
+  if ( !PL_get_bool_ex(enable, &v) )
+    return FALSE;
+  metrics_enabled = v;
+
+  return TRUE;
+}
+
+
+		 /*******************************
+		 *	    COMPRESSION		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The option compress(Method) of bdb_open/4  uses the btree compression of
+Berkeley DB (4.8 and later), which  compresses   the  encoded keys and
+values, so it works for all key and value types.
+
+  - prefix uses the default compression of Berkeley DB, which stores
+    the prefix shared with the previous key (and value for duplicates)
+    as a length.
+  - zlib(MinSize) stores the prefix shared with the previous key as a
+    length and compresses values of at  least MinSize bytes using zlib.
+    The entry is a flags byte, the key prefix length and suffix length as
+    varints, the key suffix, the value length and, if CZ_ZLIB is set,
+    the compressed length as varints, followed by the value bytes.
+
+As Berkeley DB recompresses a chunk of entries if it is modified, the
+statistics count calls to the compression function rather than stored
+values.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define CZ_ZLIB		0x01		/* value is zlib compressed */
+#define CZ_DEFAULT_MIN	128		/* default for compress(zlib) */
+
+#if defined(DB48) && defined(HAVE_ZLIB)
+
+static int
+zlib_compress(DB *dbp, const DBT *prev_key, const DBT *prev_data,
+	      const DBT *key, const DBT *data, DBT *dest)
+{ dbh *db = dbp->app_private;
+  const unsigned char *k = key->data;
+  unsigned char hdr[1+4*VARINT_MAX];
+  unsigned char *z = NULL;
+  uLongf zlen = 0;
+  u_int32_t prefix = 0;
+  size_t n = 0, size;
+  int flags = 0;
+  int rval = 0;
+
+  if ( prev_key )
+  { const unsigned char *pk = prev_key->data;
+    u_int32_t max = prev_key->size < key->size ? prev_key->size : key->size;
+
+    while( prefix < max && pk[prefix] == k[prefix] )
+      prefix++;
+  }
+
+  if ( data->size >= db->compress_min )
+  { zlen = compressBound(data->size);
+    if ( (z=malloc(zlen)) &&
+	 compress(z, &zlen, data->data, data->size) == Z_OK &&
+	 zlen < data->size )
+      flags |= CZ_ZLIB;
+  }
+
+  hdr[n++] = (unsigned char)flags;
+  n += put_varint(hdr+n, prefix);
+  n += put_varint(hdr+n, key->size-prefix);
+  n += put_varint(hdr+n, data->size);
+  if ( (flags&CZ_ZLIB) )
+    n += put_varint(hdr+n, zlen);
+  size = n + (key->size-prefix) + ((flags&CZ_ZLIB) ? zlen : data->size);
+
+  if ( size > dest->ulen )
+  { dest->size = (u_int32_t)size;
+    rval = DB_BUFFER_SMALL;
+  } else
+  { unsigned char *d = dest->data;
+
+    memcpy(d, hdr, n);
+    d += n;
+    memcpy(d, k+prefix, key->size-prefix);
+    d += key->size-prefix;
+    if ( (flags&CZ_ZLIB) )
+    { memcpy(d, z, zlen);
+      ATOMIC_ADD(&db->compress_stats.values, 1);
+      ATOMIC_ADD(&db->compress_stats.raw_bytes, data->size);
+      ATOMIC_ADD(&db->compress_stats.bytes, zlen);
+    } else
+    { memcpy(d, data->data, data->size);
+    }
+    dest->size = (u_int32_t)size;
+  }
+
+  free(z);
+  return rval;
+}
+
+
+static int
+zlib_decompress(DB *dbp, const DBT *prev_key, const DBT *prev_data,
+		DBT *compressed, DBT *key, DBT *data)
+{ const unsigned char *p = compressed->data;
+  const unsigned char *e = p+compressed->size;
+  uint64_t prefix, ksize, dsize, zsize = 0, stored;
+  int flags;
+
+  if ( p >= e )
+    return EINVAL;
+  flags = *p++;
+  if ( !get_varint(&p, e, &prefix) ||
+       !get_varint(&p, e, &ksize) ||
+       !get_varint(&p, e, &dsize) ||
+       ((flags&CZ_ZLIB) && !get_varint(&p, e, &zsize)) )
+    return EINVAL;
+  stored = (flags&CZ_ZLIB) ? zsize : dsize;
+  if ( prefix > (prev_key ? prev_key->size : 0) ||
+       ksize > (uint64_t)(e-p) ||
+       stored > (uint64_t)(e-p)-ksize )
+    return EINVAL;
+
+  key->size  = (u_int32_t)(prefix+ksize);
+  data->size = (u_int32_t)dsize;
+  if ( key->size > key->ulen || data->size > data->ulen )
+    return DB_BUFFER_SMALL;
+
+  if ( prefix )
+    memcpy(key->data, prev_key->data, prefix);
+  memcpy((char*)key->data+prefix, p, ksize);
+  p += ksize;
+  if ( (flags&CZ_ZLIB) )
+  { uLongf len = (uLongf)dsize;
+
+    if ( uncompress(data->data, &len, p, (uLong)zsize) != Z_OK ||
+	 len != dsize )
+      return EINVAL;
+  } else
+  { memcpy(data->data, p, dsize);
+  }
+  p += stored;
+  compressed->size = (u_int32_t)(p - (const unsigned char*)compressed->data);
+
+  return 0;
+}
+
+#endif /*DB48 && HAVE_ZLIB*/
+
+
+static int
+get_compress_method(term_t t, dbh *db)
+{ atom_t name;
+  size_t arity;
+
+  if ( PL_get_name_arity(t, &name, &arity) )
+  { if ( arity == 0 && name == ATOM_none )
+    { db->compress = C_NONE;
+      return TRUE;
+    } else if ( arity == 0 && name == ATOM_prefix )
+    { db->compress = C_PREFIX;
+      return TRUE;
+    } else if ( name == ATOM_zlib && arity <= 1 )
+    { db->compress = C_ZLIB;
+      db->compress_min = CZ_DEFAULT_MIN;
+      if ( arity == 1 )
+      { term_t a = PL_new_term_ref();
+
+	_PL_get_arg(1, t, a);
+	return get_u32_ex(a, &db->compress_min);
+      }
+      return TRUE;
+    }
+  }
+
+  return PL_domain_error("compress_method", t);
+}
+
+
+/* set_compression() must be called before the database is opened.
+   Returns 0 or the Berkeley DB error.
+*/
+
+static int
+set_compression(dbh *db)
+{ switch(db->compress)
+  { case C_NONE:
+      return 0;
+#ifdef DB48
+    case C_PREFIX:
+      return db->db->set_bt_compress(db->db, NULL, NULL);
+#ifdef HAVE_ZLIB
+    case C_ZLIB:
+      db->db->app_private = db;
+      return db->db->set_bt_compress(db->db, zlib_compress, zlib_decompress);
+#endif
+#endif
+    default:
+      return EOPNOTSUPP;
+  }
+}
+
+
+		 /*******************************
+		 *	   TRANSACTIONS		*
+		 *******************************/
+
+static pthread_key_t transaction_key;
+
+typedef struct transaction
+{ DB_TXN *tid;				/* transaction id */
+  struct transaction *parent;		/* parent id */
+  dbenvh *env;				/* environment of the transaction */
+  atom_t symbol;			/* <bdb_txn>(...) or 0 */
+  atom_t env_symbol;			/* locked <bdb_env>(...) */
+  struct dbcursor *cursors;		/* cursors opened in transaction */
+  u_int32_t commit_flags;		/* flags for DB_TXN->commit() */
+  int group_commit;			/* commit using group commit */
+  struct txn_cache *caches;		/* value caches to clear on commit */
+} transaction;
+
+typedef struct txn_options
+{ u_int32_t begin_flags;		/* flags for DB_ENV->txn_begin() */
+  u_int32_t commit_flags;		/* flags for DB_TXN->commit() */
+  int group_commit;			/* commit using group commit */
+} txn_options;
+
+static void close_txn_cursors(transaction *t);
+static void release_txn_caches(transaction *t, int committed);
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Group commit. If the environment is initialised with group_commit(Window),
+top-level transactions commit using  DB_TXN_NOSYNC   and  then call
+group_flush(). Each commit takes a ticket.  The first thread that needs
+a flush becomes the leader: it waits Window  to allow other commits to
+join, notes the last ticket handed  out   and  flushes the log. Threads
+that arrive while a flush is in progress wait until a flush covers their
+ticket. As the commit record is written   before  the ticket is taken, a
+flush started after the ticket is taken makes the commit durable.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct group_commit
+{ pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  uint64_t	  requested;		/* last ticket handed out */
+  uint64_t	  flushed;		/* last ticket flushed */
+  int		  flushing;		/* a leader is flushing */
+  int		  rval;			/* result of the last flush */
+  long		  window;		/* wait time in microseconds */
+} group_commit;
+
+
+static group_commit *
+new_group_commit(long window)
+{ group_commit *g;
+
+  if ( (g=calloc(1, sizeof(*g))) )
+  { pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    g->window = window;
+  }
+
+  return g;
+}
+
+
+static void
+free_group_commit(group_commit *g)
+{ pthread_mutex_destroy(&g->mutex);
+  pthread_cond_destroy(&g->cond);
+  free(g);
+}
+
+
+static int
+group_flush(dbenvh *env)
+{ group_commit *g = env->group_commit;
+  uint64_t ticket;
+  int rval = 0;
+
+  pthread_mutex_lock(&g->mutex);
+  ticket = ++g->requested;
+  while( g->flushed < ticket )
+  { if ( !g->flushing )
+    { uint64_t upto;
+
+      g->flushing = TRUE;
+      pthread_mutex_unlock(&g->mutex);
+      if ( g->window > 0 )
+      { struct timespec ts;
+
+	ts.tv_sec  = g->window/1000000;
+	ts.tv_nsec = (g->window%1000000)*1000;
+	nanosleep(&ts, NULL);
+      }
+      pthread_mutex_lock(&g->mutex);
+      upto = g->requested;
+      pthread_mutex_unlock(&g->mutex);
+
+      NOSIG(rval=env->env->log_flush(env->env, NULL));
+
+      pthread_mutex_lock(&g->mutex);
+      g->flushed  = upto;
+      g->rval     = rval;
+      g->flushing = FALSE;
+      pthread_cond_broadcast(&g->cond);
+    } else
+    { pthread_cond_wait(&g->cond, &g->mutex);
+      rval = g->rval;
+    }
+  }
+  pthread_mutex_unlock(&g->mutex);
+
+  return rval;
+}
+
+typedef struct transaction_stack
+{ transaction *top;
+} transaction_stack;
+
+static transaction_stack *
+my_tr_stack(void)
+{ transaction_stack *stack;
+
+  if ( (stack=pthread_getspecific(transaction_key)) )
+    return stack;
+
+  if ( (stack=calloc(1,sizeof(*stack))) )
+  { pthread_setspecific(transaction_key, stack);
+    return stack;
+  }
+
+  PL_resource_error("memory");
+  return NULL;
+}
+
+static void
+free_transaction_stack(void *ptr)
+{ transaction_stack *stack = ptr;
+
+  assert(stack->top == NULL);
+  free(stack);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+txn_begin(), txn_commit() and txn_abort() manage a single transaction.
+bdb_transaction/1,2,3 keep their transaction   on  a per-thread stack,
+which makes it the implicit transaction of the database operations of
+the thread (TheTXN). Transactions created by bdb_txn_begin/3 are not on
+the stack; they are only used for operations that pass txn(Txn).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+txn_begin(dbenvh *env, transaction *parent, transaction *t,
+	  const txn_options *opts)
+{ if ( env->env && (env->flags&DB_INIT_TXN) )
+  { int rval;
+    DB_TXN *tid;
+
+    if ( (rval=env->env->txn_begin(env->env, parent ? parent->tid : NULL,
+				   &tid, opts ? opts->begin_flags : 0)) )
+      return db_status_env(rval, env);
+
+    t->parent = parent;
+    t->tid = tid;
+    t->env = env;
+    t->cursors = NULL;
+    t->caches = NULL;
+    if ( opts )
+    { t->commit_flags = opts->commit_flags;
+      t->group_commit = opts->group_commit;
+    } else
+    { t->commit_flags = 0;
+      t->group_commit = (env->group_commit != NULL);
+    }
+
+    return TRUE;
+  } else
+  { term_t ex;
+
+    if ( (ex=PL_new_term_ref()) &&
+	 unify_dbenv(ex, env) )
+      return PL_permission_error("start", "transaction", ex);
+    return FALSE;
+  }
+}
+
+
+static int
+txn_commit(transaction *t)
+{ DB_TXN *tid = t->tid;
+  int rval;
+
+  t->tid = NULL;
+  close_txn_cursors(t);
+
+  METERED(&t->env->commit_metrics,
+	  if ( t->group_commit && !t->parent && t->env->group_commit )
+	  { if ( (rval=tid->commit(tid, DB_TXN_NOSYNC)) == 0 )
+	      rval = group_flush(t->env);
+	  } else
+	  { rval = tid->commit(tid, t->commit_flags);
+	  });
+  release_txn_caches(t, rval == 0);
+  if ( rval )
+    return db_status_env(rval, t->env);
+
+  return TRUE;
+}
+
+
+static int
+txn_abort(transaction *t)
+{ DB_TXN *tid = t->tid;
+  int rval;
+
+  t->tid = NULL;
+  close_txn_cursors(t);
+  release_txn_caches(t, FALSE);
+
+  if ( (rval=tid->abort(tid)) )
+    return db_status_env(rval, t->env);
+
+  return TRUE;
+}
+
+
+static int
+begin_transaction(dbenvh *env, transaction *t, const txn_options *opts)
+{ transaction_stack *stack;
+
+  if ( !(stack=my_tr_stack()) )
+    return FALSE;
+
+  t->symbol = 0;
+  t->env_symbol = 0;
+  if ( !txn_begin(env, stack->top, t, opts) )
+    return FALSE;
+  stack->top = t;
+
+  return TRUE;
+}
+
+
+static int
+commit_transaction(transaction *t)
+{ transaction_stack *stack = my_tr_stack();
+
+  assert(stack);
+  assert(stack->top == t);
+
+  stack->top = t->parent;
+
+  return txn_commit(t);
+}
+
+
+static int
+abort_transaction(transaction *t)
+{ transaction_stack *stack = my_tr_stack();
+
+  assert(stack);
+  assert(stack->top == t);
+
+  stack->top = t->parent;
+
+  return txn_abort(t);
+}
+
+
+static transaction *
+top_transaction(void)
+{ transaction_stack *stack;
+
+  if ( (stack=pthread_getspecific(transaction_key)) )
+    return stack->top;
+
+  return NULL;
+}
+
+
+static DB_TXN *
+current_transaction(void)
+{ transaction *t;
+
+  if ( (t=top_transaction()) )
+    return t->tid;
+
+  return NULL;
+}
+
+
+static db_flag txn_sync_modes[] =
+{ { "sync",		DB_TXN_SYNC,	     0 },
+  { "nosync",		DB_TXN_NOSYNC,	     0 },
+  { "write_nosync",	DB_TXN_WRITE_NOSYNC, 0 },
+  { (char*)NULL,	0,		     0 }
+};
+
+
+static db_flag txn_isolation_levels[] =
+{ { "serializable",	0,		     0 },
+#ifdef DB_TXN_SNAPSHOT
+  { "snapshot",		DB_TXN_SNAPSHOT,     0 },
+#endif
+#ifdef DB_READ_COMMITTED
+  { "read_committed",	DB_READ_COMMITTED,   0 },
+#endif
+  { "read_uncommitted",	DB_READ_UNCOMMITTED, 0 },
+  { (char*)NULL,	0,		     0 }
+};
+
+
+static void
+init_txn_options(dbenvh *env, txn_options *opts)
+{ opts->begin_flags  = 0;
+  opts->commit_flags = 0;
+  opts->group_commit = (env->group_commit != NULL);
+}
+
+
+static int
+get_txn_options(term_t options, txn_options *opts)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name, a;
+    size_t arity;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("transaction_option", head);
+    _PL_get_arg(1, head, arg);
+
+    if ( name == ATOM_sync )
+    { u_int32_t f;
+
+      if ( !PL_get_atom_ex(arg, &a) )
+	return FALSE;
+      if ( (f=lookup_flag(txn_sync_modes, a, 0)) == F_UNPROCESSED )
+	return PL_domain_error("transaction_sync", arg);
+      opts->commit_flags = f;
+      opts->group_commit = FALSE;
+    } else if ( name == ATOM_isolation )
+    { u_int32_t f;
+
+      if ( !PL_get_atom_ex(arg, &a) )
+	return FALSE;
+      if ( (f=lookup_flag(txn_isolation_levels, a, 0)) == F_UNPROCESSED )
+	return PL_domain_error("transaction_isolation", arg);
+      opts->begin_flags = f;
+    } else
+      return PL_domain_error("transaction_option", head);
+  }
+
+  return PL_get_nil_ex(tail);
+}
+
+
+static foreign_t
+bdb_transaction(term_t environment, term_t goal, term_t options)
+{ static predicate_t call1;
+  qid_t qid;
+  int rval;
+  struct transaction tr;
+  dbenvh *env = &default_env;
+  txn_options opts;
+
+  if ( !call1 )
+    call1 = PL_predicate("call", 1, "system");
+
+  if ( (environment && !get_dbenv(environment, &env)) ||
+       !check_same_thread(env) )
+    return FALSE;
+  if ( options )
+  { init_txn_options(env, &opts);
+    if ( !get_txn_options(options, &opts) )
+      return FALSE;
+  }
+
+  NOSIG(rval=begin_transaction(env, &tr, options ? &opts : NULL));
+  if ( !rval )
+    return FALSE;
+
+  qid = PL_open_query(NULL, PL_Q_PASS_EXCEPTION, call1, goal);
+  rval = PL_next_solution(qid);
+  if ( rval )
+  { PL_cut_query(qid);
+    NOSIG(rval=commit_transaction(&tr));
+    return rval;
+  } else
+  { PL_cut_query(qid);
+
+    NOSIG(rval=abort_transaction(&tr));
+    if ( !rval )
+      return FALSE;
+
+    return FALSE;
+  }
+}
+
+
+static foreign_t
+pl_bdb_transaction3(term_t environment, term_t goal, term_t options)
+{ return bdb_transaction(environment, goal, options);
+}
+
+static foreign_t
+pl_bdb_transaction2(term_t environment, term_t goal)
+{ return bdb_transaction(environment, goal, 0);
+}
+
+static foreign_t
+pl_bdb_transaction1(term_t goal)
+{ return bdb_transaction(0, goal, 0);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Explicit transactions are blobs that   wrap a heap-allocated transaction.
+They are always top-level transactions, also   if created inside
+bdb_transaction/1,2,3. The blob keeps a reference to the environment
+blob, so the environment cannot be garbage collected while it has a
+transaction. If a transaction that is still   open  is garbage collected,
+it is aborted.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+acquire_txn(atom_t symbol)
+{ transaction *t = PL_blob_data(symbol, NULL, NULL);
+  t->symbol = symbol;
+}
+
+
+static int
+release_txn(atom_t symbol)
+{ transaction *t = PL_blob_data(symbol, NULL, NULL);
+
+  if ( t->tid && t->env->env )
+  { close_txn_cursors(t);
+    t->tid->abort(t->tid);
+    t->tid = NULL;
+  }
+  release_txn_caches(t, FALSE);
+  if ( t->env_symbol )
+    PL_unregister_atom(t->env_symbol);
+  free(t);
+
+  return TRUE;
+}
+
+static int
+compare_txns(atom_t a, atom_t b)
+{ transaction *ara = PL_blob_data(a, NULL, NULL);
+  transaction *arb = PL_blob_data(b, NULL, NULL);
+
+  return ( ara > arb ?  1 :
+	   ara < arb ? -1 : 0
+	 );
+}
+
+static int
+write_txn(IOSTREAM *s, atom_t symbol, int flags)
+{ transaction *t = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<bdb_txn>(%p)", t);
+
+  return TRUE;
+}
+
+static PL_blob_t txn_blob =
+{ PL_BLOB_MAGIC,
+  PL_BLOB_NOCOPY,
+  "bdb_txn",
+  release_txn,
+  compare_txns,
+  write_txn,
+  acquire_txn
+};
+
+
+static bool
+get_txn(term_t t, transaction **tp)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &txn_blob)
+  { transaction *p = data;
+
+    if ( p->tid )
+    { *tp = p;
+
+      return true;
+    }
+
+    return PL_permission_error("access", "closed_bdb_txn", t),false;
+  }
+
+  return PL_type_error("bdb_txn", t),false;
+}
+
+
+/* Get the DB_TXN from a txn(Txn) option.  The transaction must belong to
+   the environment of the database.
+*/
+
+static int
+get_db_txn(term_t t, dbh *db, transaction **tp)
+{ if ( !get_txn(t, tp) )
+    return FALSE;
+  if ( (*tp)->env != db->env )
+    return PL_permission_error("access", "bdb_txn", t);
+
+  return TRUE;
+}
+
+
+/* Process the options of bdb_put/4, bdb_get/4 and bdb_del/4.  *tp is
+   the transaction to use or NULL.
+*/
+
+static int
+get_access_options(term_t options, dbh *db, transaction **tp)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  *tp = top_transaction();
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("access_option", head);
+    _PL_get_arg(1, head, arg);
+
+    if ( name == ATOM_txn )
+    { if ( !get_db_txn(arg, db, tp) )
+	return FALSE;
+    } else
+      return PL_domain_error("access_option", head);
+  }
+
+  return PL_get_nil_ex(tail);
+}
+
+
+static foreign_t
+pl_bdb_txn_begin(term_t environment, term_t txn, term_t options)
+{ dbenvh *env;
+  transaction *t;
+  txn_options opts;
+  int rval;
+
+  if ( !get_dbenv(environment, &env) ||
+       !check_same_thread(env) )
+    return FALSE;
+  init_txn_options(env, &opts);
+  if ( !get_txn_options(options, &opts) )
+    return FALSE;
+
+  if ( !(t=calloc(1, sizeof(*t))) )
+    return PL_resource_error("memory");
+  NOSIG(rval=txn_begin(env, NULL, t, &opts));
+  if ( !rval )
+  { free(t);
+    return FALSE;
+  }
+  if ( (t->env_symbol = env->symbol) )
+    PL_register_atom(t->env_symbol);
+
+  return PL_unify_blob(txn, t, sizeof(*t), &txn_blob);
+}
+
+
+static foreign_t
+pl_bdb_txn_commit(term_t txn, term_t options)
+{ transaction *t;
+  int rval;
+
+  if ( !get_txn(txn, &t) )
+    return FALSE;
+  if ( options )
+  { txn_options opts;
+
+    opts.begin_flags  = 0;
+    opts.commit_flags = t->commit_flags;
+    opts.group_commit = t->group_commit;
+    if ( !get_txn_options(options, &opts) )
+      return FALSE;
+    t->commit_flags = opts.commit_flags;
+    t->group_commit = opts.group_commit;
+  }
+
+  NOSIG(rval=txn_commit(t));
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_txn_commit1(term_t txn)
+{ return pl_bdb_txn_commit(txn, 0);
+}
+
+
+static foreign_t
+pl_bdb_txn_abort(term_t txn)
+{ transaction *t;
+  int rval;
+
+  if ( !get_txn(txn, &t) )
+    return FALSE;
+
+  NOSIG(rval=txn_abort(t));
+
+  return rval;
+}
+
+
+		 /*******************************
+		 *	     VALUE CACHE		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A database opened with cache(Bytes) keeps  recently read records in
+memory, keyed by the encoded key. The value   is kept as a PL_record()
+of the decoded term. bdb_get/3,4 first   consult the cache, which avoids
+the Berkeley DB lookup with its locking and page access as well as
+decoding the value.  On a hit, PL_recorded() copies the term.  The size
+of an entry is estimated from the encoded key and value.  The cache
+holds at most Bytes; the least recently used records are evicted.
+
+The cache reflects the committed  state  of   the  database.  It is
+consulted and filled only by reads outside a transaction.  Writes
+through the handle remove the key after the write. A write inside a
+transaction also registers the database with the outermost transaction,
+which clears the cache after it  committed.   Each  change increments
+the generation of the cache. A reader  only adds a record if the
+generation did not change since it started   reading, so a concurrent
+write cannot leave a stale record behind.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct vc_entry
+{ struct vc_entry *next;		/* next in hash chain */
+  struct vc_entry *newer;		/* LRU list */
+  struct vc_entry *older;
+  unsigned int	hash;			/* hash of the key */
+  u_int32_t	ksize;			/* size of the key */
+  u_int32_t	vsize;			/* encoded size of the value */
+  record_t	value;			/* PL_record() of the value */
+  char		data[];			/* the key */
+} vc_entry;
+
+typedef struct value_cache
+{ pthread_mutex_t mutex;		/* protects the cache */
+  vc_entry    **buckets;		/* hash table */
+  size_t	nbuckets;		/* # buckets (power of 2) */
+  size_t	count;			/* # entries */
+  vc_entry     *newest;			/* head of LRU list */
+  vc_entry     *oldest;			/* tail of LRU list */
+  size_t	bytes;			/* memory used by entries */
+  size_t	max_bytes;		/* cache(Bytes) */
+  uint64_t	generation;		/* incremented on each change */
+  uint64_t	hits;			/* statistics */
+  uint64_t	misses;
+  uint64_t	evictions;
+} value_cache;
+
+typedef struct txn_cache
+{ dbh	       *db;			/* database written in transaction */
+  atom_t	db_symbol;		/* locked <bdb>(...) */
+  struct txn_cache *next;
+} txn_cache;
+
+#define VC_INITIAL_BUCKETS 64
+
+
+static value_cache *
+new_value_cache(size_t max_bytes)
+{ value_cache *vc;
+
+  if ( !(vc=calloc(1, sizeof(*vc))) )
+    return NULL;
+  if ( !(vc->buckets=calloc(VC_INITIAL_BUCKETS, sizeof(*vc->buckets))) )
+  { free(vc);
+    return NULL;
+  }
+  vc->nbuckets  = VC_INITIAL_BUCKETS;
+  vc->max_bytes = max_bytes;
+  pthread_mutex_init(&vc->mutex, NULL);
+
+  return vc;
+}
+
+
+static void
+vc_free_entry(vc_entry *e)
+{ PL_erase(e->value);
+  free(e);
+}
+
+
+static void
+vc_clear_unlocked(value_cache *vc)
+{ vc_entry *e, *next;
+
+  for(e=vc->newest; e; e=next)
+  { next = e->older;
+    vc_free_entry(e);
+  }
+  memset(vc->buckets, 0, vc->nbuckets*sizeof(*vc->buckets));
+  vc->newest = vc->oldest = NULL;
+  vc->count = 0;
+  vc->bytes = 0;
+  vc->generation++;
+}
+
+
+static void
+free_value_cache(value_cache *vc)
+{ vc_clear_unlocked(vc);
+  pthread_mutex_destroy(&vc->mutex);
+  free(vc->buckets);
+  free(vc);
+}
+
+
+static unsigned int
+vc_hash(const DBT *k)
+{ const unsigned char *p = k->data;
+  unsigned int h = 2166136261U;		/* FNV-1a */
+  u_int32_t i;
+
+  for(i=0; i<k->size; i++)
+    h = (h^p[i])*16777619U;
+
+  return h;
+}
+
+
+static vc_entry **
+vc_find(value_cache *vc, const DBT *k, unsigned int h)
+{ vc_entry **ep = &vc->buckets[h&(vc->nbuckets-1)];
+
+  for( ; *ep; ep = &(*ep)->next )
+  { vc_entry *e = *ep;
+
+    if ( e->hash == h && e->ksize == k->size &&
+	 memcmp(e->data, k->data, k->size) == 0 )
+      break;
+  }
+
+  return ep;
+}
+
+
+static void
+vc_lru_unlink(value_cache *vc, vc_entry *e)
+{ if ( e->newer )
+    e->newer->older = e->older;
+  else
+    vc->newest = e->older;
+  if ( e->older )
+    e->older->newer = e->newer;
+  else
+    vc->oldest = e->newer;
+}
+
+
+static void
+vc_lru_push(value_cache *vc, vc_entry *e)
+{ e->newer = NULL;
+  e->older = vc->newest;
+  if ( vc->newest )
+    vc->newest->newer = e;
+  else
+    vc->oldest = e;
+  vc->newest = e;
+}
+
+
+/* Remove the entry at *ep */
+
+static void
+vc_remove(value_cache *vc, vc_entry **ep)
+{ vc_entry *e = *ep;
+
+  *ep = e->next;
+  vc_lru_unlink(vc, e);
+  vc->bytes -= sizeof(*e)+e->ksize+e->vsize;
+  vc->count--;
+  vc_free_entry(e);
+}
+
+
+static void
+vc_resize(value_cache *vc)
+{ size_t n = vc->nbuckets*2;
+  vc_entry **buckets;
+  vc_entry *e;
+
+  if ( !(buckets=calloc(n, sizeof(*buckets))) )
+    return;				/* keep the old table */
+  for(e=vc->newest; e; e=e->older)
+  { vc_entry **bp = &buckets[e->hash&(n-1)];
+
+    e->next = *bp;
+    *bp = e;
+  }
+  free(vc->buckets);
+  vc->buckets  = buckets;
+  vc->nbuckets = n;
+}
+
+
+/* Lookup k.  On a hit, put a copy of the value in t and return TRUE.
+   On a miss, return FALSE and the generation to pass to vc_insert().
+   Returns -1 if copying the value raised an exception.
+*/
+
+static int
+vc_lookup(value_cache *vc, const DBT *k, term_t t, uint64_t *gen)
+{ unsigned int h = vc_hash(k);
+  vc_entry *e;
+  int rc = FALSE;
+
+  pthread_mutex_lock(&vc->mutex);
+  if ( (e=*vc_find(vc, k, h)) )
+  { if ( PL_recorded(e->value, t) )
+    { vc_lru_unlink(vc, e);
+      vc_lru_push(vc, e);
+      vc->hits++;
+      rc = TRUE;
+    } else
+      rc = -1;
+  } else
+  { vc->misses++;
+  }
+  *gen = vc->generation;
+  pthread_mutex_unlock(&vc->mutex);
+
+  return rc;
+}
+
+
+/* Add value, the decoded term of v, for k */
+
+static void
+vc_insert(value_cache *vc, const DBT *k, const DBT *v, term_t value,
+	  uint64_t gen)
+{ size_t size = sizeof(vc_entry)+k->size+v->size;
+  unsigned int h = vc_hash(k);
+  vc_entry *e;
+
+  if ( size > vc->max_bytes || !(e=malloc(sizeof(*e)+k->size)) )
+    return;
+  if ( !(e->value = PL_record(value)) )
+  { free(e);
+    return;
+  }
+  e->hash  = h;
+  e->ksize = k->size;
+  e->vsize = v->size;
+  memcpy(e->data, k->data, k->size);
+
+  pthread_mutex_lock(&vc->mutex);
+  if ( gen == vc->generation && !*vc_find(vc, k, h) )
+  { vc_entry **bp;
+
+    while( vc->bytes+size > vc->max_bytes && vc->oldest )
+    { vc_entry **ep = &vc->buckets[vc->oldest->hash&(vc->nbuckets-1)];
+
+      while( *ep != vc->oldest )
+	ep = &(*ep)->next;
+      vc_remove(vc, ep);
+      vc->evictions++;
+    }
+    if ( vc->count >= vc->nbuckets*2 )
+      vc_resize(vc);
+    bp = &vc->buckets[h&(vc->nbuckets-1)];
+    e->next = *bp;
+    *bp = e;
+    vc_lru_push(vc, e);
+    vc->bytes += size;
+    vc->count++;
+    e = NULL;
+  }
+  pthread_mutex_unlock(&vc->mutex);
+
+  if ( e )
+    vc_free_entry(e);
+}
+
+
+/* Remove k from the cache or, if k is NULL, clear the cache */
+
+static void
+vc_invalidate(value_cache *vc, const DBT *k)
+{ pthread_mutex_lock(&vc->mutex);
+  if ( k )
+  { vc_entry **ep = vc_find(vc, k, vc_hash(k));
+
+    if ( *ep )
+      vc_remove(vc, ep);
+    vc->generation++;
+  } else
+  { vc_clear_unlocked(vc);
+  }
+  pthread_mutex_unlock(&vc->mutex);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+cache_write() must be called after  modifying   the  record  with key k
+through db in transaction t (NULL  if   none).  If  k  is NULL, many
+records may have been modified.  Writes through  a secondary modify the
+primary.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+cache_write(dbh *db, transaction *t, const DBT *k)
+{ txn_cache *tc;
+
+  if ( db->primary )
+  { db = db->primary;
+    k = NULL;
+  }
+  if ( !db->vcache )
+    return;
+
+  vc_invalidate(db->vcache, k);
+  if ( t )
+  { while( t->parent )
+      t = t->parent;
+    for(tc=t->caches; tc; tc=tc->next)
+    { if ( tc->db == db )
+	return;
+    }
+    if ( (tc=malloc(sizeof(*tc))) )
+    { tc->db = db;
+      if ( (tc->db_symbol = db->symbol) )
+	PL_register_atom(tc->db_symbol);
+      tc->next = t->caches;
+      t->caches = tc;
+    }
+  }
+}
+
+
+static void
+release_txn_caches(transaction *t, int committed)
+{ txn_cache *tc, *next;
+
+  for(tc=t->caches; tc; tc=next)
+  { next = tc->next;
+    if ( committed && tc->db->vcache )
+      vc_invalidate(tc->db->vcache, NULL);
+    if ( tc->db_symbol )
+      PL_unregister_atom(tc->db_symbol);
+    free(tc);
+  }
+  t->caches = NULL;
+}
+
+
+		 /*******************************
+		 *	   THREAD BUFFERS		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The deterministic access predicates encode keys and values into buffers
+that belong to the calling thread and, in a threaded environment, fetch
+values into a DB_DBT_USERMEM buffer  that   grows  on  demand.  The
+enumeration contexts of bdb_get/3, bdb_del/3  and bdb_enum/3 are kept on
+a per-thread free list together  with   their  DB_DBT_REALLOC buffers.
+After warming up, these calls no longer allocate memory, except for the
+record of D_TERM keys and values.
+
+If a database is opened  with   cache_cursors(true),  each thread keeps
+one cursor per database open, which saves opening and closing a cursor
+for every bdb_get/3 on  a  database  with   duplicates.  An  idle  DB
+cursor may hold locks, so  this  is   only  done  in environments that
+do not use locking and only outside transactions. The cached cursors
+of a database are closed by bdb_close/1; the  owning thread notices this
+through the cleared db field. Both lists are protected by cursor_mutex.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MAX_FREE_CTX 4			/* max recycled contexts per thread */
+
+static pthread_key_t buffers_key;
+static pthread_mutex_t cursor_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct cached_cursor
+{ DBC	       *cursor;			/* the DB cursor */
+  dbh	       *db;			/* database (NULL: closed) */
+  int		busy;			/* cursor is in use */
+  struct cached_cursor *next;		/* next of the database */
+  struct cached_cursor *thread_next;	/* next of the thread */
+} cached_cursor;
+
+typedef struct _dbget_ctx
+{ dbh *db;				/* the database */
+  DBC *cursor;				/* the cursor */
+  cached_cursor *cached;		/* cursor is from the cache */
+  transaction *txn;			/* transaction of bdb_del/3,4 */
+  int bounded;				/* key is an upper bound */
+  DBT key;				/* the key */
+  DBT k2;				/* secondary key */
+  DBT pkey;				/* primary key for bdb_pget/4 */
+  DBT value;				/* the value */
+  charbuf keybuf;			/* storage for key */
+  struct _dbget_ctx *next;		/* next in free list */
+} dbget_ctx;
+
+typedef struct thread_buffers
+{ charbuf key;				/* encoded key */
+  charbuf value;			/* encoded value */
+  charbuf result;			/* DB_DBT_USERMEM result */
+  dbget_ctx *free_ctx;			/* recycled contexts */
+  int free_count;			/* length of free_ctx */
+  cached_cursor *cursors;		/* cursors cached by this thread */
+} thread_buffers;
+
+
+static void
+free_get_ctx_buffers(dbget_ctx *c)
+{ if ( c->k2.data )
+    free(c->k2.data);
+  if ( c->pkey.data )
+    free(c->pkey.data);
+  if ( c->value.data )
+    free(c->value.data);
+  free_charbuf(&c->keybuf);
+  free(c);
+}
+
+
+static void
+free_thread_buffers(void *closure)
+{ thread_buffers *tb = closure;
+  dbget_ctx *c, *next;
+  cached_cursor *cc, *cnext;
+
+  pthread_mutex_lock(&cursor_mutex);
+  for(cc=tb->cursors; cc; cc=cnext)
+  { cnext = cc->thread_next;
+
+    if ( cc->db )
+    { cached_cursor **p;
+
+      for(p = &cc->db->cached_cursors; *p; p = &(*p)->next)
+      { if ( *p == cc )
+	{ *p = cc->next;
+	  break;
+	}
+      }
+      cc->cursor->c_close(cc->cursor);
+    }
+    free(cc);
+  }
+  pthread_mutex_unlock(&cursor_mutex);
+
+  for(c=tb->free_ctx; c; c=next)
+  { next = c->next;
+    free_get_ctx_buffers(c);
+  }
+
+  free_charbuf(&tb->key);
+  free_charbuf(&tb->value);
+  free_charbuf(&tb->result);
+  free(tb);
+}
+
+
+static thread_buffers *
+my_buffers(void)
+{ thread_buffers *tb;
+
+  if ( (tb=pthread_getspecific(buffers_key)) )
+    return tb;
+
+  if ( (tb=calloc(1, sizeof(*tb))) )
+  { pthread_setspecific(buffers_key, tb);
+    return tb;
+  }
+
+  PL_resource_error("memory");
+  return NULL;
+}
+
+
+static dbget_ctx *
+alloc_get_ctx(thread_buffers *tb, dbh *db)
+{ dbget_ctx *c;
+
+  if ( (c=tb->free_ctx) )
+  { tb->free_ctx = c->next;
+    tb->free_count--;
+  } else if ( (c=calloc(1, sizeof(*c))) )
+  { c->k2.flags    = DB_DBT_REALLOC;
+    c->pkey.flags  = DB_DBT_REALLOC;
+    c->value.flags = DB_DBT_REALLOC;
+  } else
+  { PL_resource_error("memory");
+    return NULL;
+  }
+
+  c->db = db;
+  c->txn = NULL;
+  c->next = NULL;
+  memset(&c->key, 0, sizeof(c->key));
+  c->value.flags = DB_DBT_REALLOC;
+  c->value.doff = c->value.dlen = 0;
+
+  return c;
+}
+
+
+static void
+free_get_ctx(dbget_ctx *c)
+{ thread_buffers *tb = pthread_getspecific(buffers_key);
+
+  if ( tb && tb->free_count < MAX_FREE_CTX )
+  { c->db = NULL;
+    c->cursor = NULL;
+    c->cached = NULL;
+    c->next = tb->free_ctx;
+    tb->free_ctx = c;
+    tb->free_count++;
+  } else
+  { free_get_ctx_buffers(c);
+  }
+}
+
+
+/* Copy the key into the context, such that it survives until the
+   context is released
+*/
+
+static int
+set_get_ctx_key(dbget_ctx *c, const DBT *k)
+{ c->keybuf.size = 0;
+  if ( !add_charbuf(&c->keybuf, k->data, k->size) )
+    return FALSE;
+  c->key.data = c->keybuf.base;
+  c->key.size = k->size;
+
+  return TRUE;
+}
+
+
+static int
+may_cache_cursor(dbh *db, DB_TXN *txn)
+{ return ( db->cache_cursors &&
+	   !txn &&
+	   !(db->env->flags&(DB_INIT_LOCK|DB_INIT_CDB)) );
+}
+
+
+static int
+acquire_db_cursor(dbh *db, DB_TXN *txn, DBC **cp, cached_cursor **ccp)
+{ *ccp = NULL;
+
+  if ( may_cache_cursor(db, txn) )
+  { thread_buffers *tb;
+    cached_cursor **p, *cc = NULL;
+
+    if ( !(tb=my_buffers()) )
+      return ENOMEM;
+
+    pthread_mutex_lock(&cursor_mutex);
+    for(p = &tb->cursors; *p; )
+    { cached_cursor *e = *p;
+
+      if ( !e->db && !e->busy )		/* database was closed */
+      { *p = e->thread_next;
+	free(e);
+	continue;
+      }
+      if ( e->db == db )
+	cc = e;
+      p = &e->thread_next;
+    }
+    pthread_mutex_unlock(&cursor_mutex);
+
+    if ( cc )
+    { if ( cc->busy )			/* nested use: do not cache */
+	return db->db->cursor(db->db, NULL, cp, 0);
+    } else
+    { int rval;
+      DBC *dbc;
+
+      if ( (rval=db->db->cursor(db->db, NULL, &dbc, 0)) )
+	return rval;
+      if ( !(cc=calloc(1, sizeof(*cc))) )
+      { *cp = dbc;
+	return 0;
+      }
+      cc->cursor = dbc;
+      cc->db = db;
+      pthread_mutex_lock(&cursor_mutex);
+      cc->next = db->cached_cursors;
+      db->cached_cursors = cc;
+      cc->thread_next = tb->cursors;
+      tb->cursors = cc;
+      pthread_mutex_unlock(&cursor_mutex);
+    }
+
+    cc->busy = TRUE;
+    *cp = cc->cursor;
+    *ccp = cc;
+    return 0;
+  }
+
+  return db->db->cursor(db->db, txn, cp, 0);
+}
+
+
+static int
+release_db_cursor(DBC *cursor, cached_cursor *cc)
+{ if ( cc )
+  { cc->busy = FALSE;
+    return 0;
+  }
+
+  return cursor->c_close(cursor);
+}
+
+
+/* Close the cached cursors of a database.  Called by bdb_close() */
+
+static void
+close_cached_cursors(dbh *db)
+{ cached_cursor *cc;
+
+  pthread_mutex_lock(&cursor_mutex);
+  while( (cc=db->cached_cursors) )
+  { db->cached_cursors = cc->next;
+    cc->cursor->c_close(cc->cursor);
+    cc->cursor = NULL;
+    cc->db = NULL;
+  }
+  pthread_mutex_unlock(&cursor_mutex);
+}
+
+
+static void
+init_result_dbt(dbh *db, DBT *v, thread_buffers *tb)
+{ memset(v, 0, sizeof(*v));
+
+  if ( (db->env->flags&DB_THREAD) )
+  { v->flags = DB_DBT_USERMEM;
+    v->data  = tb->result.base;
+    v->ulen  = (u_int32_t)tb->result.allocated;
+  }
+}
+
+
+/* Get a value into the buffer from init_result_dbt(), growing it if
+   the value does not fit
+*/
+
+static int
+get_result_dbt(dbh *db, DB_TXN *txn, DBT *k, DBT *v, thread_buffers *tb)
+{ int rval;
+
+  for(;;)
+  { NOSIG(METERED(&db->metrics[M_GET],
+		  rval=db->db->get(db->db, txn, k, v, 0)));
+
+    if ( rval == DB_BUFFER_SMALL && (v->flags&DB_DBT_USERMEM) )
+    { size_t size = v->size;
+      char *p;
+
+      if ( !(p=realloc(tb->result.base, size)) )
+	return ENOMEM;
+      tb->result.base = p;
+      tb->result.allocated = size;
+      v->data = p;
+      v->ulen = (u_int32_t)size;
+      continue;
+    }
+
+    return rval;
+  }
+}
+
+
+		 /*******************************
+		 *	     DB ACCESS		*
+		 *******************************/
+
+static foreign_t
+bdb_put(term_t handle, term_t key, term_t value, term_t options)
+{ DBT k, v;
+  dbh *db;
+  thread_buffers *tb;
+  transaction *t;
+  DB_TXN *txn;
+  int flags = 0;
+  int rval;
+
+  if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+    return FALSE;
+  if ( options )
+  { if ( !get_access_options(options, db, &t) )
+      return FALSE;
+  } else
+    t = top_transaction();
+  txn = (t ? t->tid : NULL);
+
+  if ( !get_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+  if ( !get_dbt_buf(value, db->value_type, db->dict, &v, &tb->value) )
+  { free_dbt_buf(&k, db->key_type);
+    return FALSE;
+  }
+
+  NOSIG(METERED(&db->metrics[M_PUT],
+		rval = db->db->put(db->db, txn, &k, &v, flags)));
+  if ( rval == DB_KEYEXIST && (db->flags&DB_DUPSORT) )
+    rval = 0;				/* pair already exists */
+  if ( rval == 0 )
+    cache_write(db, t, &k);
+  rval = db_status(rval, handle);
+  free_dbt_buf(&k, db->key_type);
+  free_dbt_buf(&v, db->value_type);
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_put(term_t handle, term_t key, term_t value)
+{ return bdb_put(handle, key, value, 0);
+}
+
+
+static foreign_t
+pl_bdb_put4(term_t handle, term_t key, term_t value, term_t options)
+{ return bdb_put(handle, key, value, options);
+}
+
+
+static foreign_t
+pl_bdb_del2(term_t handle, term_t key)
+{ DBT k;
+  dbh *db;
+  thread_buffers *tb;
+  int flags = 0;			/* current no flags in DB */
+  int rval;
+
+  if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+
+  NOSIG(METERED(&db->metrics[M_DEL],
+		rval = db->db->del(db->db, TheTXN, &k, flags)));
+  if ( rval == 0 )
+    cache_write(db, top_transaction(), &k);
+  rval = db_status(rval, handle);
+  free_dbt_buf(&k, db->key_type);
+
+  return rval;
+}
+
+
+static int
+has_duplicates(const dbh *db)
+{ return (db->flags&(DB_DUP|DB_DUPSORT)) != 0;
+}
+
+
+static int
+equal_dbt(DBT *a, DBT *b)
+{ if ( a->size == b->size )
+  { if ( a->data == b->data )
+      return TRUE;
+    if ( memcmp(a->data, b->data, a->size) == 0 )
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static foreign_t
+pl_bdb_getall(term_t handle, term_t key, term_t value)
+{ DBT k;
+  dbh *db;
+  thread_buffers *tb;
+  int rval;
+
+  if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+
+  if ( has_duplicates(db) )			/* must use a cursor */
+  { dbget_ctx *c;
+    term_t tail = PL_copy_term_ref(value);
+    term_t head = PL_new_term_ref();
+    int rc;
+
+    if ( !(c=alloc_get_ctx(tb, db)) )
+    { free_dbt_buf(&k, db->key_type);
+      return FALSE;
+    }
+    NOSIG(rval=acquire_db_cursor(db, TheTXN, &c->cursor, &c->cached));
+    if ( rval )
+    { free_get_ctx(c);
+      free_dbt_buf(&k, db->key_type);
+      return db_status(rval, handle);
+    }
+
+    NOSIG(METERED(&db->metrics[M_GET],
+		  rval=c->cursor->c_get(c->cursor, &k, &c->value, DB_SET)));
+    if ( rval == 0 )
+    { rc = ( PL_unify_list(tail, head, tail) &&
+	     unify_dbt(head, db->value_type, db->dict, &c->value) );
+
+      while( rc )
+      { NOSIG(METERED(&db->metrics[M_CURSOR],
+			rval=c->cursor->c_get(c->cursor, &c->k2, &c->value,
+					      DB_NEXT_DUP)));
+	if ( rval != 0 )
+	  break;
+	rc = ( PL_unify_list(tail, head, tail) &&
+	       unify_dbt(head, db->value_type, db->dict, &c->value) );
+      }
+
+      if ( rc )
+      { if ( rval == DB_NOTFOUND )
+	  rc = PL_unify_nil(tail);
+	else
+	  rc = db_status(rval, handle);
+      }
+    } else
+    { rc = db_status(rval, handle);
+    }
+
+    NOSIG(release_db_cursor(c->cursor, c->cached);
+	  free_get_ctx(c);
+	  free_dbt_buf(&k, db->key_type));
+
+    return rc;
+  } else
+  { DBT v;
+
+    init_result_dbt(db, &v, tb);
+    rval = get_result_dbt(db, TheTXN, &k, &v, tb);
+    free_dbt_buf(&k, db->key_type);
+
+    if ( !rval )
+    { term_t tail = PL_copy_term_ref(value);
+      term_t head = PL_new_term_ref();
+      int rc;
+
+      rc = ( PL_unify_list(tail, head, tail) &&
+	     unify_dbt(head, db->value_type, db->dict, &v) &&
+	     PL_unify_nil(tail) );
+      free_result_dbt(&v);
+
+      return rc;
+    } else
+      return db_status(rval, handle);
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If keys_only is TRUE, values are   retrieved  using a zero-length partial
+DBT and each key is enumerated only once.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+bdb_enum(term_t handle, term_t key, term_t value, control_t ctx, int keys_only)
+{ dbh *db;
+  thread_buffers *tb;
+  int rval = 0;
+  dbget_ctx *c = NULL;
+  fid_t fid = 0;
+
+  switch( PL_foreign_control(ctx) )
+  { case PL_FIRST_CALL:
+      if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+	return FALSE;
+      if ( !(c=alloc_get_ctx(tb, db)) )
+	return FALSE;
+
+      if ( (rval=acquire_db_cursor(db, TheTXN, &c->cursor, &c->cached)) )
+      { free_get_ctx(c);
+	return db_status(rval, handle);
+      }
+      DEBUG(Sdprintf("Created cursor at %p\n", c->cursor));
+      if ( keys_only )
+	c->value.flags |= DB_DBT_PARTIAL;
+
+      METERED(&db->metrics[M_CURSOR],
+	      rval = c->cursor->c_get(c->cursor, &c->k2, &c->value, DB_FIRST));
+      if ( rval == 0 )
+      { fid = PL_open_foreign_frame();
+	if ( unify_dbt(key, db->key_type, db->dict, &c->k2) &&
+	     (keys_only || unify_dbt(value, db->value_type, db->dict, &c->value)) )
+	{ PL_close_foreign_frame(fid);
+	  PL_retry_address(c);
+	}
+
+	PL_rewind_foreign_frame(fid);
+	goto retry;
+      }
+      goto out;
+    case PL_REDO:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+
+    retry:
+      for(;;)
+      { METERED(&db->metrics[M_CURSOR],
+		rval = c->cursor->c_get(c->cursor, &c->k2, &c->value,
+					keys_only ? DB_NEXT_NODUP : DB_NEXT));
+
+	if ( rval == 0 )
+	{ if ( !fid )
+	    fid = PL_open_foreign_frame();
+
+	  if ( unify_dbt(key, db->key_type, db->dict, &c->k2) &&
+	       (keys_only || unify_dbt(value, db->value_type, db->dict, &c->value)) )
+	  { PL_close_foreign_frame(fid);
+	    PL_retry_address(c);
+	  }
+	  PL_rewind_foreign_frame(fid);
+	  continue;
+	}
+	break;
+      }
+      break;
+    case PL_PRUNED:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+      break;
+  }
+
+out:
+  if ( c )
+  { int rc = release_db_cursor(c->cursor, c->cached);
+
+    if ( rval == 0 )
+      rval = rc;
+    free_get_ctx(c);
+  }
+  if ( fid )
+    PL_close_foreign_frame(fid);
+
+  db_status(rval, handle);
+  return FALSE;				/* also on rval = 0! */
+}
+
+
+static foreign_t
+pl_bdb_enum(term_t handle, term_t key, term_t value, control_t ctx)
+{ return bdb_enum(handle, key, value, ctx, FALSE);
+}
+
+
+static foreign_t
+pl_bdb_enum_keys(term_t handle, term_t key, control_t ctx)
+{ return bdb_enum(handle, key, 0, ctx, TRUE);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+In a database with sorted duplicates, a  key/value pair is unique and we
+can find it using DB_GET_BOTH rather  than walking all duplicates of the
+key. This requires the value to have  a canonical encoding, which is not
+the case for D_TERM.  getdel_both() returns  -1   if  the value cannot be
+encoded, in which case the caller  falls   back  to  walking the
+duplicates, so type errors are handled the same as in that case.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+can_get_both(dbh *db, term_t value)
+{ return ( (db->flags&DB_DUPSORT) &&
+	   db->value_type != D_TERM &&
+	   PL_is_ground(value) );
+}
+
+
+static int
+getdel_both(dbh *db, transaction *t, thread_buffers *tb, DBT *k,
+	    term_t value, term_t handle, int del)
+{ DB_TXN *txn = (t ? t->tid : NULL);
+  DBT v;
+  int rval;
+
+  if ( !lookup_dbt_buf(value, db->value_type, db->dict, &v, &tb->value) )
+  { if ( !PL_exception(0) )
+      return FALSE;			/* not in the term_dict dictionary */
+    PL_clear_exception();
+    return -1;
+  }
+  v.flags = DB_DBT_USERMEM;
+  v.ulen  = (u_int32_t)tb->value.allocated;
+
+  if ( del )
+  { DBC *cursor;
+    cached_cursor *cc;
+
+    if ( (rval=acquire_db_cursor(db, txn, &cursor, &cc)) )
+      return db_status(rval, handle);
+    NOSIG(METERED(&db->metrics[M_GET],
+		  rval=cursor->c_get(cursor, k, &v, DB_GET_BOTH)));
+    if ( rval == 0 )
+    { if ( unify_dbt(value, db->value_type, db->dict, &v) )
+      { NOSIG(METERED(&db->metrics[M_DEL],
+		      rval=cursor->c_del(cursor, 0)));
+	if ( rval == 0 )
+	  cache_write(db, t, k);
+      } else
+	rval = DB_NOTFOUND;
+    }
+    NOSIG(release_db_cursor(cursor, cc));
+  } else
+  { NOSIG(METERED(&db->metrics[M_GET],
+		  rval=db->db->get(db->db, txn, k, &v, DB_GET_BOTH)));
+    if ( rval == 0 && !unify_dbt(value, db->value_type, db->dict, &v) )
+      rval = DB_NOTFOUND;
+  }
+
+  return rval == 0 ? TRUE : db_status(rval, handle);
+}
+
+
+#define DO_DEL \
+	if ( del ) \
+	{ METERED(&db->metrics[M_DEL], rval=c->cursor->c_del(c->cursor, 0)); \
+	  if ( rval != 0 ) \
+	    goto out; \
+	  cache_write(db, c->txn, &c->key); \
+	}
+
+
+static foreign_t
+bdb_getdel(term_t handle, term_t key, term_t value, term_t options,
+	   control_t ctx, int del)
+{ dbh *db;
+  thread_buffers *tb;
+  int rval = 0;
+  dbget_ctx *c = NULL;
+  fid_t fid = 0;
+
+  switch( PL_foreign_control(ctx) )
+  { case PL_FIRST_CALL:
+    { DBT k;
+      transaction *t;
+      DB_TXN *txn;
+
+      if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+	return FALSE;
+      if ( options )
+      { if ( !get_access_options(options, db, &t) )
+	  return FALSE;
+      } else
+	t = top_transaction();
+      txn = (t ? t->tid : NULL);
+      if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+	return FALSE;
+
+      if ( has_duplicates(db) )		/* DB with duplicates */
+      { int rc;
+
+	if ( can_get_both(db, value) &&
+	     (rc=getdel_both(db, t, tb, &k, value, handle, del)) >= 0 )
+	{ free_dbt_buf(&k, db->key_type);
+	  return rc;
+	}
+
+	if ( !(c=alloc_get_ctx(tb, db)) )
+	{ free_dbt_buf(&k, db->key_type);
+	  return FALSE;
+	}
+	c->txn = t;
+	rc = set_get_ctx_key(c, &k);
+	free_dbt_buf(&k, db->key_type);
+	if ( !rc )
+	{ free_get_ctx(c);
+	  return FALSE;
+	}
+
+	if ( (rval=acquire_db_cursor(db, txn, &c->cursor, &c->cached)) )
+	{ free_get_ctx(c);
+	  return db_status(rval, handle);
+	}
+	DEBUG(Sdprintf("Created cursor at %p\n", c->cursor));
+
+	METERED(&db->metrics[M_GET],
+		rval = c->cursor->c_get(c->cursor, &c->key, &c->value, DB_SET));
+	if ( rval == 0 )
+	{ fid = PL_open_foreign_frame();
+	  if ( unify_dbt(value, db->value_type, db->dict, &c->value) )
+	  { DO_DEL;
+
+	    PL_close_foreign_frame(fid);
+	    PL_retry_address(c);
+	  }
+
+	  PL_rewind_foreign_frame(fid);
+	  goto retry;
+	}
+	goto out;
+      } else				/* Unique DB */
+      { DBT v;
+	value_cache *vc = (txn ? NULL : db->vcache);
+	uint64_t gen = 0;
+	int rc;
+
+	if ( vc && !del )
+	{ term_t tmp = PL_new_term_ref();
+
+	  if ( (rc=vc_lookup(vc, &k, tmp, &gen)) )
+	  { free_dbt_buf(&k, db->key_type);
+	    return rc > 0 && PL_unify(value, tmp);
+	  }
+	}
+
+	init_result_dbt(db, &v, tb);
+	if ( (rval=get_result_dbt(db, txn, &k, &v, tb)) == 0 )
+	{ if ( vc && !del )
+	  { term_t tmp = PL_new_term_ref();
+
+	    if ( (rc=unify_dbt(tmp, db->value_type, db->dict, &v)) )
+	    { vc_insert(vc, &k, &v, tmp, gen);
+	      rc = PL_unify(value, tmp);
+	    }
+	  } else
+	    rc = unify_dbt(value, db->value_type, db->dict, &v);
+
+	  free_result_dbt(&v);
+	  if ( rc && del )
+	  { int flags = 0;
+
+	    METERED(&db->metrics[M_DEL],
+		    rval = db->db->del(db->db, txn, &k, flags));
+	    if ( rval == 0 )
+	      cache_write(db, t, &k);
+	    rc = db_status(rval, handle);
+	  }
+	} else
+	  rc = db_status(rval, handle);
+
+	free_dbt_buf(&k, db->key_type);
+
+	return rc;
+      }
+    }
+    case PL_REDO:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+
+    retry:
+      for(;;)
+      { METERED(&db->metrics[M_CURSOR],
+		rval = c->cursor->c_get(c->cursor, &c->k2, &c->value, DB_NEXT));
+
+	if ( rval == 0 && equal_dbt(&c->key, &c->k2) )
+	{ if ( !fid )
+	    fid = PL_open_foreign_frame();
+	  if ( unify_dbt(value, db->value_type, db->dict, &c->value) )
+	  { DO_DEL;
+	    PL_close_foreign_frame(fid);
+	    PL_retry_address(c);
+	  }
+	  PL_rewind_foreign_frame(fid);
+	  continue;
+	}
+	break;
+      }
+      break;
+    case PL_PRUNED:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+      break;
+  }
+
+out:
+  if ( c )
+  { int rc = release_db_cursor(c->cursor, c->cached);
+
+    if ( rval == 0 )
+      rval = rc;
+    DEBUG(Sdprintf("Released cursor at %p\n", c->cursor));
+    free_get_ctx(c);
+  }
+  if ( fid )
+    PL_close_foreign_frame(fid);
+
+  db_status(rval, handle);
+  return FALSE;				/* also on rval = 0! */
+}
+
+
+static foreign_t
+pl_bdb_get(term_t handle, term_t key, term_t value, control_t ctx)
+{ int rval;
+
+  NOSIG(rval = bdb_getdel(handle, key, value, 0, ctx, FALSE));
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_get4(term_t handle, term_t key, term_t value, term_t options,
+	    control_t ctx)
+{ int rval;
+
+  NOSIG(rval = bdb_getdel(handle, key, value, options, ctx, FALSE));
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_del3(term_t handle, term_t key, term_t value, control_t ctx)
+{ int rval;
+
+  NOSIG(rval=bdb_getdel(handle, key, value, 0, ctx, TRUE));
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_del4(term_t handle, term_t key, term_t value, term_t options,
+	    control_t ctx)
+{ int rval;
+
+  NOSIG(rval=bdb_getdel(handle, key, value, options, ctx, TRUE));
+
+  return rval;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_exists/2 and bdb_count/3 do not retrieve the values.  If DB->exists()
+is not available we use a zero-length DB_DBT_PARTIAL get.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+init_partial_dbt(DBT *v, u_int32_t offset, u_int32_t len)
+{ memset(v, 0, sizeof(*v));
+  v->flags = DB_DBT_PARTIAL|DB_DBT_USERMEM;
+  v->doff  = offset;
+  v->dlen  = len;
+}
+
+
+static int
+key_exists(dbh *db, DBT *k)
+{ int rval;
+
+#ifdef DB46
+  NOSIG(rval=db->db->exists(db->db, TheTXN, k, 0));
+#else
+  DBT v;
+
+  init_partial_dbt(&v, 0, 0);
+  NOSIG(rval=db->db->get(db->db, TheTXN, k, &v, 0));
+#endif
+
+  return rval;
+}
+
+
+static foreign_t
+pl_bdb_exists(term_t handle, term_t key)
+{ DBT k;
+  dbh *db;
+  thread_buffers *tb;
+  int rval;
+
+  if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+  rval = key_exists(db, &k);
+  free_dbt_buf(&k, db->key_type);
+
+  return db_status(rval, handle);
+}
+
+
+static foreign_t
+pl_bdb_count(term_t handle, term_t key, term_t count)
+{ DBT k;
+  dbh *db;
+  thread_buffers *tb;
+  db_recno_t n = 0;
+  int rval;
+
+  if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return !PL_exception(0) && PL_unify_integer(count, 0);
+
+  if ( has_duplicates(db) )
+  { DBC *cursor;
+    cached_cursor *cc;
+
+    if ( (rval=acquire_db_cursor(db, TheTXN, &cursor, &cc)) == 0 )
+    { DBT v;
+
+      init_partial_dbt(&v, 0, 0);
+      NOSIG(rval=cursor->c_get(cursor, &k, &v, DB_SET));
+      if ( rval == 0 )
+	NOSIG(rval=cursor->c_count(cursor, &n, 0));
+      NOSIG(release_db_cursor(cursor, cc));
+    }
+  } else
+  { if ( (rval=key_exists(db, &k)) == 0 )
+      n = 1;
+  }
+  free_dbt_buf(&k, db->key_type);
+
+  if ( rval == DB_NOTFOUND || rval == DB_KEYEMPTY )
+    return PL_unify_integer(count, 0);
+  if ( rval )
+    return db_status(rval, handle);
+
+  return PL_unify_integer(count, n);
+}
+
+
+static int
+check_partial_db(dbh *db, term_t handle)
+{ if ( db->value_type != D_CBLOB )
+    return PL_permission_error("partial_access", "bdb", handle);
+
+  return TRUE;
+}
+
+
+static foreign_t
+pl_bdb_get_partial(term_t handle, term_t key, term_t offset, term_t length,
+		   term_t bytes)
+{ DBT k, v;
+  dbh *db;
+  thread_buffers *tb;
+  u_int32_t off, len;
+  int rval;
+
+  if ( !get_db(handle, &db) || !check_partial_db(db, handle) ||
+       !get_u32_ex(offset, &off) || !get_u32_ex(length, &len) ||
+       !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !lookup_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+  init_result_dbt(db, &v, tb);
+  v.flags |= DB_DBT_PARTIAL;
+  v.doff = off;
+  v.dlen = len;
+  rval = get_result_dbt(db, TheTXN, &k, &v, tb);
+  free_dbt_buf(&k, db->key_type);
+
+  if ( rval == 0 )
+  { int rc = unify_dbt(bytes, db->value_type, db->dict, &v);
+
+    free_result_dbt(&v);
+    return rc;
+  }
+
+  return db_status(rval, handle);
+}
+
+
+static foreign_t
+pl_bdb_put_partial(term_t handle, term_t key, term_t offset, term_t length,
+		   term_t bytes)
+{ DBT k, v;
+  dbh *db;
+  thread_buffers *tb;
+  u_int32_t off, len;
+  int rval;
+
+  if ( !get_db(handle, &db) || !check_partial_db(db, handle) ||
+       !get_u32_ex(offset, &off) || !get_u32_ex(length, &len) ||
+       !(tb=my_buffers()) )
+    return FALSE;
+
+  if ( !get_dbt_buf(key, db->key_type, db->dict, &k, &tb->key) )
+    return FALSE;
+  if ( !get_dbt_buf(bytes, db->value_type, db->dict, &v, &tb->value) )
+  { free_dbt_buf(&k, db->key_type);
+    return FALSE;
+  }
+  v.flags = DB_DBT_PARTIAL;
+  v.doff = off;
+  v.dlen = len;
+
+  NOSIG(rval=db->db->put(db->db, TheTXN, &k, &v, 0));
+  if ( rval == 0 )
+    cache_write(db, top_transaction(), &k);
+  free_dbt_buf(&k, db->key_type);
+
+  return db_status(rval, handle);
+}
+
+
+		 /*******************************
+		 *	  APPEND AND QUEUES	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Recno, queue and heap databases number their records. bdb_append/3 adds
+a record (DB_APPEND) and returns the number  or record id assigned by
+Berkeley DB.
+
+A database of type(queue) holds fixed-length records. bdb_enqueue/3 is
+bdb_append/3 for queues. bdb_dequeue/3,4 remove   the  record at the
+head of the queue (DB_CONSUME). Using wait(true), the default, they wait
+until a record is available (see bdb_dequeue() below). Queues use
+record-level locking, so many threads can  produce and consume without
+contending on a single page.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+check_queue(dbh *db, term_t handle)
+{ if ( db->type != DB_QUEUE )
+    return PL_permission_error("queue", "bdb_database", handle);
+
+  return TRUE;
+}
+
+
+static int
+db_append(dbh *db, term_t handle, term_t value, term_t recno)
+{ DBT k, v;
+  thread_buffers *tb;
+  unsigned char id[HEAP_RID_SIZE];
+  int rval;
+
+  if ( db->key_type != D_RECNO && db->key_type != D_HEAP_RID )
+    return PL_permission_error("append", "bdb_database", handle);
+  if ( !(tb=my_buffers()) ||
+       !get_dbt_buf(value, db->value_type, db->dict, &v, &tb->value) )
+    return FALSE;
+
+  memset(&k, 0, sizeof(k));
+  k.data  = id;
+  k.ulen  = sizeof(id);
+  k.flags = DB_DBT_USERMEM;
+  NOSIG(METERED(&db->metrics[M_PUT],
+		rval = db->db->put(db->db, TheTXN, &k, &v, DB_APPEND)));
+  free_dbt_buf(&v, db->value_type);
+  if ( rval )
+    return db_status(rval, handle);
+
+  return unify_dbt(recno, db->key_type, db->dict, &k);
+}
+
+
+static foreign_t
+pl_bdb_append(term_t handle, term_t value, term_t recno)
+{ dbh *db;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+
+  return db_append(db, handle, value, recno);
+}
+
+
+static foreign_t
+pl_bdb_enqueue(term_t handle, term_t value, term_t recno)
+{ dbh *db;
+
+  if ( !get_db(handle, &db) || !check_queue(db, handle) )
+    return FALSE;
+
+  return db_append(db, handle, value, recno);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_dequeue() does not use DB_CONSUME_WAIT  because   this  blocks the
+thread in Berkeley DB without a timeout, so it cannot be signalled and
+the database may be closed under it.  Instead,  we poll using DB_CONSUME
+with an interval that  doubles  up   to  DEQUEUE_MAX_SLICE  microseconds,
+handling signals and checking the handle between the polls.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define DEQUEUE_MIN_SLICE 1000
+#define DEQUEUE_MAX_SLICE 100000
+
+static foreign_t
+bdb_dequeue(term_t handle, term_t recno, term_t value, term_t options)
+{ DBT k, v;
+  dbh *db;
+  transaction *t = top_transaction();
+  db_recno_t n = 0;
+  int wait = TRUE;
+  double timeout = -1.0;		/* < 0: wait forever */
+  double waited = 0.0;
+  long slice = DEQUEUE_MIN_SLICE;
+  int rval, rc;
+
+  if ( !get_db(handle, &db) || !check_queue(db, handle) )
+    return FALSE;
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
+
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      size_t arity;
+
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("dequeue_option", head);
+      _PL_get_arg(1, head, arg);
+      if ( name == ATOM_wait )
+      { if ( !PL_get_bool_ex(arg, &wait) )
+	  return FALSE;
+      } else if ( name == ATOM_timeout )
+      { if ( !PL_get_float_ex(arg, &timeout) )
+	  return FALSE;
+	if ( timeout < 0.0 )
+	  return PL_domain_error("bdb_timeout", arg);
+      } else if ( name == ATOM_txn )
+      { if ( !get_db_txn(arg, db, &t) )
+	  return FALSE;
+      } else
+	return PL_domain_error("dequeue_option", head);
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
+  }
+
+  memset(&k, 0, sizeof(k));
+  k.data  = &n;
+  k.ulen  = sizeof(n);
+  k.flags = DB_DBT_USERMEM;
+  memset(&v, 0, sizeof(v));
+  v.flags = DB_DBT_MALLOC;
+  for(;;)
+  { struct timespec ts;
+
+    NOSIG(METERED(&db->metrics[M_DEL],
+		  rval = db->db->get(db->db, t ? t->tid : NULL, &k, &v,
+				     DB_CONSUME)));
+    if ( rval != DB_NOTFOUND || !wait ||
+	 (timeout >= 0.0 && waited >= timeout) )
+      break;
+
+    ts.tv_sec  = slice/1000000;
+    ts.tv_nsec = (slice%1000000)*1000;
+    nanosleep(&ts, NULL);
+    waited += (double)slice/1000000.0;
+    if ( (slice *= 2) > DEQUEUE_MAX_SLICE )
+      slice = DEQUEUE_MAX_SLICE;
+
+    if ( PL_handle_signals() < 0 ||
+	 !get_db(handle, &db) )		/* closed while waiting */
+      return FALSE;
+  }
+  if ( rval )
+    return db_status(rval, handle);
+  cache_write(db, t, &k);
+
+  rc = ( unify_dbt(recno, D_RECNO, NULL, &k) &&
+	 unify_dbt(value, db->value_type, db->dict, &v) );
+  free_result_dbt(&v);
+
+  return rc;
+}
+
+
+static foreign_t
+pl_bdb_dequeue3(term_t handle, term_t recno, term_t value)
+{ return bdb_dequeue(handle, recno, value, 0);
+}
+
+
+static foreign_t
+pl_bdb_dequeue4(term_t handle, term_t recno, term_t value, term_t options)
+{ return bdb_dequeue(handle, recno, value, options);
+}
+
+
+		 /*******************************
+		 *	      SEQUENCES		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A sequence is a persistent counter stored as a record in a database.
+With cache(Count), the DB_SEQUENCE handle  reserves Count values at a
+time, so most calls to bdb_sequence_next/2,3   do  not access the
+database. As the handle is shared between   threads, threads allocating
+ids do not contend on a record or the log.
+
+Sequences are blobs. The blob keeps  a   reference  to the database
+blob, so the database is not garbage   collected  before the sequence.
+The sequence must be closed before the database is closed explicitly.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#ifdef DB43
+
+typedef struct sequence
+{ DB_SEQUENCE  *seq;			/* the sequence */
+  dbh	       *db;			/* database holding it */
+  atom_t	symbol;			/* <bdb_sequence>(...) */
+  atom_t	db_symbol;		/* symbol of the database */
+  int32_t	cache;			/* cached values */
+} sequence;
+
+
+static void
+acquire_sequence(atom_t symbol)
+{ sequence *s = PL_blob_data(symbol, NULL, NULL);
+  s->symbol = symbol;
+}
+
+
+static int
+release_sequence(atom_t symbol)
+{ sequence *s = PL_blob_data(symbol, NULL, NULL);
+
+  if ( s->seq && s->db->db )
+    s->seq->close(s->seq, 0);
+  s->seq = NULL;
+  if ( s->db_symbol )
+    PL_unregister_atom(s->db_symbol);
+  free(s);
+
+  return TRUE;
+}
+
+static int
+compare_sequences(atom_t a, atom_t b)
+{ sequence *ara = PL_blob_data(a, NULL, NULL);
+  sequence *arb = PL_blob_data(b, NULL, NULL);
+
+  return ( ara > arb ?  1 :
+	   ara < arb ? -1 : 0
+	 );
+}
+
+static int
+write_sequence(IOSTREAM *s, atom_t symbol, int flags)
+{ sequence *seq = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<bdb_sequence>(%p)", seq);
+
+  return TRUE;
+}
+
+static PL_blob_t sequence_blob =
+{ PL_BLOB_MAGIC,
+  PL_BLOB_NOCOPY,
+  "bdb_sequence",
+  release_sequence,
+  compare_sequences,
+  write_sequence,
+  acquire_sequence
+};
+
+
+static bool
+get_sequence(term_t t, sequence **sp)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &sequence_blob)
+  { sequence *p = data;
+
+    if ( p->seq && p->db->db )
+    { *sp = p;
+
+      return true;
+    }
+
+    return PL_permission_error("access", "closed_bdb_sequence", t),false;
+  }
+
+  return PL_type_error("bdb_sequence", t),false;
+}
+
+
+static int
+get_seq_options(term_t options, DB_SEQUENCE *seq, int32_t *cache)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+  db_seq_t min = INT64_MIN, max = INT64_MAX;
+  u_int32_t flags = 0;
+  int rval;
+
+  *cache = 0;
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("sequence_option", head);
+    _PL_get_arg(1, head, arg);
+
+    if ( name == ATOM_initial )
+    { int64_t v;
+
+      if ( !PL_get_int64_ex(arg, &v) )
+	return FALSE;
+      if ( (rval=seq->initial_value(seq, v)) )
+	return db_status(rval, options);
+    } else if ( name == ATOM_min || name == ATOM_max )
+    { int64_t v;
+
+      if ( !PL_get_int64_ex(arg, &v) )
+	return FALSE;
+      if ( name == ATOM_min )
+	min = v;
+      else
+	max = v;
+    } else if ( name == ATOM_cache )
+    { u_int32_t v;
+
+      if ( !get_u32_ex(arg, &v) )
+	return FALSE;
+      if ( v > INT32_MAX )
+	return PL_domain_error("sequence_cache", arg);
+      *cache = (int32_t)v;
+    } else if ( name == ATOM_decrement || name == ATOM_wrap )
+    { int v;
+
+      if ( !PL_get_bool_ex(arg, &v) )
+	return FALSE;
+      if ( v )
+	flags |= (name == ATOM_wrap ? DB_SEQ_WRAP : DB_SEQ_DEC);
+    } else
+      return PL_domain_error("sequence_option", head);
+  }
+  if ( !PL_get_nil_ex(tail) )
+    return FALSE;
+
+  if ( ( (min != INT64_MIN || max != INT64_MAX) &&
+	 (rval=seq->set_range(seq, min, max)) ) ||
+       (rval=seq->set_flags(seq, (flags&DB_SEQ_DEC) ? flags
+						    : flags|DB_SEQ_INC)) ||
+       ( *cache && (rval=seq->set_cachesize(seq, *cache)) ) )
+    return db_status(rval, options);
+
+  return TRUE;
+}
+
+
+static foreign_t
+pl_bdb_sequence_open(term_t handle, term_t key, term_t seqh, term_t options)
+{ dbh *db;
+  sequence *s;
+  DB_SEQUENCE *seq;
+  DBT k;
+  u_int32_t flags = DB_CREATE;
+  int rval;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+  if ( (rval=db_sequence_create(&seq, db->db, 0)) )
+    return db_status(rval, handle);
+  if ( !(s=calloc(1, sizeof(*s))) )
+  { seq->close(seq, 0);
+    return PL_resource_error("memory");
+  }
+  if ( !get_seq_options(options, seq, &s->cache) ||
+       !get_dbt(key, db->key_type, db->dict, &k) )
+  { seq->close(seq, 0);
+    free(s);
+    return FALSE;
+  }
+
+  if ( (db->env->flags&DB_THREAD) )
+    flags |= DB_THREAD;
+  NOSIG(rval=seq->open(seq, TheTXN, &k, flags));
+  free_dbt(&k, db->key_type);
+  if ( rval )
+  { seq->close(seq, 0);
+    free(s);
+    return db_status(rval, handle);
+  }
+
+  s->seq = seq;
+  s->db  = db;
+  if ( (s->db_symbol = db->symbol) )
+    PL_register_atom(s->db_symbol);
+
+  return PL_unify_blob(seqh, s, sizeof(*s), &sequence_blob);
+}
+
+
+static foreign_t
+bdb_sequence_next(term_t seqh, term_t value, term_t options)
+{ sequence *s;
+  DB_TXN *txn;
+  int32_t delta = 1;
+  db_seq_t v;
+  int rval;
+
+  if ( !get_sequence(seqh, &s) )
+    return FALSE;
+  txn = (s->cache ? NULL : TheTXN);	/* cached sequences: no txn */
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
+
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      size_t arity;
+
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("sequence_option", head);
+      _PL_get_arg(1, head, arg);
+      if ( name == ATOM_delta )
+      { u_int32_t d;
+
+	if ( !get_u32_ex(arg, &d) )
+	  return FALSE;
+	if ( d < 1 || d > INT32_MAX )
+	  return PL_domain_error("sequence_delta", arg);
+	delta = (int32_t)d;
+      } else if ( name == ATOM_txn )
+      { transaction *t;
+
+	if ( !get_db_txn(arg, s->db, &t) )
+	  return FALSE;
+	txn = t->tid;
+      } else
+	return PL_domain_error("sequence_option", head);
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
+  }
+
+  NOSIG(rval=s->seq->get(s->seq, txn, delta, &v, 0));
+  if ( rval )
+    return db_status(rval, seqh);
+
+  return PL_unify_int64(value, v);
+}
+
+
+static foreign_t
+pl_bdb_sequence_next2(term_t seqh, term_t value)
+{ return bdb_sequence_next(seqh, value, 0);
+}
+
+
+static foreign_t
+pl_bdb_sequence_next3(term_t seqh, term_t value, term_t options)
+{ return bdb_sequence_next(seqh, value, options);
+}
+
+
+static foreign_t
+pl_bdb_sequence_close(term_t seqh)
+{ sequence *s;
+  DB_SEQUENCE *seq;
+  int rval;
+
+  if ( !get_sequence(seqh, &s) )
+    return FALSE;
+  seq = s->seq;
+  s->seq = NULL;
+  NOSIG(rval=seq->close(seq, 0));
+
+  return db_status(rval, seqh);
+}
+
+#endif /*DB43*/
+
+
+		 /*******************************
+		 *	 SECONDARY INDEXES	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_associate/3 makes a database a  secondary   index  of a primary using
+DB->associate(). The secondary key is computed  by extract_key() from a
+declarative key extractor, so no Prolog   goal is called for each write.
+The extractor is one of
+
+  - value
+    The value of the primary is the key.  If the key type of the
+    secondary is the value type of the primary, the encoded value is
+    used as is.
+  - arg(N) or path([N1,...])
+    The value is decoded and the key is the (nested) argument.  If the
+    value has no such argument, the record is not indexed.
+  - bytes(Offset, Length)
+    The bytes of a c_blob value, used as the encoded key.  Records
+    shorter than Offset are not indexed.
+
+The secondary locks the  blob  of  the   primary,  such  that  the
+primary cannot be garbage collected before the secondary.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef enum
+{ KX_VALUE,				/* the value itself */
+  KX_PATH,				/* argument path into the value */
+  KX_BYTES				/* byte range of a c_blob value */
+} kx_type;
+
+typedef struct key_extractor
+{ kx_type	type;			/* KX_* */
+  u_int32_t	offset;			/* KX_BYTES: offset */
+  u_int32_t	length;			/* KX_BYTES: length */
+  size_t	path_len;		/* KX_PATH: length of path */
+  int		path[];			/* KX_PATH: argument indexes */
+} key_extractor;
+
+
+static void
+release_association(dbh *db)
+{ if ( db->primary_symbol )
+  { PL_unregister_atom(db->primary_symbol);
+    db->primary_symbol = 0;
+  }
+  db->primary = NULL;
+  if ( db->extractor )
+  { free(db->extractor);
+    db->extractor = NULL;
+  }
+}
+
+
+static int
+extract_term_key(dbh *db, const key_extractor *kx, const DBT *pdata,
+		 DBT *skey)
+{ fid_t fid;
+  term_t t, a;
+  int rval = EINVAL;
+
+  if ( !(fid=PL_open_foreign_frame()) )
+    return ENOMEM;
+  t = PL_new_term_ref();
+  a = PL_new_term_ref();
+
+  if ( unify_dbt(t, db->primary->value_type, db->primary->dict, (DBT*)pdata) )
+  { size_t i;
+    DBT k;
+
+    rval = 0;
+    for(i=0; i<kx->path_len; i++)
+    { if ( !PL_get_arg(kx->path[i], t, a) )
+      { rval = DB_DONOTINDEX;
+	break;
+      }
+      PL_put_term(t, a);
+    }
+
+    if ( rval == 0 )
+    { if ( get_dbt(t, db->key_type, db->dict, &k) )
+      { if ( (skey->data = malloc(k.size ? k.size : 1)) )
+	{ memcpy(skey->data, k.data, k.size);
+	  skey->size  = k.size;
+	  skey->flags = DB_DBT_APPMALLOC;
+	} else
+	  rval = ENOMEM;
+	free_dbt(&k, db->key_type);
+      } else
+	rval = EINVAL;
+    }
+  }
+  if ( rval == EINVAL )
+    PL_clear_exception();
+  PL_discard_foreign_frame(fid);
+
+  return rval;
+}
+
+
+static int
+extract_key(DB *sdb, const DBT *pkey, const DBT *pdata, DBT *skey)
+{ dbh *db = sdb->app_private;
+  const key_extractor *kx = db->extractor;
+
+  memset(skey, 0, sizeof(*skey));
+  switch(kx->type)
+  { case KX_VALUE:
+      if ( db->key_type == db->primary->value_type &&
+	   (db->key_type != D_TERM_DICT || db->dict == db->primary->dict) )
+      { skey->data = pdata->data;		/* same encoding: copy */
+	skey->size = pdata->size;
+	return 0;
+      }
+      return extract_term_key(db, kx, pdata, skey);
+    case KX_PATH:
+      return extract_term_key(db, kx, pdata, skey);
+    case KX_BYTES:
+    { u_int32_t left;
+
+      if ( pdata->size < kx->offset )
+	return DB_DONOTINDEX;
+      left = pdata->size - kx->offset;
+      skey->data = (char*)pdata->data + kx->offset;
+      skey->size = left < kx->length ? left : kx->length;
+      return 0;
+    }
+  }
+
+  return EINVAL;
+}
+
+
+static int
+get_key_extractor(term_t t, dbh *primary, key_extractor **kxp)
+{ atom_t name;
+  size_t arity;
+  key_extractor *kx;
+
+  if ( !PL_get_name_arity(t, &name, &arity) )
+    return PL_type_error("key_extractor", t);
+
+  if ( name == ATOM_value && arity == 0 )
+  { if ( !(kx=calloc(1, sizeof(*kx))) )
+      return PL_resource_error("memory");
+    kx->type = KX_VALUE;
+  } else if ( name == ATOM_arg && arity == 1 )
+  { term_t a = PL_new_term_ref();
+    int n;
+
+    _PL_get_arg(1, t, a);
+    if ( !PL_get_integer_ex(a, &n) )
+      return FALSE;
+    if ( n < 1 )
+      return PL_domain_error("not_less_than_one", a);
+    if ( !(kx=calloc(1, sizeof(*kx)+sizeof(int))) )
+      return PL_resource_error("memory");
+    kx->type = KX_PATH;
+    kx->path_len = 1;
+    kx->path[0] = n;
+  } else if ( name == ATOM_path && arity == 1 )
+  { term_t tail = PL_new_term_ref();
+    term_t head = PL_new_term_ref();
+    size_t len;
+
+    _PL_get_arg(1, t, tail);
+    if ( PL_skip_list(tail, 0, &len) != PL_LIST )
+      return PL_type_error("list", tail);
+    if ( !(kx=calloc(1, sizeof(*kx)+len*sizeof(int))) )
+      return PL_resource_error("memory");
+    kx->type = KX_PATH;
+    while( PL_get_list(tail, head, tail) )
+    { int n;
+
+      if ( !PL_get_integer_ex(head, &n) )
+      { free(kx);
+	return FALSE;
+      }
+      if ( n < 1 )
+      { free(kx);
+	return PL_domain_error("not_less_than_one", head);
+      }
+      kx->path[kx->path_len++] = n;
+    }
+  } else if ( name == ATOM_bytes && arity == 2 )
+  { term_t a = PL_new_term_ref();
+    u_int32_t off, len;
+
+    _PL_get_arg(1, t, a);
+    if ( !get_u32_ex(a, &off) )
+      return FALSE;
+    _PL_get_arg(2, t, a);
+    if ( !get_u32_ex(a, &len) )
+      return FALSE;
+    if ( primary->value_type != D_CBLOB )
+      return PL_permission_error("partial_access", "bdb", t);
+    if ( !(kx=calloc(1, sizeof(*kx))) )
+      return PL_resource_error("memory");
+    kx->type = KX_BYTES;
+    kx->offset = off;
+    kx->length = len;
+  } else
+    return PL_domain_error("key_extractor", t),FALSE;
+
+  *kxp = kx;
+  return TRUE;
+}
+
+
+static foreign_t
+pl_bdb_associate(term_t primary, term_t secondary, term_t extractor)
+{ dbh *pdb, *sdb;
+  key_extractor *kx = NULL;
+  int rval;
+
+  if ( !get_db(primary, &pdb) ||
+       !get_db(secondary, &sdb) )
+    return FALSE;
+  if ( sdb->primary || sdb == pdb || sdb->vcache )
+    return PL_permission_error("associate", "bdb", secondary);
+  if ( !get_key_extractor(extractor, pdb, &kx) )
+    return FALSE;
+
+  sdb->primary = pdb;
+  sdb->extractor = kx;
+  sdb->db->app_private = sdb;
+  NOSIG(rval=pdb->db->associate(pdb->db, TheTXN, sdb->db, extract_key,
+				DB_CREATE));
+  if ( rval )
+  { sdb->primary = NULL;
+    sdb->extractor = NULL;
+    free(kx);
+    return db_status(rval, secondary);
+  }
+  sdb->primary_symbol = pdb->symbol;
+  PL_register_atom(sdb->primary_symbol);
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_pget/4 enumerates the primary  keys   and  values associated with a
+secondary key using DBC->c_pget(), walking the   duplicates of the key
+with DB_NEXT_DUP.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+unify_pget(dbget_ctx *c, term_t pkey, term_t value)
+{ dbh *pdb = c->db->primary;
+
+  return ( unify_dbt(pkey, pdb->key_type, pdb->dict, &c->pkey) &&
+	   unify_dbt(value, pdb->value_type, pdb->dict, &c->value) );
+}
+
+
+static foreign_t
+pl_bdb_pget(term_t handle, term_t skey, term_t pkey, term_t value,
+	    control_t ctx)
+{ dbh *db;
+  thread_buffers *tb;
+  int rval = 0;
+  dbget_ctx *c = NULL;
+  fid_t fid = 0;
+
+  switch( PL_foreign_control(ctx) )
+  { case PL_FIRST_CALL:
+    { DBT k;
+      int rc;
+
+      if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+	return FALSE;
+      if ( !db->primary )
+	return PL_permission_error("pget", "bdb", handle);
+      if ( !lookup_dbt_buf(skey, db->key_type, db->dict, &k, &tb->key) )
+	return FALSE;
+
+      if ( !(c=alloc_get_ctx(tb, db)) )
+      { free_dbt_buf(&k, db->key_type);
+	return FALSE;
+      }
+      rc = set_get_ctx_key(c, &k);
+      free_dbt_buf(&k, db->key_type);
+      if ( !rc )
+      { free_get_ctx(c);
+	return FALSE;
+      }
+
+      if ( (rval=acquire_db_cursor(db, TheTXN, &c->cursor, &c->cached)) )
+      { free_get_ctx(c);
+	return db_status(rval, handle);
+      }
+
+      NOSIG(rval=c->cursor->c_pget(c->cursor, &c->key, &c->pkey, &c->value,
+				   DB_SET));
+      if ( rval == 0 )
+      { fid = PL_open_foreign_frame();
+	if ( unify_pget(c, pkey, value) )
+	{ PL_close_foreign_frame(fid);
+	  PL_retry_address(c);
+	}
+	PL_rewind_foreign_frame(fid);
+	goto retry;
+      }
+      goto out;
+    }
+    case PL_REDO:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+
+    retry:
+      for(;;)
+      { NOSIG(rval=c->cursor->c_pget(c->cursor, &c->k2, &c->pkey, &c->value,
+				     DB_NEXT_DUP));
+	if ( rval == 0 )
+	{ if ( !fid )
+	    fid = PL_open_foreign_frame();
+	  if ( unify_pget(c, pkey, value) )
+	  { PL_close_foreign_frame(fid);
+	    PL_retry_address(c);
+	  }
+	  PL_rewind_foreign_frame(fid);
+	  continue;
+	}
+	break;
+      }
+      break;
+    case PL_PRUNED:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+      break;
+  }
+
+out:
+  if ( c )
+  { int rc = release_db_cursor(c->cursor, c->cached);
+
+    if ( rval == 0 )
+      rval = rc;
+    free_get_ctx(c);
+  }
+  if ( fid )
+    PL_close_foreign_frame(fid);
+
+  db_status(rval, handle);
+  return FALSE;				/* also on rval = 0! */
+}
+
+
+		 /*******************************
+		 *	     BULK ACCESS		*
+		 *******************************/
+
+#define BULK_BUFSIZE (64*1024)		/* initial DB_MULTIPLE buffer */
+
+typedef struct bulk_key
+{ DBT	 key;				/* encoded key */
+  term_t term;				/* Prolog key */
+} bulk_key;
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+compare_dbt() compares two  encoded  keys   the  same  way  as the default
+btree comparison function: bytewise, where a prefix sorts before the longer
+key.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+compare_dbt(const DBT *a, const DBT *b)
+{ u_int32_t len = a->size < b->size ? a->size : b->size;
+  int d;
+
+  if ( len && (d=memcmp(a->data, b->data, len)) != 0 )
+    return d;
+
+  return ( a->size < b->size ? -1 :
+	   a->size > b->size ?  1 : 0
+	 );
+}
+
+static int
+compare_bulk_keys(const void *p1, const void *p2)
+{ const bulk_key *k1 = p1;
+  const bulk_key *k2 = p2;
+
+  return compare_dbt(&k1->key, &k2->key);
+}
+
+
+static int
+init_bulk_buffer(DBT *buf)
+{ memset(buf, 0, sizeof(*buf));
+  if ( !(buf->data = malloc(BULK_BUFSIZE)) )
+    return PL_resource_error("memory");
+  buf->ulen  = BULK_BUFSIZE;
+  buf->flags = DB_DBT_USERMEM;
+
+  return TRUE;
+}
+
+/* Grow buf after DB_BUFFER_SMALL.  The size must be a multiple of 1024 */
+
+static int
+grow_bulk_buffer(DBT *buf)
+{ u_int32_t size = (buf->size+1023) & ~(u_int32_t)1023;
+  void *p;
+
+  if ( size <= buf->ulen )
+    size = buf->ulen*2;
+  if ( !(p = realloc(buf->data, size)) )
+    return PL_resource_error("memory");
+  buf->data = p;
+  buf->ulen = size;
+
+  return TRUE;
+}
+
+
+static int
+add_bulk_pair(term_t tail, term_t key, dtype type, struct term_dict *dict,
+	      void *data, u_int32_t len)
+{ term_t head = PL_new_term_ref();
+  term_t v    = PL_new_term_ref();
+  DBT d;
+
+  memset(&d, 0, sizeof(d));
+  d.data = data;
+  d.size = len;
+
+  return ( PL_unify_list(tail, head, tail) &&
+	   unify_dbt(v, type, dict, &d) &&
+	   PL_unify_term(head, PL_FUNCTOR, FUNCTOR_minus2,
+				 PL_TERM, key,
+				 PL_TERM, v) );
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+get_many_btree() fetches the values for  a   sorted  array of keys from a
+btree. The cursor is positioned using  DB_SET_RANGE|DB_MULTIPLE_KEY, which
+fills  the  buffer  with  the  following  key/value  pairs  in  order. As
+long as the next requested keys are  in   the  buffer  we do not need to
+access the database again. If the buffer   is exhausted while we are still
+collecting duplicates, we continue using DB_NEXT.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+get_many_btree(dbh *db, DBC *cursor, bulk_key *keys, size_t nkeys,
+	       DBT *buf, term_t tail)
+{ void *p = NULL;
+  size_t i = 0;
+  int matched = FALSE;
+
+  while( i < nkeys )
+  { void *prev = p;
+    void *rk, *rd;
+    u_int32_t rklen, rdlen;
+    DBT rkey;
+    int cmp;
+
+    if ( !p )				/* (re)fill the buffer */
+    { DBT k = keys[i].key;
+      int rval;
+
+      NOSIG(rval=cursor->c_get(cursor, &k, buf,
+			       (matched ? DB_NEXT : DB_SET_RANGE)|
+			       DB_MULTIPLE_KEY));
+      if ( rval == DB_BUFFER_SMALL )
+      { if ( !grow_bulk_buffer(buf) )
+	  return FALSE;
+	continue;
+      }
+      if ( rval == DB_NOTFOUND )
+	return TRUE;			/* no more keys >= keys[i] */
+      if ( rval )
+	return db_status_db(rval, db);
+
+      DB_MULTIPLE_INIT(p, buf);
+      prev = p;
+    }
+
+    DB_MULTIPLE_KEY_NEXT(p, buf, rk, rklen, rd, rdlen);
+    if ( !p )
+      continue;				/* buffer exhausted */
+
+    memset(&rkey, 0, sizeof(rkey));
+    rkey.data = rk;
+    rkey.size = rklen;
+    cmp = compare_dbt(&rkey, &keys[i].key);
+
+    if ( cmp < 0 )
+    { continue;
+    } else if ( cmp == 0 )
+    { if ( !add_bulk_pair(tail, keys[i].term, db->value_type, db->dict,
+			      rd, rdlen) )
+	return FALSE;
+      matched = TRUE;
+    } else
+    { p = prev;				/* re-examine for the next key */
+      matched = FALSE;
+      i++;
+    }
+  }
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+get_many_keyed() handles the other  access   methods.  Each  key is located
+using DB_SET|DB_MULTIPLE, which returns  all   duplicates  of  the key in
+one buffer.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+get_many_keyed(dbh *db, DBC *cursor, bulk_key *keys, size_t nkeys,
+	       DBT *buf, term_t tail)
+{ size_t i;
+
+  for(i=0; i<nkeys; i++)
+  { u_int32_t flags = DB_SET|DB_MULTIPLE;
+
+    for(;;)
+    { DBT k = keys[i].key;
+      void *p, *rd;
+      u_int32_t rdlen;
+      int rval;
+
+      NOSIG(rval=cursor->c_get(cursor, &k, buf, flags));
+      if ( rval == DB_BUFFER_SMALL )
+      { if ( !grow_bulk_buffer(buf) )
+	  return FALSE;
+	continue;
+      }
+      if ( rval == DB_NOTFOUND || rval == DB_KEYEMPTY )
+	break;
+      if ( rval )
+	return db_status_db(rval, db);
+
+      DB_MULTIPLE_INIT(p, buf);
+      for(;;)
+      { DB_MULTIPLE_NEXT(p, buf, rd, rdlen);
+	if ( !p )
+	  break;
+	if ( !add_bulk_pair(tail, keys[i].term, db->value_type, db->dict,
+			      rd, rdlen) )
+	  return FALSE;
+      }
+
+      if ( !has_duplicates(db) )
+	break;
+      flags = DB_NEXT_DUP|DB_MULTIPLE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+static foreign_t
+pl_bdb_get_many(term_t handle, term_t keylist, term_t pairs)
+{ dbh *db;
+  size_t len, nkeys = 0, i;
+  bulk_key *keys = NULL;
+  term_t tail, tail_out;
+  DBC *cursor = NULL;
+  DBT buf;
+  int rc = FALSE;
+  int rval;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+  if ( PL_skip_list(keylist, 0, &len) != PL_LIST )
+    return PL_type_error("list", keylist);
+
+  memset(&buf, 0, sizeof(buf));
+  if ( len > 0 && !(keys = calloc(len, sizeof(*keys))) )
+    return PL_resource_error("memory");
+
+  tail = PL_copy_term_ref(keylist);
+  for(i=0; i<len; i++)
+  { term_t kt = PL_new_term_ref();
+
+    if ( !PL_get_list(tail, kt, tail) )
+      goto out;
+    if ( !lookup_dbt(kt, db->key_type, db->dict, &keys[nkeys].key) )
+    { if ( PL_exception(0) )
+	goto out;
+      continue;				/* not in the term_dict dictionary */
+    }
+    keys[nkeys++].term = kt;
+  }
+
+  qsort(keys, nkeys, sizeof(*keys), compare_bulk_keys);
+  if ( nkeys > 1 )			/* remove duplicate keys */
+  { size_t n = 1;
+
+    for(i=1; i<nkeys; i++)
+    { if ( compare_dbt(&keys[n-1].key, &keys[i].key) == 0 )
+	free_dbt(&keys[i].key, db->key_type);
+      else
+	keys[n++] = keys[i];
+    }
+    nkeys = n;
+  }
+
+  if ( !init_bulk_buffer(&buf) )
+    goto out;
+  NOSIG(rval=db->db->cursor(db->db, TheTXN, &cursor, 0));
+  if ( rval )
+  { cursor = NULL;
+    db_status(rval, handle);
+    goto out;
+  }
+
+  tail_out = PL_copy_term_ref(pairs);
+  if ( db->type == DB_BTREE )
+    rc = get_many_btree(db, cursor, keys, nkeys, &buf, tail_out);
   else
-    return PL_domain_error("type", t);
+    rc = get_many_keyed(db, cursor, keys, nkeys, &buf, tail_out);
+  if ( rc )
+    rc = PL_unify_nil(tail_out);
+
+out:
+  if ( cursor )
+  { NOSIG(rval=cursor->c_close(cursor));
+    if ( rc && rval )
+      rc = db_status(rval, handle);
+  }
+  for(i=0; i<nkeys; i++)
+    free_dbt(&keys[i].key, db->key_type);
+  if ( keys )
+    free(keys);
+  if ( buf.data )
+    free(buf.data);
+
+  return rc;
+}
+
+
+typedef struct bulk_pair
+{ DBT	 key;				/* encoded key */
+  DBT	 value;				/* encoded value */
+  size_t index;				/* position in input (stable sort) */
+} bulk_pair;
+
+static int
+compare_bulk_pairs(const void *p1, const void *p2)
+{ const bulk_pair *b1 = p1;
+  const bulk_pair *b2 = p2;
+  int d;
+
+  if ( (d=compare_dbt(&b1->key, &b2->key)) != 0 )
+    return d;
+
+  return b1->index < b2->index ? -1 : b1->index > b2->index ? 1 : 0;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+put_chunk() writes n pairs. If the  DB   version  supports  bulk updates
+(4.8 and later), all pairs are  written   into  a  single buffer that is
+passed to DB->put() using DB_MULTIPLE_KEY.   A bulk put stops at a pair
+that already exists in a database   with  sorted duplicates. In that case
+we redo the chunk pair by pair, ignoring the existing pairs.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+put_chunk(dbh *db, DB_TXN *txn, bulk_pair *pairs, size_t n, DBT *buf)
+{ size_t i;
+  int rval;
+#ifdef DB_MULTIPLE_KEY_WRITE_NEXT
+  size_t size = sizeof(u_int32_t);
+  void *p;
+  DBT dummy;
+
+  for(i=0; i<n; i++)
+    size += pairs[i].key.size + pairs[i].value.size + 4*sizeof(u_int32_t);
+  size = (size+1023) & ~(size_t)1023;
+  if ( size > UINT32_MAX )
+    return ENOMEM;
+
+  if ( size > buf->ulen )
+  { void *new;
+
+    if ( !(new = realloc(buf->data, size)) )
+      return ENOMEM;
+    buf->data = new;
+    buf->ulen = (u_int32_t)size;
+  }
+  buf->flags = DB_DBT_USERMEM;
+
+  DB_MULTIPLE_WRITE_INIT(p, buf);
+  for(i=0; i<n; i++)
+  { DB_MULTIPLE_KEY_WRITE_NEXT(p, buf,
+			       pairs[i].key.data,   pairs[i].key.size,
+			       pairs[i].value.data, pairs[i].value.size);
+    assert(p);
+  }
+
+  memset(&dummy, 0, sizeof(dummy));
+  rval = db->db->put(db->db, txn, buf, &dummy, DB_MULTIPLE_KEY);
+  if ( rval != DB_KEYEXIST )
+    return rval;
+#endif
+
+  for(i=0; i<n; i++)
+  { rval = db->db->put(db->db, txn, &pairs[i].key, &pairs[i].value, 0);
+    if ( rval == DB_KEYEXIST && (db->flags&DB_DUPSORT) )
+      continue;
+    if ( rval )
+      return rval;
+  }
+
+  return 0;
+}
+
+
+static foreign_t
+pl_bdb_put_many(term_t handle, term_t pairlist, term_t options)
+{ dbh *db;
+  size_t len, npairs, i;
+  bulk_pair *pairs = NULL;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t a    = PL_new_term_ref();
+  int sort;
+  size_t chunk = 0;
+  DB_TXN *txn;
+  DBT buf;
+  int rc = FALSE;
+  int rval = 0;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+  sort = (db->type == DB_BTREE);
+
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("option", head);
+    _PL_get_arg(1, head, a);
+    if ( name == ATOM_sort )
+    { if ( !PL_get_bool_ex(a, &sort) )
+	return FALSE;
+    } else if ( name == ATOM_chunk )
+    { if ( !PL_get_size_ex(a, &chunk) )
+	return FALSE;
+    } else
+      return PL_domain_error("put_many_option", head);
+  }
+  if ( !PL_get_nil_ex(tail) )
+    return FALSE;
+
+  if ( PL_skip_list(pairlist, 0, &len) != PL_LIST )
+    return PL_type_error("list", pairlist);
+  if ( len == 0 )
+    return TRUE;
+  if ( !(pairs = calloc(len, sizeof(*pairs))) )
+    return PL_resource_error("memory");
+
+  tail = PL_copy_term_ref(pairlist);
+  for(npairs=0; npairs<len; npairs++)
+  { term_t k = PL_new_term_ref();
+    term_t v = PL_new_term_ref();
+
+    if ( !PL_get_list(tail, head, tail) )
+      goto out;
+    if ( !PL_is_functor(head, FUNCTOR_minus2) )
+    { PL_type_error("pair", head);
+      goto out;
+    }
+    _PL_get_arg(1, head, k);
+    _PL_get_arg(2, head, v);
+    if ( !get_dbt(k, db->key_type, db->dict, &pairs[npairs].key) )
+      goto out;
+    if ( !get_dbt(v, db->value_type, db->dict, &pairs[npairs].value) )
+    { free_dbt(&pairs[npairs].key, db->key_type);
+      goto out;
+    }
+    pairs[npairs].index = npairs;
+    PL_reset_term_refs(k);
+  }
+
+  if ( sort )
+    qsort(pairs, npairs, sizeof(*pairs), compare_bulk_pairs);
+  if ( chunk == 0 )
+    chunk = npairs;
+
+  memset(&buf, 0, sizeof(buf));
+  txn = TheTXN;
+  for(i=0; i<npairs && rval == 0; i += chunk)
+  { size_t n = (npairs-i < chunk ? npairs-i : chunk);
+
+    if ( !txn && (db->env->flags&DB_INIT_TXN) ) /* one txn per chunk */
+    { DB_TXN *tid;
+
+      NOSIG(rval=db->env->env->txn_begin(db->env->env, NULL, &tid, 0));
+      if ( rval == 0 )
+      { NOSIG(rval=put_chunk(db, tid, &pairs[i], n, &buf));
+	if ( rval == 0 )
+	{ NOSIG(rval=tid->commit(tid, 0));
+	} else
+	{ NOSIG(tid->abort(tid));
+	}
+      }
+    } else
+    { NOSIG(rval=put_chunk(db, txn, &pairs[i], n, &buf));
+    }
+  }
+  if ( buf.data )
+    free(buf.data);
+  cache_write(db, top_transaction(), NULL);
+
+  if ( rval == ENOMEM )
+    rc = PL_resource_error("memory");
+  else
+    rc = db_status(rval, handle);
+
+out:
+  for(i=0; i<npairs; i++)
+  { free_dbt(&pairs[i].key,   db->key_type);
+    free_dbt(&pairs[i].value, db->value_type);
+  }
+  free(pairs);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	      CURSORS		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Cursor objects are blobs that wrap a DBC.  A cursor keeps a reference to
+the database blob, so the database cannot   be garbage collected while it
+has cursors. bdb_close/1 closes all cursors  of the database and ending a
+transaction closes all cursors that  were   created  inside it. The lists
+are protected by cursor_mutex  because  atom   garbage  collection  may
+release a cursor from another thread.
+
+Keys and values are retrieved  into   DB_DBT_REALLOC  buffers that belong
+to the cursor, so walking the cursor does not allocate memory for every
+record.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct dbcursor
+{ DBC	       *cursor;			/* the DB cursor */
+  dbh	       *db;			/* database we belong to */
+  atom_t	db_symbol;		/* locked <bdb>(...) */
+  atom_t	symbol;			/* <bdb_cursor>(...) */
+  transaction  *txn;			/* transaction we belong to */
+  struct dbcursor *next;		/* next cursor of the database */
+  struct dbcursor *txn_next;		/* next cursor of the transaction */
+  DBT		key;			/* key buffer */
+  DBT		value;			/* value buffer */
+  char	       *prefix;			/* prefix for prefix(Key) scans */
+  u_int32_t	prefix_len;		/* length of prefix */
+} dbcursor;
+
+/* unlink_cursor() and close_cursor_unlocked() must be called with
+   cursor_mutex locked
+*/
+
+static void
+unlink_cursor(dbcursor *c)
+{ dbcursor **p;
+
+  for(p = &c->db->cursors; *p; p = &(*p)->next)
+  { if ( *p == c )
+    { *p = c->next;
+      break;
+    }
+  }
+  if ( c->txn )
+  { for(p = &c->txn->cursors; *p; p = &(*p)->txn_next)
+    { if ( *p == c )
+      { *p = c->txn_next;
+	break;
+      }
+    }
+    c->txn = NULL;
+  }
+  c->next = c->txn_next = NULL;
+}
+
+
+static int
+close_cursor_unlocked(dbcursor *c)
+{ DBC *dbc;
+  int rval = 0;
+
+  if ( (dbc=c->cursor) )
+  { c->cursor = NULL;
+    unlink_cursor(c);
+    DEBUG(Sdprintf("Destroyed cursor at %p\n", dbc));
+    NOSIG(rval=dbc->c_close(dbc));
+  }
+
+  return rval;
+}
+
+
+static int
+close_cursor(dbcursor *c)
+{ int rval;
+
+  pthread_mutex_lock(&cursor_mutex);
+  rval = close_cursor_unlocked(c);
+  pthread_mutex_unlock(&cursor_mutex);
+
+  return rval;
+}
+
+
+static void
+close_db_cursors(dbh *db)
+{ pthread_mutex_lock(&cursor_mutex);
+  while( db->cursors )
+    close_cursor_unlocked(db->cursors);
+  pthread_mutex_unlock(&cursor_mutex);
+}
+
+
+static void
+close_txn_cursors(transaction *t)
+{ pthread_mutex_lock(&cursor_mutex);
+  while( t->cursors )
+    close_cursor_unlocked(t->cursors);
+  pthread_mutex_unlock(&cursor_mutex);
+}
+
+
+static void
+acquire_cursor(atom_t symbol)
+{ dbcursor *c = PL_blob_data(symbol, NULL, NULL);
+  c->symbol = symbol;
+}
+
+
+static int
+release_cursor(atom_t symbol)
+{ dbcursor *c = PL_blob_data(symbol, NULL, NULL);
+  int rval;
+
+  if ( (rval=close_cursor(c)) )
+    Sdprintf("Warning: BDB: cursor close failed: %s\n", db_strerror(rval));
+  PL_unregister_atom(c->db_symbol);
+  if ( c->key.data )
+    free(c->key.data);
+  if ( c->value.data )
+    free(c->value.data);
+  if ( c->prefix )
+    free(c->prefix);
+  free(c);
+
+  return TRUE;
+}
+
+static int
+compare_cursors(atom_t a, atom_t b)
+{ dbcursor *ara = PL_blob_data(a, NULL, NULL);
+  dbcursor *arb = PL_blob_data(b, NULL, NULL);
+
+  return ( ara > arb ?  1 :
+	   ara < arb ? -1 : 0
+	 );
+}
+
+static int
+write_cursor(IOSTREAM *s, atom_t symbol, int flags)
+{ dbcursor *c = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<bdb_cursor>(%p)", c);
+
+  return TRUE;
+}
+
+static PL_blob_t cursor_blob =
+{ PL_BLOB_MAGIC,
+  PL_BLOB_NOCOPY,
+  "bdb_cursor",
+  release_cursor,
+  compare_cursors,
+  write_cursor,
+  acquire_cursor
+};
+
+
+static bool
+get_cursor(term_t t, dbcursor **cp)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &cursor_blob)
+  { dbcursor *c = data;
+
+    if ( c->cursor )
+    { *cp = c;
+
+      return true;
+    }
+
+    return PL_permission_error("access", "closed_bdb_cursor", t),false;
+  }
+
+  return PL_type_error("bdb_cursor", t),false;
+}
+
+
+static db_flag cursor_flags[] =
+{
+#ifdef DB_READ_COMMITTED
+  { "read_committed",	DB_READ_COMMITTED,   0 },
+#endif
+  { "read_uncommitted",	DB_READ_UNCOMMITTED, 0 },
+  { NULL,		0,		     0 }
+};
+
+
+static foreign_t
+pl_bdb_cursor_open(term_t handle, term_t cursor, term_t options)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t a    = PL_new_term_ref();
+  u_int32_t flags = 0;
+  transaction *t = top_transaction();
+  dbcursor *c;
+  dbh *db;
+  int rval;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+    u_int32_t fv;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("cursor_option", head);
+    _PL_get_arg(1, head, a);
+    if ( name == ATOM_txn )
+    { if ( !get_db_txn(a, db, &t) )
+	return FALSE;
+      continue;
+    }
+    switch( (fv=lookup_flag(cursor_flags, name, a)) )
+    { case F_ERROR:
+	return FALSE;
+      case F_UNPROCESSED:
+	return PL_domain_error("cursor_option", head);
+      default:
+	flags |= fv;
+    }
+  }
+  if ( !PL_get_nil_ex(tail) )
+    return FALSE;
+
+  if ( !(c=calloc(1, sizeof(*c))) )
+    return PL_resource_error("memory");
+  c->db = db;
+
+  NOSIG(rval=db->db->cursor(db->db, t ? t->tid : NULL, &c->cursor, flags));
+  if ( rval )
+  { free(c);
+    return db_status(rval, handle);
+  }
+  DEBUG(Sdprintf("Created cursor at %p\n", c->cursor));
+
+  c->key.flags   = DB_DBT_REALLOC;
+  c->value.flags = DB_DBT_REALLOC;
+  c->db_symbol   = db->symbol;
+  PL_register_atom(c->db_symbol);
+
+  pthread_mutex_lock(&cursor_mutex);
+  c->next = db->cursors;
+  db->cursors = c;
+  if ( t )
+  { c->txn = t;
+    c->txn_next = t->cursors;
+    t->cursors = c;
+  }
+  pthread_mutex_unlock(&cursor_mutex);
+
+  return PL_unify_blob(cursor, c, sizeof(*c), &cursor_blob);
+}
+
+
+static foreign_t
+pl_bdb_cursor_close(term_t cursor)
+{ dbcursor *c;
+
+  if ( get_cursor(cursor, &c) )
+    return db_status(close_cursor(c), cursor);
+
+  return FALSE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+cursor_get() moves the cursor and unifies   the  key and value. If the
+cursor was positioned using prefix(Prefix), it  fails if the new key does
+not start with the prefix.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+cursor_get(dbcursor *c, term_t cursor, term_t key, term_t value,
+	   u_int32_t flags)
+{ int rval;
+
+  NOSIG(METERED(&c->db->metrics[M_CURSOR],
+		rval=c->cursor->c_get(c->cursor, &c->key, &c->value, flags)));
+  if ( rval == 0 )
+  { if ( c->prefix &&
+	 ( c->key.size < c->prefix_len ||
+	   memcmp(c->key.data, c->prefix, c->prefix_len) != 0 ) )
+      return FALSE;
+
+    return ( unify_dbt(key, c->db->key_type, c->db->dict, &c->key) &&
+	     unify_dbt(value, c->db->value_type, c->db->dict, &c->value) );
+  }
+
+  return db_status(rval, cursor);
+}
+
+
+static void
+clear_cursor_prefix(dbcursor *c)
+{ if ( c->prefix )
+  { free(c->prefix);
+    c->prefix = NULL;
+    c->prefix_len = 0;
+  }
+}
+
+
+/* Copy an encoded key into the cursor's key buffer for DB_SET* */
+
+static int
+set_cursor_key(dbcursor *c, const DBT *k)
+{ void *p;
+
+  if ( !(p=realloc(c->key.data, k->size ? k->size : 1)) )
+    return PL_resource_error("memory");
+  memcpy(p, k->data, k->size);
+  c->key.data = p;
+  c->key.size = k->size;
 
   return TRUE;
 }
 
 
-static db_flag db_flags[] =
-{ { "auto_commit",	DB_AUTO_COMMIT,	     0 },
-  { "create",		DB_CREATE,	     0 },
-  { "excl",		DB_EXCL,	     0 },
-  { "multiversion",	DB_MULTIVERSION,     0 },
-  { "nommap",		DB_NOMMAP,	     0 },
-  { "rdonly",		DB_RDONLY,	     0 },
-  { "read_uncommitted",	DB_READ_UNCOMMITTED, 0 },
-  { "thread",		DB_THREAD,	     0 },
-  { "truncate",		DB_TRUNCATE,	     0 },
-  { "dup",		DB_DUP,		     0 },
-  { "duplicates",	DB_DUP,		     0 }, /* compatibility */
-  { NULL,		0,		     0 },
-};
+/* Number of significant bytes of an encoded prefix key, or -1 if the
+   key type does not allow for prefix matching
+*/
+
+static int
+prefix_length(dtype type, const DBT *k, u_int32_t *len)
+{ switch(type)
+  { case D_ATOM:
+    case D_CBLOB:
+      *len = k->size;
+      return TRUE;
+    case D_CSTRING:
+      *len = k->size-1;			/* strip the 0-byte */
+      return TRUE;
+    case D_TERM_ORDERED:
+    { const unsigned char *p = k->data;
+
+      if ( (p[0] == OT_ATOM || p[0] == OT_STRING) &&
+	   p[k->size-1] == OT_TEXT_END )
+	*len = k->size-2;		/* strip the end marker */
+      else
+	*len = k->size;
+      return TRUE;
+    }
+    default:
+      return FALSE;
+  }
+}
+
+
+static foreign_t
+pl_bdb_cursor_seek(term_t cursor, term_t spec, term_t key, term_t value)
+{ dbcursor *c;
+  atom_t name;
+  size_t arity;
+  term_t a;
+  u_int32_t flags;
+  DBT k;
+  int rc;
+
+  if ( !get_cursor(cursor, &c) )
+    return FALSE;
+  if ( !PL_get_name_arity(spec, &name, &arity) || arity != 1 )
+    return PL_type_error("cursor_seek", spec);
+  if ( name == ATOM_exact )
+    flags = DB_SET;
+  else if ( name == ATOM_range || name == ATOM_prefix )
+    flags = DB_SET_RANGE;
+  else
+    return PL_domain_error("cursor_seek", spec);
+
+  a = PL_new_term_ref();
+  _PL_get_arg(1, spec, a);
+  if ( !lookup_dbt(a, c->db->key_type, c->db->dict, &k) )
+    return FALSE;
+
+  clear_cursor_prefix(c);
+  if ( name == ATOM_prefix )
+  { u_int32_t plen;
+
+    if ( !prefix_length(c->db->key_type, &k, &plen) )
+    { free_dbt(&k, c->db->key_type);
+      return PL_domain_error("prefix_key_type", spec);
+    }
+    if ( !(c->prefix = malloc(plen ? plen : 1)) )
+    { free_dbt(&k, c->db->key_type);
+      return PL_resource_error("memory");
+    }
+    memcpy(c->prefix, k.data, plen);
+    c->prefix_len = plen;
+    k.size = plen;
+  }
+
+  rc = set_cursor_key(c, &k);
+  free_dbt(&k, c->db->key_type);
+
+  return rc && cursor_get(c, cursor, key, value, flags);
+}
+
+
+static foreign_t
+pl_bdb_cursor_next(term_t cursor, term_t key, term_t value)
+{ dbcursor *c;
+
+  if ( !get_cursor(cursor, &c) )
+    return FALSE;
+
+  return cursor_get(c, cursor, key, value, DB_NEXT);
+}
+
+
+static foreign_t
+pl_bdb_cursor_prev(term_t cursor, term_t key, term_t value)
+{ dbcursor *c;
 
+  if ( !get_cursor(cursor, &c) )
+    return FALSE;
+
+  return cursor_get(c, cursor, key, value, DB_PREV);
+}
+
+
+static foreign_t
+pl_bdb_cursor_last(term_t cursor, term_t key, term_t value)
+{ dbcursor *c;
+
+  if ( !get_cursor(cursor, &c) )
+    return FALSE;
+  clear_cursor_prefix(c);
+
+  return cursor_get(c, cursor, key, value, DB_LAST);
+}
+
+
+		 /*******************************
+		 *	 PARTITIONED SCANS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_partition_keys/3 splits the key space of a btree into ranges that
+hold about the same number of   records,  such that multiple threads can
+scan the database using bdb_enum_range/4.   The  split points are found
+without reading the data: we take the   first  and last key, interpret
+the 8 bytes after their  common  prefix   as  an  unsigned integer and
+bisect this number,  using  DB->key_range()  to   find  the  fraction of
+the keys below a candidate. The  candidate   is  then  snapped  to an
+existing key using DB_SET_RANGE.
+
+Range boundaries are passed to Prolog as   bytes(String), where String
+holds the encoded key. This avoids re-encoding the key, which is not
+guaranteed to produce the same bytes for type `term`.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define SPLIT_BYTES 8			/* # bytes interpolated */
 
 static int
-db_options(term_t t, dbh *dbh, char **subdb)
-{ term_t tail = PL_copy_term_ref(t);
-  term_t head = PL_new_term_ref();
-  int flags = 0;
+get_key_only(DBC *cursor, DBT *k, u_int32_t how)
+{ DBT v;
+  int rval;
 
-  dbh->key_type   = D_TERM;
-  dbh->value_type = D_TERM;
+  memset(&v, 0, sizeof(v));
+  v.flags = DB_DBT_PARTIAL|DB_DBT_USERMEM;
+  NOSIG(rval=cursor->c_get(cursor, k, &v, how));
 
-  while( PL_get_list(tail, head, tail) )
-  { atom_t name;
-    size_t arity;
+  return rval;
+}
 
-    if ( PL_get_name_arity(head, &name, &arity) )
-    { if ( arity == 1 )
-      { term_t a0 = PL_new_term_ref();
 
-	_PL_get_arg(1, head, a0);
-	if ( name == ATOM_database )
-	{ if ( !PL_get_chars(a0, subdb,
-			     CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_UTF8) )
-	    return FALSE;
-	} else if ( name == ATOM_key )
-	{ if ( !get_dtype(a0, &dbh->key_type) )
-	    return FALSE;
-	} else if ( name == ATOM_value )
-	{ if ( !get_dtype(a0, &dbh->value_type) )
-	    return FALSE;
-	} else if ( name == ATOM_type || name == ATOM_environment )
-	{  ;  /* type(_) and environment() are handled by db_preoptions */
-	} else
-	{ u_int32_t fv = lookup_flag(db_flags, name, a0);
+static uint64_t
+split_number(const DBT *k, u_int32_t offset)
+{ const unsigned char *s = k->data;
+  uint64_t v = 0;
+  u_int32_t i;
 
-	  switch(fv)
-	  { case F_ERROR:
-	      return FALSE;
-	    case F_UNPROCESSED:
-	      return PL_domain_error("db_option", head);
-	    default:
-	      flags |= fv;
+  for(i=0; i<SPLIT_BYTES; i++)
+  { v <<= 8;
+    if ( offset+i < k->size )
+      v |= s[offset+i];
+  }
+
+  return v;
+}
+
+
+/* Find a key such that about `fraction` of the keys sort before it.
+   cand->data must be able to hold first->size+SPLIT_BYTES bytes.
+*/
+
+static int
+find_split(dbh *db, const DBT *first, const DBT *last, double fraction,
+	   DBT *cand)
+{ u_int32_t max = first->size < last->size ? first->size : last->size;
+  const unsigned char *f = first->data;
+  const unsigned char *l = last->data;
+  unsigned char *c = cand->data;
+  u_int32_t plen = 0;
+  uint64_t lo, hi;
+  int rval;
+
+  while( plen < max && f[plen] == l[plen] )
+    plen++;
+  lo = split_number(first, plen);
+  hi = split_number(last, plen);
+
+  memcpy(c, f, plen);
+  cand->size = plen+SPLIT_BYTES;
+
+  while( lo < hi )
+  { uint64_t mid = lo + (hi-lo)/2;
+    DB_KEY_RANGE kr;
+
+    put_uint64_be(c+plen, mid);
+    NOSIG(rval=db->db->key_range(db->db, TheTXN, cand, &kr, 0));
+    if ( rval )
+      return rval;
+    if ( kr.less < fraction )
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  put_uint64_be(c+plen, lo);
+
+  return 0;
+}
+
+
+static int
+unify_range_bound(term_t t, const DBT *k, atom_t unbounded)
+{ term_t a;
+
+  if ( !k )
+    return PL_unify_atom(t, unbounded);
+
+  return ( (a=PL_new_term_ref()) &&
+	   PL_unify_functor(t, FUNCTOR_bytes1) &&
+	   PL_get_arg(1, t, a) &&
+	   PL_unify_chars(a, PL_STRING|REP_ISO_LATIN_1, k->size, k->data) );
+}
+
+
+static foreign_t
+pl_bdb_partition_keys(term_t handle, term_t count, term_t ranges)
+{ dbh *db;
+  int n, i, nbounds = 0;
+  DBC *cursor = NULL;
+  DBT first, last, cand;
+  DBT *bounds = NULL;
+  int rval = 0;
+  int rc = FALSE;
+
+  if ( !get_db(handle, &db) || !PL_get_integer_ex(count, &n) )
+    return FALSE;
+  if ( n < 1 )
+    return PL_domain_error("positive_integer", count);
+
+  memset(&first, 0, sizeof(first));
+  memset(&last, 0, sizeof(last));
+  memset(&cand, 0, sizeof(cand));
+  first.flags = last.flags = DB_DBT_REALLOC;
+
+  if ( db->type == DB_BTREE && n > 1 )
+  { if ( (rval=db->db->cursor(db->db, TheTXN, &cursor, 0)) )
+      return db_status(rval, handle);
+
+    if ( (rval=get_key_only(cursor, &first, DB_FIRST)) == 0 &&
+	 (rval=get_key_only(cursor, &last, DB_LAST)) == 0 )
+    { if ( !(cand.data = malloc(first.size+SPLIT_BYTES)) ||
+	   !(bounds = calloc(n, sizeof(*bounds))) )
+      { rval = ENOMEM;
+	goto out;
+      }
+
+      for(i=1; i<n; i++)
+      { DBT *k = &bounds[nbounds];
+	const DBT *prev = nbounds > 0 ? &bounds[nbounds-1] : &first;
+
+	if ( (rval=find_split(db, &first, &last, (double)i/n, &cand)) )
+	  goto out;
+	if ( !(k->data = malloc(cand.size)) )
+	{ rval = ENOMEM;
+	  goto out;
+	}
+	memcpy(k->data, cand.data, cand.size);
+	k->size = cand.size;
+	k->flags = DB_DBT_REALLOC;
+
+	if ( (rval=get_key_only(cursor, k, DB_SET_RANGE)) )
+	{ if ( rval == DB_NOTFOUND )
+	  { rval = 0;
+	    break;
 	  }
+	  goto out;
+	}
+	if ( compare_dbt(k, prev) > 0 )
+	  nbounds++;
+	else
+	{ free(k->data);
+	  k->data = NULL;
 	}
+      }
+    } else if ( rval == DB_NOTFOUND )	/* empty database */
+    { rval = 0;
+    } else
+      goto out;
+  }
+
+  { term_t tail = PL_copy_term_ref(ranges);
+    term_t head = PL_new_term_ref();
+    term_t lo   = PL_new_term_ref();
+    term_t hi   = PL_new_term_ref();
+    const DBT *prev = NULL;
+
+    for(i=0; i<=nbounds; i++)
+    { const DBT *next = i < nbounds ? &bounds[i] : NULL;
+
+      if ( !PL_unify_list(tail, head, tail) ||
+	   !PL_unify_functor(head, FUNCTOR_range2) ||
+	   !PL_get_arg(1, head, lo) ||
+	   !PL_get_arg(2, head, hi) ||
+	   !unify_range_bound(lo, prev, ATOM_min) ||
+	   !unify_range_bound(hi, next, ATOM_max) )
+	goto out;
+      prev = next;
+    }
+    rc = PL_unify_nil(tail);
+  }
+
+out:
+  if ( cursor )
+    cursor->c_close(cursor);
+  if ( bounds )
+  { for(i=0; i<n; i++)
+    { if ( bounds[i].data )
+	free(bounds[i].data);
+    }
+    free(bounds);
+  }
+  if ( first.data )
+    free(first.data);
+  if ( last.data )
+    free(last.data);
+  if ( cand.data )
+    free(cand.data);
+
+  if ( rval )
+    return db_status(rval, handle);
+  return rc;
+}
+
+
+static int
+get_range_bound(term_t t, atom_t unbounded, char **s, size_t *len)
+{ atom_t a;
+
+  if ( PL_get_atom(t, &a) && a == unbounded )
+  { *s = NULL;
+    return TRUE;
+  }
+  if ( PL_is_functor(t, FUNCTOR_bytes1) )
+  { term_t a0 = PL_new_term_ref();
+
+    _PL_get_arg(1, t, a0);
+    return PL_get_nchars(a0, len, s,
+			 CVT_ATOM|CVT_STRING|CVT_EXCEPTION|
+			 REP_ISO_LATIN_1|BUF_STACK);
+  }
+
+  return PL_domain_error("bdb_range_bound", t);
+}
+
+
+static foreign_t
+pl_bdb_enum_range(term_t handle, term_t range, term_t key, term_t value,
+		  control_t ctx)
+{ dbh *db;
+  thread_buffers *tb;
+  int rval = 0;
+  dbget_ctx *c = NULL;
+  fid_t fid = 0;
+  u_int32_t how = DB_NEXT;
+
+  switch( PL_foreign_control(ctx) )
+  { case PL_FIRST_CALL:
+    { term_t a = PL_new_term_ref();
+      char *lo, *hi;
+      size_t lolen, hilen;
+
+      if ( !get_db(handle, &db) || !(tb=my_buffers()) )
+	return FALSE;
+      if ( !PL_is_functor(range, FUNCTOR_range2) )
+	return PL_type_error("bdb_range", range);
+      _PL_get_arg(1, range, a);
+      if ( !get_range_bound(a, ATOM_min, &lo, &lolen) )
+	return FALSE;
+      _PL_get_arg(2, range, a);
+      if ( !get_range_bound(a, ATOM_max, &hi, &hilen) )
+	return FALSE;
+
+      if ( !(c=alloc_get_ctx(tb, db)) )
+	return FALSE;
+      if ( (c->bounded = (hi != NULL)) )
+      { DBT k;
+
+	memset(&k, 0, sizeof(k));
+	k.data = hi;
+	k.size = (u_int32_t)hilen;
+	if ( !set_get_ctx_key(c, &k) )
+	{ free_get_ctx(c);
+	  return FALSE;
+	}
+      }
+      if ( lo )
+      { void *p;
+
+	if ( !(p=realloc(c->k2.data, lolen+1)) )
+	{ free_get_ctx(c);
+	  return PL_resource_error("memory");
+	}
+	memcpy(p, lo, lolen);
+	c->k2.data = p;
+	c->k2.size = (u_int32_t)lolen;
+	how = DB_SET_RANGE;
       } else
-	return PL_type_error("db_option", head);
+	how = DB_FIRST;
+
+      if ( (rval=acquire_db_cursor(db, TheTXN, &c->cursor, &c->cached)) )
+      { free_get_ctx(c);
+	return db_status(rval, handle);
+      }
+      break;
     }
+    case PL_REDO:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+      break;
+    case PL_PRUNED:
+      c = PL_foreign_context_address(ctx);
+      db = c->db;
+      goto out;
   }
 
-  if ( !PL_get_nil_ex(tail) )
-    return FALSE;
+  for(;;)
+  { rval = c->cursor->c_get(c->cursor, &c->k2, &c->value, how);
+    how = DB_NEXT;
 
-  if ( flags )
-  { int rval;
+    if ( rval != 0 ||
+	 (c->bounded && compare_dbt(&c->k2, &c->key) >= 0) )
+      break;
 
-    if ( (rval=dbh->db->set_flags(dbh->db, flags)) )
-      return db_status_db(rval, dbh);
-    dbh->flags = flags;
+    if ( !fid )
+      fid = PL_open_foreign_frame();
+    if ( unify_dbt(key, db->key_type, db->dict, &c->k2) &&
+	 unify_dbt(value, db->value_type, db->dict, &c->value) )
+    { PL_close_foreign_frame(fid);
+      PL_retry_address(c);
+    }
+    PL_rewind_foreign_frame(fid);
   }
 
+out:
+  if ( c )
+  { int rc = release_db_cursor(c->cursor, c->cached);
 
-  return TRUE;
-}
+    if ( rval == 0 )
+      rval = rc;
+    free_get_ctx(c);
+  }
+  if ( fid )
+    PL_close_foreign_frame(fid);
 
+  db_status(rval, handle);
+  return FALSE;				/* also on rval = 0! */
+}
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-verify that an environment that is not  initialized for threading is not
-accessed from multiple threads. Not sure whether or not an uninitialized
-default environment can be accessed from multiple threads.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
-check_same_thread(dbenvh *env)
-{ if ( (env->flags&DB_THREAD) || env->thread == PL_thread_self() )
-  { return TRUE;
-  } else if ( env == &default_env && !env->thread )
-  { env->thread = PL_thread_self();
-    return TRUE;
-  } else
-  { term_t e;
+bdb_close_env(dbenvh *env, int silent)
+{ int rc = TRUE;
 
-    if ( (e = PL_new_term_ref()) &&
-	 unify_dbenv(e, env) )
-      return PL_permission_error("access", "bdb_environment", e);
-    return FALSE;
+  if ( env->env )
+  { int rval;
+
+    stop_maint_tasks(env);
+    rval = env->env->close(env->env, 0);
+
+    if ( silent )			/* do not throw exceptions */
+    { if ( rval )
+	Sdprintf("DB: ENV close failed: %s\n", db_strerror(rc));
+      rc = !rval;
+    } else
+    { rc = db_status_env(rval, env);
+    }
+
+    env->env	= NULL;
+    env->flags  = 0;
+    env->thread = 0;
+    if ( env->group_commit )
+    { free_group_commit(env->group_commit);
+      env->group_commit = NULL;
+    }
+    if ( env->home )
+    { free(env->home);
+      env->home = NULL;
+    }
   }
+
+  return rc;
 }
 
 
-static foreign_t
-pl_bdb_open(term_t file, term_t mode, term_t handle, term_t options)
-{ char *fname;
-  int flags;
-  int m = 0666;
-  int type = DB_BTREE;
-  dbh *dbh;
-  atom_t a;
-  int rval;
-  char *subdb = NULL;
-  dbenvh *env = &default_env;
+		 /*******************************
+		 *	    STATISTICS		*
+		 *******************************/
 
-  if ( !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
-    return FALSE;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_db_statistics/3 and bdb_env_statistics/3   return  the statistics of
+Berkeley DB as dicts. A  stat_dict   collects  the  key-value pairs; the
+STAT_* macros add a field and return FALSE from the enclosing function if
+this fails. The structures returned  by   the  *_stat()  functions are
+allocated using malloc() and must be freed by the caller.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  if ( !PL_get_atom_ex(mode, &a) )		/* process mode */
-    return FALSE;
-  if ( a == ATOM_read )
-    flags = DB_RDONLY;
-  else if ( a == ATOM_update )
-    flags = DB_CREATE;
-  else
-    return PL_domain_error("io_mode", mode);
+#define MAX_STAT_KEYS 32
 
-  if ( !db_preoptions(options, &env, &type) ||
-       !check_same_thread(env) )
-    return FALSE;
+typedef struct stat_dict
+{ size_t	count;			/* # keys */
+  atom_t	keys[MAX_STAT_KEYS];	/* the keys */
+  term_t	values;			/* MAX_STAT_KEYS term references */
+} stat_dict;
 
-  dbh = calloc(1, sizeof(*dbh));
-  dbh->magic = DBH_MAGIC;
-  dbh->env   = env;
-  NOSIG(rval=db_create(&dbh->db, env->env, 0));
-  if ( rval )
-  { dbh->db = NULL;
-    dbh->symbol = 0;
-    return db_status(rval, file);
-  }
+#define STAT_INT(d, name, v) \
+	if ( !add_stat_int(d, name, (int64_t)(v)) ) return FALSE
+#define STAT_FLOAT(d, name, v) \
+	if ( !add_stat_float(d, name, v) ) return FALSE
 
-  DEBUG(Sdprintf("New DB at %p\n", dbh->db));
 
-  if ( !db_options(options, dbh, &subdb) )
-  { bdb_close(dbh);
-    return FALSE;
-  }
+static int
+init_stat_dict(stat_dict *d)
+{ d->count = 0;
 
-#ifdef DB41
-  if ( (env->flags&DB_INIT_TXN) )
-    flags |= DB_AUTO_COMMIT;
-  NOSIG(rval=dbh->db->open(dbh->db, TheTXN, fname, subdb, type, flags, m));
-#else
-  NOSIG(rval=dbh->db->open(dbh->db, fname, subdb, type, flags, m));
-#endif
+  return (d->values = PL_new_term_refs(MAX_STAT_KEYS)) != 0;
+}
 
-  if ( rval )
-  { bdb_close(dbh);
-    return db_status_db(rval, dbh);
-  }
 
-  return unify_db(handle, dbh);
+static term_t
+stat_value(stat_dict *d, const char *name)
+{ assert(d->count < MAX_STAT_KEYS);
+  d->keys[d->count] = PL_new_atom(name);
+
+  return d->values+d->count++;
 }
 
 
 static int
-bdb_close(dbh *db)
-{ int rval;
+add_stat_int(stat_dict *d, const char *name, int64_t v)
+{ return PL_put_int64(stat_value(d, name), v);
+}
 
-  DEBUG(Sdprintf("Close DB at %p\n", db->db));
-  NOSIG(rval = db->db->close(db->db, 0);
-	db->db = NULL;
-	db->symbol = 0);
 
-  return rval;
+static int
+add_stat_float(stat_dict *d, const char *name, double v)
+{ return PL_put_float(stat_value(d, name), v);
 }
 
 
-static foreign_t
-pl_bdb_close(term_t handle)
-{ dbh *db;
+static int
+put_stat_dict(term_t t, stat_dict *d)
+{ int rc = PL_put_dict(t, 0, d->count, d->keys, d->values);
+  size_t i;
 
-  if ( get_db(handle, &db) )
-  { if ( !db->db || !db->symbol )
-      return PL_existence_error("db", handle);
-    return db_status(bdb_close(db), handle);
-  }
+  for(i=0; i<d->count; i++)
+    PL_unregister_atom(d->keys[i]);
+  d->count = 0;
 
-  return FALSE;
+  return rc;
 }
 
-static foreign_t
-pl_bdb_is_open(term_t t)
-{ PL_blob_t *type;
-  void *data;
 
-  if ( PL_get_blob(t, &data, NULL, &type) && type == &db_blob)
-  { dbh *p = data;
+static double
+hit_ratio(uintmax_t hit, uintmax_t miss)
+{ return hit+miss > 0 ? (double)hit/(double)(hit+miss) : 1.0;
+}
 
-    if ( p->db && p->symbol )
-      return TRUE;
 
+static int
+put_btree_stat(term_t t, const DB_BTREE_STAT *sp)
+{ stat_dict d;
+
+  if ( !init_stat_dict(&d) )
     return FALSE;
-  }
+  STAT_INT(&d, "version",     sp->bt_version);
+  STAT_INT(&d, "nkeys",	      sp->bt_nkeys);
+  STAT_INT(&d, "ndata",	      sp->bt_ndata);
+#ifdef DB47
+  STAT_INT(&d, "pagecnt",     sp->bt_pagecnt);
+#endif
+  STAT_INT(&d, "pagesize",    sp->bt_pagesize);
+  STAT_INT(&d, "minkey",      sp->bt_minkey);
+  STAT_INT(&d, "re_len",      sp->bt_re_len);
+  STAT_INT(&d, "levels",      sp->bt_levels);
+  STAT_INT(&d, "int_pg",      sp->bt_int_pg);
+  STAT_INT(&d, "leaf_pg",     sp->bt_leaf_pg);
+  STAT_INT(&d, "dup_pg",      sp->bt_dup_pg);
+  STAT_INT(&d, "over_pg",     sp->bt_over_pg);
+  STAT_INT(&d, "empty_pg",    sp->bt_empty_pg);
+  STAT_INT(&d, "free",	      sp->bt_free);
+  STAT_INT(&d, "int_pgfree",  sp->bt_int_pgfree);
+  STAT_INT(&d, "leaf_pgfree", sp->bt_leaf_pgfree);
+  STAT_INT(&d, "dup_pgfree",  sp->bt_dup_pgfree);
+  STAT_INT(&d, "over_pgfree", sp->bt_over_pgfree);
+
+  return put_stat_dict(t, &d);
+}
 
-  return PL_type_error("db", t);
+
+static int
+put_hash_stat(term_t t, const DB_HASH_STAT *sp)
+{ stat_dict d;
+
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "version",   sp->hash_version);
+  STAT_INT(&d, "nkeys",	    sp->hash_nkeys);
+  STAT_INT(&d, "ndata",	    sp->hash_ndata);
+#ifdef DB47
+  STAT_INT(&d, "pagecnt",   sp->hash_pagecnt);
+#endif
+  STAT_INT(&d, "pagesize",  sp->hash_pagesize);
+  STAT_INT(&d, "ffactor",   sp->hash_ffactor);
+  STAT_INT(&d, "buckets",   sp->hash_buckets);
+  STAT_INT(&d, "free",	    sp->hash_free);
+  STAT_INT(&d, "bfree",	    sp->hash_bfree);
+  STAT_INT(&d, "bigpages",  sp->hash_bigpages);
+  STAT_INT(&d, "big_bfree", sp->hash_big_bfree);
+  STAT_INT(&d, "overflows", sp->hash_overflows);
+  STAT_INT(&d, "ovfl_free", sp->hash_ovfl_free);
+  STAT_INT(&d, "dup",	    sp->hash_dup);
+  STAT_INT(&d, "dup_free",  sp->hash_dup_free);
+
+  return put_stat_dict(t, &d);
 }
 
 
-		 /*******************************
-		 *	   TRANSACTIONS		*
-		 *******************************/
+static int
+put_queue_stat(term_t t, const DB_QUEUE_STAT *sp)
+{ stat_dict d;
 
-static pthread_key_t transaction_key;
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "version",     sp->qs_version);
+  STAT_INT(&d, "nkeys",	      sp->qs_nkeys);
+  STAT_INT(&d, "ndata",	      sp->qs_ndata);
+  STAT_INT(&d, "pagesize",    sp->qs_pagesize);
+  STAT_INT(&d, "extentsize",  sp->qs_extentsize);
+  STAT_INT(&d, "pages",	      sp->qs_pages);
+  STAT_INT(&d, "re_len",      sp->qs_re_len);
+  STAT_INT(&d, "pgfree",      sp->qs_pgfree);
+  STAT_INT(&d, "first_recno", sp->qs_first_recno);
+  STAT_INT(&d, "cur_recno",   sp->qs_cur_recno);
+
+  return put_stat_dict(t, &d);
+}
 
-typedef struct transaction
-{ DB_TXN *tid;				/* transaction id */
-  struct transaction *parent;		/* parent id */
-  dbenvh *env;				/* environment of the transaction */
-} transaction;
 
-typedef struct transaction_stack
-{ transaction *top;
-} transaction_stack;
+#ifdef DB52
+static int
+put_heap_stat(term_t t, const DB_HEAP_STAT *sp)
+{ stat_dict d;
 
-static transaction_stack *
-my_tr_stack(void)
-{ transaction_stack *stack;
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "version",    sp->heap_version);
+  STAT_INT(&d, "nkeys",	     sp->heap_nrecs);
+  STAT_INT(&d, "pagecnt",    sp->heap_pagecnt);
+  STAT_INT(&d, "pagesize",   sp->heap_pagesize);
+  STAT_INT(&d, "nregions",   sp->heap_nregions);
+  STAT_INT(&d, "regionsize", sp->heap_regionsize);
+
+  return put_stat_dict(t, &d);
+}
+#endif
 
-  if ( (stack=pthread_getspecific(transaction_key)) )
-    return stack;
 
-  if ( (stack=calloc(1,sizeof(*stack))) )
-  { pthread_setspecific(transaction_key, stack);
-    return stack;
+static foreign_t
+bdb_db_statistics(term_t handle, term_t stats, term_t options)
+{ dbh *db;
+  u_int32_t flags = 0;
+  void *sp;
+  term_t t;
+  int rval;
+
+  if ( !get_db(handle, &db) )
+    return FALSE;
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
+
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      size_t arity;
+      int v;
+
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("statistics_option", head);
+      _PL_get_arg(1, head, arg);
+      if ( name == ATOM_fast )
+      { if ( !PL_get_bool_ex(arg, &v) )
+	  return FALSE;
+	if ( v )
+	  flags |= DB_FAST_STAT;
+      } else
+	return PL_domain_error("statistics_option", head);
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
   }
 
-  PL_resource_error("memory");
-  return NULL;
+#ifdef DB43
+  NOSIG(rval=db->db->stat(db->db, TheTXN, &sp, flags));
+#else
+  NOSIG(rval=db->db->stat(db->db, &sp, flags));
+#endif
+  if ( rval )
+    return db_status(rval, handle);
+
+  t = PL_new_term_ref();
+  switch(db->type)
+  { case DB_BTREE:
+    case DB_RECNO:
+      rval = put_btree_stat(t, sp);
+      break;
+    case DB_HASH:
+      rval = put_hash_stat(t, sp);
+      break;
+    case DB_QUEUE:
+      rval = put_queue_stat(t, sp);
+      break;
+#ifdef DB52
+    case DB_HEAP:
+      rval = put_heap_stat(t, sp);
+      break;
+#endif
+    default:
+      rval = PL_put_dict(t, 0, 0, NULL, 0);
+  }
+  free(sp);
+
+  return rval && PL_unify(stats, t);
 }
 
-static void
-free_transaction_stack(void *ptr)
-{ transaction_stack *stack = ptr;
 
-  assert(stack->top == NULL);
-  free(stack);
+static foreign_t
+pl_bdb_db_statistics2(term_t handle, term_t stats)
+{ return bdb_db_statistics(handle, stats, 0);
 }
 
 
-static int
-begin_transaction(dbenvh *env, transaction *t)
-{ if ( env->env && (env->flags&DB_INIT_TXN) )
-  { int rval;
-    DB_TXN *pid, *tid;
-    transaction_stack *stack;
+static foreign_t
+pl_bdb_db_statistics3(term_t handle, term_t stats, term_t options)
+{ return bdb_db_statistics(handle, stats, options);
+}
 
-    if ( !(stack=my_tr_stack()) )
-      return FALSE;
 
-    if ( stack->top )
-      pid = stack->top->tid;
-    else
-      pid = NULL;
+static int
+put_mpool_file_stat(term_t t, const DB_MPOOL_FSTAT *sp)
+{ stat_dict d;
 
-    if ( (rval=env->env->txn_begin(env->env, pid, &tid, 0)) )
-      return db_status_env(rval, env);
+  if ( !init_stat_dict(&d) ||
+       !PL_put_atom_chars(stat_value(&d, "file"), sp->file_name) )
+    return FALSE;
+  STAT_INT(&d,	 "pagesize",	sp->st_pagesize);
+  STAT_INT(&d,	 "map",		sp->st_map);
+  STAT_INT(&d,	 "cache_hit",	sp->st_cache_hit);
+  STAT_INT(&d,	 "cache_miss",	sp->st_cache_miss);
+  STAT_FLOAT(&d, "hit_ratio",	hit_ratio(sp->st_cache_hit,
+					  sp->st_cache_miss));
+  STAT_INT(&d,	 "page_create", sp->st_page_create);
+  STAT_INT(&d,	 "page_in",	sp->st_page_in);
+  STAT_INT(&d,	 "page_out",	sp->st_page_out);
+
+  return put_stat_dict(t, &d);
+}
 
-    t->parent = stack->top;
-    t->tid = tid;
-    t->env = env;
-    stack->top = t;
 
-    return TRUE;
-  } else
-  { term_t ex;
+static int
+put_mpool_stat(term_t t, const DB_MPOOL_STAT *sp, DB_MPOOL_FSTAT **fsp)
+{ stat_dict d;
+  term_t files = PL_new_term_ref();
+  term_t file  = PL_new_term_ref();
 
-    if ( (ex=PL_new_term_ref()) &&
-	 unify_dbenv(ex, env) )
-      return PL_permission_error("start", "transaction", ex);
+  if ( !init_stat_dict(&d) )
     return FALSE;
+  STAT_INT(&d,	 "gbytes",	 sp->st_gbytes);
+  STAT_INT(&d,	 "bytes",	 sp->st_bytes);
+  STAT_INT(&d,	 "ncache",	 sp->st_ncache);
+  STAT_INT(&d,	 "cache_hit",	 sp->st_cache_hit);
+  STAT_INT(&d,	 "cache_miss",	 sp->st_cache_miss);
+  STAT_FLOAT(&d, "hit_ratio",	 hit_ratio(sp->st_cache_hit,
+					   sp->st_cache_miss));
+  STAT_INT(&d,	 "page_create",	 sp->st_page_create);
+  STAT_INT(&d,	 "page_in",	 sp->st_page_in);
+  STAT_INT(&d,	 "page_out",	 sp->st_page_out);
+  STAT_INT(&d,	 "ro_evict",	 sp->st_ro_evict);
+  STAT_INT(&d,	 "rw_evict",	 sp->st_rw_evict);
+  STAT_INT(&d,	 "page_trickle", sp->st_page_trickle);
+  STAT_INT(&d,	 "pages",	 sp->st_pages);
+  STAT_INT(&d,	 "page_clean",	 sp->st_page_clean);
+  STAT_INT(&d,	 "page_dirty",	 sp->st_page_dirty);
+
+  PL_put_nil(files);
+  if ( fsp )
+  { size_t n;
+
+    for(n=0; fsp[n]; n++)
+      ;
+    while(n-- > 0)
+    { if ( !put_mpool_file_stat(file, fsp[n]) ||
+	   !PL_cons_list(files, file, files) )
+	return FALSE;
+    }
   }
+  if ( !PL_put_term(stat_value(&d, "files"), files) )
+    return FALSE;
+
+  return put_stat_dict(t, &d);
 }
 
 
 static int
-commit_transaction(transaction *t)
-{ transaction_stack *stack = my_tr_stack();
-  int rval;
-
-  assert(stack);
-  assert(stack->top == t);
+put_lock_stat(term_t t, const DB_LOCK_STAT *sp)
+{ stat_dict d;
 
-  stack->top = t->parent;
-
-  if ( (rval=t->tid->commit(t->tid, 0)) )
-    return db_status_env(rval, t->env);
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "maxlocks",	sp->st_maxlocks);
+  STAT_INT(&d, "maxlockers",	sp->st_maxlockers);
+  STAT_INT(&d, "maxobjects",	sp->st_maxobjects);
+  STAT_INT(&d, "nlocks",	sp->st_nlocks);
+  STAT_INT(&d, "maxnlocks",	sp->st_maxnlocks);
+  STAT_INT(&d, "nlockers",	sp->st_nlockers);
+  STAT_INT(&d, "maxnlockers",	sp->st_maxnlockers);
+  STAT_INT(&d, "nobjects",	sp->st_nobjects);
+  STAT_INT(&d, "maxnobjects",	sp->st_maxnobjects);
+  STAT_INT(&d, "nrequests",	sp->st_nrequests);
+  STAT_INT(&d, "nreleases",	sp->st_nreleases);
+#ifdef DB47
+  STAT_INT(&d, "lock_wait",	sp->st_lock_wait);
+  STAT_INT(&d, "lock_nowait",	sp->st_lock_nowait);
+#else
+  STAT_INT(&d, "lock_wait",	sp->st_nconflicts);
+  STAT_INT(&d, "lock_nowait",	sp->st_nnowaits);
+#endif
+  STAT_INT(&d, "ndeadlocks",	sp->st_ndeadlocks);
+  STAT_INT(&d, "nlocktimeouts", sp->st_nlocktimeouts);
+  STAT_INT(&d, "ntxntimeouts",	sp->st_ntxntimeouts);
 
-  return TRUE;
+  return put_stat_dict(t, &d);
 }
 
 
 static int
-abort_transaction(transaction *t)
-{ transaction_stack *stack = my_tr_stack();
-  int rval;
-
-  assert(stack);
-  assert(stack->top == t);
-
-  stack->top = t->parent;
+put_txn_stat(term_t t, const DB_TXN_STAT *sp)
+{ stat_dict d;
 
-  if ( (rval=t->tid->abort(t->tid)) )
-    return db_status_env(rval, t->env);
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "last_txnid",	sp->st_last_txnid);
+  STAT_INT(&d, "maxtxns",	sp->st_maxtxns);
+  STAT_INT(&d, "nbegins",	sp->st_nbegins);
+  STAT_INT(&d, "ncommits",	sp->st_ncommits);
+  STAT_INT(&d, "naborts",	sp->st_naborts);
+  STAT_INT(&d, "nactive",	sp->st_nactive);
+  STAT_INT(&d, "maxnactive",	sp->st_maxnactive);
+#ifdef DB46
+  STAT_INT(&d, "nsnapshot",	sp->st_nsnapshot);
+  STAT_INT(&d, "maxnsnapshot",	sp->st_maxnsnapshot);
+#endif
 
-  return TRUE;
+  return put_stat_dict(t, &d);
 }
 
 
-static DB_TXN *
-current_transaction(void)
-{ transaction_stack *stack;
-
-  if ( (stack=pthread_getspecific(transaction_key)) &&
-       stack->top )
-    return stack->top->tid;
+static int
+put_log_stat(term_t t, const DB_LOG_STAT *sp)
+{ stat_dict d;
 
-  return NULL;
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d, "lg_bsize",	sp->st_lg_bsize);
+  STAT_INT(&d, "lg_size",	sp->st_lg_size);
+  STAT_INT(&d, "w_bytes",	sp->st_w_bytes);
+  STAT_INT(&d, "w_mbytes",	sp->st_w_mbytes);
+  STAT_INT(&d, "wc_bytes",	sp->st_wc_bytes);
+  STAT_INT(&d, "wc_mbytes",	sp->st_wc_mbytes);
+  STAT_INT(&d, "wcount",	sp->st_wcount);
+  STAT_INT(&d, "wcount_fill",	sp->st_wcount_fill);
+  STAT_INT(&d, "scount",	sp->st_scount);
+  STAT_INT(&d, "cur_file",	sp->st_cur_file);
+  STAT_INT(&d, "cur_offset",	sp->st_cur_offset);
+  STAT_INT(&d, "disk_file",	sp->st_disk_file);
+  STAT_INT(&d, "disk_offset",	sp->st_disk_offset);
+  STAT_INT(&d, "maxcommitperflush", sp->st_maxcommitperflush);
+  STAT_INT(&d, "mincommitperflush", sp->st_mincommitperflush);
+
+  return put_stat_dict(t, &d);
 }
 
 
-static foreign_t
-bdb_transaction(term_t environment, term_t goal)
-{ static predicate_t call1;
-  qid_t qid;
-  int rval;
-  struct transaction tr;
-  dbenvh *env = &default_env;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_env_statistics/3 returns a  dict  with   the  keys  `mpool`, `lock`,
+`txn` and `log` for  the  subsystems  that   are  initialised  in  the
+environment.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  if ( !call1 )
-    call1 = PL_predicate("call", 1, "system");
+static foreign_t
+bdb_env_statistics(term_t environment, term_t stats, term_t options)
+{ dbenvh *env;
+  DB_ENV *e;
+  u_int32_t flags = 0;
+  stat_dict d;
+  term_t t;
+  int rval = 0;
+  int rc = TRUE;
 
-  if ( (environment && !get_dbenv(environment, &env)) ||
-       !check_same_thread(env) )
+  if ( !get_dbenv(environment, &env) )
     return FALSE;
+  if ( !(e=env->env) )
+  { term_t ex;
 
-  NOSIG(rval=begin_transaction(env, &tr));
-  if ( !rval )
+    if ( (ex=PL_new_term_ref()) && unify_dbenv(ex, env) )
+      return PL_existence_error("bdb_environment", ex);
     return FALSE;
+  }
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
 
-  qid = PL_open_query(NULL, PL_Q_PASS_EXCEPTION, call1, goal);
-  rval = PL_next_solution(qid);
-  if ( rval )
-  { PL_cut_query(qid);
-    NOSIG(rval=commit_transaction(&tr));
-    return rval;
-  } else
-  { PL_cut_query(qid);
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      size_t arity;
+      int v;
 
-    NOSIG(rval=abort_transaction(&tr));
-    if ( !rval )
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("statistics_option", head);
+      _PL_get_arg(1, head, arg);
+      if ( name == ATOM_clear )
+      { if ( !PL_get_bool_ex(arg, &v) )
+	  return FALSE;
+	if ( v )
+	  flags |= DB_STAT_CLEAR;
+      } else
+	return PL_domain_error("statistics_option", head);
+    }
+    if ( !PL_get_nil_ex(tail) )
       return FALSE;
+  }
 
+  if ( !init_stat_dict(&d) )
     return FALSE;
+  t = PL_new_term_ref();
+
+  if ( (env->flags&DB_INIT_MPOOL) )
+  { DB_MPOOL_STAT *sp;
+    DB_MPOOL_FSTAT **fsp;
+
+    NOSIG(rval=e->memp_stat(e, &sp, &fsp, flags));
+    if ( rval == 0 )
+    { rc = put_mpool_stat(stat_value(&d, "mpool"), sp, fsp);
+      free(sp);
+      if ( fsp )
+	free(fsp);
+    }
   }
-}
+  if ( rc && rval == 0 && (env->flags&DB_INIT_LOCK) )
+  { DB_LOCK_STAT *sp;
+
+    NOSIG(rval=e->lock_stat(e, &sp, flags));
+    if ( rval == 0 )
+    { rc = put_lock_stat(stat_value(&d, "lock"), sp);
+      free(sp);
+    }
+  }
+  if ( rc && rval == 0 && (env->flags&DB_INIT_TXN) )
+  { DB_TXN_STAT *sp;
 
+    NOSIG(rval=e->txn_stat(e, &sp, flags));
+    if ( rval == 0 )
+    { rc = put_txn_stat(stat_value(&d, "txn"), sp);
+      free(sp);
+    }
+  }
+  if ( rc && rval == 0 && (env->flags&DB_INIT_LOG) )
+  { DB_LOG_STAT *sp;
 
-static foreign_t
-pl_bdb_transaction2(term_t environment, term_t goal)
-{ return bdb_transaction(environment, goal);
+    NOSIG(rval=e->log_stat(e, &sp, flags));
+    if ( rval == 0 )
+    { rc = put_log_stat(stat_value(&d, "log"), sp);
+      free(sp);
+    }
+  }
+
+  if ( rval )
+    rc = db_status_env(rval, env);
+  if ( rc )
+    rc = put_stat_dict(t, &d);
+  else
+    put_stat_dict(t, &d);		/* unregister the keys */
+
+  return rc && PL_unify(stats, t);
 }
 
+
 static foreign_t
-pl_bdb_transaction1(term_t goal)
-{ return bdb_transaction(0, goal);
+pl_bdb_env_statistics2(term_t environment, term_t stats)
+{ return bdb_env_statistics(environment, stats, 0);
 }
 
 
-		 /*******************************
-		 *	     DB ACCESS		*
-		 *******************************/
-
 static foreign_t
-pl_bdb_put(term_t handle, term_t key, term_t value)
-{ DBT k, v;
-  dbh *db;
-  int flags = 0;
-  int rval;
+pl_bdb_env_statistics3(term_t environment, term_t stats, term_t options)
+{ return bdb_env_statistics(environment, stats, options);
+}
 
-  if ( !get_db(handle, &db) )
-    return FALSE;
 
-  if ( !get_dbt(key, db->key_type, &k) ||
-       !get_dbt(value, db->value_type, &v) )
-    return FALSE;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_handle_metrics/3 reports the   op_metrics  collected  by METERED().
+Percentiles are the upper bound of the histogram bucket that holds them.
+The counters are copied before they are cleared; operations that finish
+in between are lost.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  NOSIG(rval = db_status(db->db->put(db->db, TheTXN, &k, &v, flags), handle));
-  free_dbt(&k, db->key_type);
-  free_dbt(&v, db->value_type);
+static double
+metric_percentile(const op_metrics *m, double q)
+{ uint64_t target = (uint64_t)(q*(double)m->count + 0.5);
+  uint64_t seen = 0;
+  int b;
+
+  if ( target == 0 )
+    target = 1;
+  for(b=0; b<METRIC_BUCKETS; b++)
+  { seen += m->buckets[b];
+    if ( seen >= target )
+      break;
+  }
 
-  return rval;
+  return (double)((uint64_t)1<<b)/1e6;
 }
 
 
-static foreign_t
-pl_bdb_del2(term_t handle, term_t key)
-{ DBT k;
-  dbh *db;
-  int flags = 0;			/* current no flags in DB */
-  int rval;
+static int
+put_op_metrics(term_t t, const op_metrics *m)
+{ stat_dict d;
+  term_t list = PL_new_term_ref();
+  term_t cnt  = PL_new_term_ref();
+  int b;
 
-  if ( !get_db(handle, &db) )
+  if ( !init_stat_dict(&d) )
     return FALSE;
+  STAT_INT(&d,	 "count", m->count);
+  STAT_FLOAT(&d, "total", (double)m->total/1e9);
+  STAT_FLOAT(&d, "max",	  (double)m->max/1e9);
+  if ( m->count > 0 )
+  { STAT_FLOAT(&d, "mean", (double)m->total/(double)m->count/1e9);
+    STAT_FLOAT(&d, "p50",  metric_percentile(m, 0.50));
+    STAT_FLOAT(&d, "p90",  metric_percentile(m, 0.90));
+    STAT_FLOAT(&d, "p99",  metric_percentile(m, 0.99));
+  }
 
-  if ( !get_dbt(key, db->key_type, &k) )
+  PL_put_nil(list);
+  for(b=METRIC_BUCKETS-1; b >= 0; b--)
+  { if ( !PL_put_int64(cnt, (int64_t)m->buckets[b]) ||
+	 !PL_cons_list(list, cnt, list) )
+      return FALSE;
+  }
+  if ( !PL_put_term(stat_value(&d, "buckets"), list) )
     return FALSE;
 
-  NOSIG(rval = db_status(db->db->del(db->db, TheTXN, &k, flags), handle));
-  free_dbt(&k, db->key_type);
-
-  return rval;
+  return put_stat_dict(t, &d);
 }
 
 
 static int
-equal_dbt(DBT *a, DBT *b)
-{ if ( a->size == b->size )
-  { if ( a->data == b->data )
-      return TRUE;
-    if ( memcmp(a->data, b->data, a->size) == 0 )
-      return TRUE;
-  }
+put_value_cache_stat(term_t t, value_cache *vc, int clear)
+{ stat_dict d;
+  value_cache copy;
 
-  return FALSE;
+  pthread_mutex_lock(&vc->mutex);
+  copy = *vc;
+  if ( clear )
+    vc->hits = vc->misses = vc->evictions = 0;
+  pthread_mutex_unlock(&vc->mutex);
+
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  STAT_INT(&d,	 "hits",      copy.hits);
+  STAT_INT(&d,	 "misses",    copy.misses);
+  STAT_FLOAT(&d, "hit_ratio", hit_ratio(copy.hits, copy.misses));
+  STAT_INT(&d,	 "evictions", copy.evictions);
+  STAT_INT(&d,	 "entries",   copy.count);
+  STAT_INT(&d,	 "bytes",     copy.bytes);
+  STAT_INT(&d,	 "max_bytes", copy.max_bytes);
+
+  return put_stat_dict(t, &d);
 }
 
 
-static foreign_t
-pl_bdb_getall(term_t handle, term_t key, term_t value)
-{ DBT k, v;
-  dbh *db;
-  int rval;
+static int
+put_compress_stat(term_t t, dbh *db, int clear)
+{ compress_stats copy = db->compress_stats;
+  stat_dict d;
 
-  if ( !get_db(handle, &db) )
-    return FALSE;
+  if ( clear )
+    memset(&db->compress_stats, 0, sizeof(db->compress_stats));
 
-  if ( !get_dbt(key, db->key_type, &k) )
+  if ( !init_stat_dict(&d) )
     return FALSE;
-  memset(&v, 0, sizeof(v));
-
-  if ( (db->flags&DB_DUP) )			/* must use a cursor */
-  { DBC *cursor;
-    term_t tail = PL_copy_term_ref(value);
-    term_t head = PL_new_term_ref();
+  STAT_INT(&d,	 "values",    copy.values);
+  STAT_INT(&d,	 "raw_bytes", copy.raw_bytes);
+  STAT_INT(&d,	 "bytes",     copy.bytes);
+  STAT_FLOAT(&d, "ratio",     copy.bytes ? (double)copy.raw_bytes/copy.bytes
+					 : 0.0);
 
-    NOSIG(rval=db->db->cursor(db->db, TheTXN, &cursor, 0));
-    if ( rval )
-      return db_status(rval, handle);
+  return put_stat_dict(t, &d);
+}
 
-    NOSIG(rval=cursor->c_get(cursor, &k, &v, DB_SET));
-    if ( rval == 0 )
-    { DBT k2;
 
-      if ( !PL_unify_list(tail, head, tail) ||
-	   !unify_dbt(head, db->value_type, &v) )
-      { cursor->c_close(cursor);
-	return FALSE;
-      }
+static foreign_t
+bdb_handle_metrics(term_t handle, term_t metrics, term_t options)
+{ static const char *op_names[M_COUNT] = { "get", "put", "del", "cursor" };
+  op_metrics copy[M_COUNT];
+  op_metrics *live;
+  PL_blob_t *type;
+  const char **names;
+  int count, clear = FALSE;
+  stat_dict d;
+  term_t t;
+  dbh *db;
+  dbenvh *env;
+  int i;
 
-      memset(&k2, 0, sizeof(k2));
-      for(;;)
-      { NOSIG(rval=cursor->c_get(cursor, &k2, &v, DB_NEXT));
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
 
-	if ( rval == 0 )
-	{ if ( equal_dbt(&k, &k2) )
-	  { int ok = ( PL_unify_list(tail, head, tail) &&
-		       unify_dbt(head, db->value_type, &v) );
-	    free_result_dbt(&v);
-	    if ( ok )
-	      continue;
-	  }
-	  free_result_dbt(&v);
-	}
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      size_t arity;
 
-	NOSIG(cursor->c_close(cursor);
-	      free_dbt(&k, db->key_type));
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("metrics_option", head);
+      _PL_get_arg(1, head, arg);
+      if ( name == ATOM_clear )
+      { if ( !PL_get_bool_ex(arg, &clear) )
+	  return FALSE;
+      } else
+	return PL_domain_error("metrics_option", head);
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
+  }
 
-	if ( rval <= 0 )		/* normal failure */
-	{ return PL_unify_nil(tail);
-	} else				/* error failure */
-	{ return db_status(rval, handle);
-	}
-      }
-    } else if ( rval == DB_NOTFOUND )
-    { free_dbt(&k, db->key_type);
+  db = NULL;
+  if ( PL_get_blob(handle, NULL, NULL, &type) && type == &db_blob )
+  { if ( !get_db(handle, &db) )
       return FALSE;
-    } else
-    { free_dbt(&k, db->key_type);
-      return db_status(rval, handle);
-    }
+    live  = db->metrics;
+    names = op_names;
+    count = M_COUNT;
   } else
-  { NOSIG(rval=db->db->get(db->db, TheTXN, &k, &v, 0));
+  { static const char *env_names[] = { "commit" };
 
-    if ( !rval )
-    { term_t t = PL_new_term_ref();
-      term_t tail = PL_copy_term_ref(value);
-      term_t head = PL_new_term_ref();
+    if ( !get_dbenv(handle, &env) )
+      return FALSE;
+    live  = &env->commit_metrics;
+    names = env_names;
+    count = 1;
+  }
 
-      free_dbt(&k, db->key_type);
-      PL_recorded_external(v.data, t);
-      if ( PL_unify_list(tail, head, tail) &&
-	   PL_unify(head, t) &&
-	   PL_unify_nil(tail) )
-	return TRUE;
+  memcpy(copy, live, count*sizeof(*live));
+  if ( clear )
+    memset(live, 0, count*sizeof(*live));
 
+  if ( !init_stat_dict(&d) )
+    return FALSE;
+  for(i=0; i<count; i++)
+  { if ( !put_op_metrics(stat_value(&d, names[i]), &copy[i]) )
+    { put_stat_dict(PL_new_term_ref(), &d);
       return FALSE;
-    } else
-      return db_status(rval, handle);
+    }
+  }
+  if ( db && db->vcache &&
+       !put_value_cache_stat(stat_value(&d, "cache"), db->vcache, clear) )
+  { put_stat_dict(PL_new_term_ref(), &d);
+    return FALSE;
+  }
+  if ( db && db->compress == C_ZLIB &&
+       !put_compress_stat(stat_value(&d, "compress"), db, clear) )
+  { put_stat_dict(PL_new_term_ref(), &d);
+    return FALSE;
   }
+
+  t = PL_new_term_ref();
+  return put_stat_dict(t, &d) && PL_unify(metrics, t);
 }
 
 
-typedef struct _dbget_ctx
-{ dbh *db;				/* the database */
-  DBC *cursor;				/* the cursor */
-  DBT key;				/* the key */
-  DBT k2;				/* secondary key */
-  DBT value;				/* the value */
-} dbget_ctx;
+static foreign_t
+pl_bdb_handle_metrics2(term_t handle, term_t metrics)
+{ return bdb_handle_metrics(handle, metrics, 0);
+}
 
 
 static foreign_t
-pl_bdb_enum(term_t handle, term_t key, term_t value, control_t ctx)
-{ DBT k, v;
-  dbh *db;
-  int rval = 0;
-  dbget_ctx *c = NULL;
-  fid_t fid = 0;
+pl_bdb_handle_metrics3(term_t handle, term_t metrics, term_t options)
+{ return bdb_handle_metrics(handle, metrics, options);
+}
 
-  memset(&k, 0, sizeof(k));
-  memset(&v, 0, sizeof(v));
 
-  switch( PL_foreign_control(ctx) )
-  { case PL_FIRST_CALL:
-      if ( !get_db(handle, &db) )
+		 /*******************************
+		 *	COMPACT AND TRUNCATE	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_compact/2,3 compact a B-tree or recno database and optionally return
+the freed pages to the file system.  With   batch(Pages), the database
+is compacted in steps that each free at   most  Pages pages. Each step
+runs in its own transaction if the  environment is transactional and we
+are not inside a transaction, such that locks are held only briefly.
+The next step starts at the key where   the  previous step stopped. The
+counters of the steps are summed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#ifdef DB46
+
+typedef struct compact_options
+{ u_int32_t	fillpercent;		/* target fill percentage */
+  u_int32_t	pages;			/* max pages to free (0: all) */
+  u_int32_t	batch;			/* pages per step (0: one step) */
+  db_timeout_t	timeout;		/* lock timeout */
+  u_int32_t	flags;			/* DB_FREE_SPACE, DB_FREELIST_ONLY */
+} compact_options;
+
+static int
+get_compact_options(term_t options, compact_options *opts)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  memset(opts, 0, sizeof(*opts));
+  while( PL_get_list(tail, head, tail) )
+  { atom_t name;
+    size_t arity;
+
+    if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+      return PL_type_error("compact_option", head);
+    _PL_get_arg(1, head, arg);
+
+    if ( name == ATOM_fill_percent )
+    { if ( !get_u32_ex(arg, &opts->fillpercent) )
 	return FALSE;
-      c = calloc(1, sizeof(*c));
+      if ( opts->fillpercent < 1 || opts->fillpercent > 100 )
+	return PL_domain_error("percentage", arg);
+    } else if ( name == ATOM_pages )
+    { if ( !get_u32_ex(arg, &opts->pages) )
+	return FALSE;
+    } else if ( name == ATOM_batch )
+    { if ( !get_u32_ex(arg, &opts->batch) )
+	return FALSE;
+    } else if ( name == ATOM_timeout )
+    { if ( !get_timeout(arg, &opts->timeout) )
+	return FALSE;
+    } else if ( name == ATOM_free_space || name == ATOM_freelist_only )
+    { u_int32_t f = (name == ATOM_free_space ? DB_FREE_SPACE
+					     : DB_FREELIST_ONLY);
+      int v;
 
-      c->db = db;
-      if ( (rval=db->db->cursor(db->db, TheTXN, &c->cursor, 0)) )
-      { free(c);
-	return db_status(rval, handle);
-      }
-      DEBUG(Sdprintf("Created cursor at %p\n", c->cursor));
+      if ( !PL_get_bool_ex(arg, &v) )
+	return FALSE;
+      if ( v )
+	opts->flags |= f;
+      else
+	opts->flags &= ~f;
+    } else
+      return PL_domain_error("compact_option", head);
+  }
 
-      rval = c->cursor->c_get(c->cursor, &c->key, &c->value, DB_FIRST);
-      if ( rval == 0 )
-      { int rc;
+  return PL_get_nil_ex(tail);
+}
 
-	fid = PL_open_foreign_frame();
-	rc = ( unify_dbt(key, db->key_type, &c->key) &&
-	       unify_dbt(value, db->value_type, &c->value) );
-	free_result_dbt(&c->key);
-	free_result_dbt(&c->value);
-	if ( rc )
-	{ PL_close_foreign_frame(fid);
-	  PL_retry_address(c);
-	}
 
-	PL_rewind_foreign_frame(fid);
-	goto retry;
-      }
-      goto out;
-    case PL_REDO:
-      c = PL_foreign_context_address(ctx);
-      db = c->db;
+static int
+compact_step(dbh *db, DB_TXN *txn, DBT *start, DB_COMPACT *c,
+	     u_int32_t flags, DBT *end)
+{ DB_TXN *tid = NULL;
+  int rval;
 
-    retry:
-      for(;;)
-      { rval = c->cursor->c_get(c->cursor, &c->k2, &c->value, DB_NEXT);
+  if ( !txn && (db->env->flags&DB_INIT_TXN) )
+  { if ( (rval=db->env->env->txn_begin(db->env->env, NULL, &tid, 0)) )
+      return rval;
+    txn = tid;
+  }
+  rval = db->db->compact(db->db, txn, start, NULL, c, flags, end);
+  if ( tid )
+  { if ( rval == 0 )
+      rval = tid->commit(tid, 0);
+    else
+      tid->abort(tid);
+  }
 
-	if ( rval == 0 )
-	{ int rc;
+  return rval;
+}
 
-	  if ( !fid )
-	    fid = PL_open_foreign_frame();
 
-	  rc =  ( unify_dbt(key, db->key_type, &c->k2) &&
-		  unify_dbt(value, db->value_type, &c->value) );
-	  free_result_dbt(&c->key);
-	  free_result_dbt(&c->value);
-	  if ( rc )
-	  { PL_close_foreign_frame(fid);
-	    PL_retry_address(c);
-	  }
-	  PL_rewind_foreign_frame(fid);
-	  continue;
-	}
-	break;
-      }
+static foreign_t
+bdb_compact(term_t handle, term_t stats, term_t options)
+{ dbh *db;
+  compact_options opts;
+  DB_COMPACT total;
+  DBT start, end;
+  DB_TXN *txn;
+  int steps = 0;
+  int rval = 0;
+
+  if ( !get_db(handle, &db) ||
+       !get_compact_options(options, &opts) )
+    return FALSE;
+
+  memset(&total, 0, sizeof(total));
+  memset(&start, 0, sizeof(start));
+  memset(&end, 0, sizeof(end));
+  end.flags = DB_DBT_MALLOC;
+  txn = TheTXN;
+
+  for(;;)
+  { DB_COMPACT c;
+
+    memset(&c, 0, sizeof(c));
+    c.compact_fillpercent = opts.fillpercent;
+    c.compact_timeout	  = opts.timeout;
+    c.compact_pages	  = opts.batch;
+    if ( opts.pages )
+    { u_int32_t left = opts.pages - total.compact_pages_free;
+
+      if ( !c.compact_pages || left < c.compact_pages )
+	c.compact_pages = left;
+    }
+
+    NOSIG(rval=compact_step(db, txn, steps ? &start : NULL, &c,
+			    opts.flags, &end));
+    if ( start.data )
+      free(start.data);
+    start = end;			/* continue where we stopped */
+    start.flags = 0;
+    memset(&end, 0, sizeof(end));
+    end.flags = DB_DBT_MALLOC;
+    steps++;
+    if ( rval )
       break;
-    case PL_PRUNED:
-      c = PL_foreign_context_address(ctx);
-      db = c->db;
+
+    total.compact_pages_free	  += c.compact_pages_free;
+    total.compact_pages_examine	  += c.compact_pages_examine;
+    total.compact_levels	  += c.compact_levels;
+    total.compact_deadlock	  += c.compact_deadlock;
+    total.compact_pages_truncated += c.compact_pages_truncated;
+
+    if ( !opts.batch ||			/* single step */
+	 start.size == 0 ||		/* reached the end */
+	 c.compact_pages_free == 0 ||	/* no progress */
+	 ( opts.pages && total.compact_pages_free >= opts.pages ) )
       break;
   }
+  if ( start.data )
+    free(start.data);
 
-out:
-  if ( c )
-  { if ( rval == 0 )
-      rval = c->cursor->c_close(c->cursor);
-    else
-      c->cursor->c_close(c->cursor);
-    free(c);
+  if ( rval )
+    return db_status(rval, handle);
+
+  if ( stats )
+  { stat_dict d;
+    term_t t = PL_new_term_ref();
+
+    if ( !init_stat_dict(&d) )
+      return FALSE;
+    STAT_INT(&d, "pages_free",	    total.compact_pages_free);
+    STAT_INT(&d, "pages_examine",   total.compact_pages_examine);
+    STAT_INT(&d, "pages_truncated", total.compact_pages_truncated);
+    STAT_INT(&d, "levels",	    total.compact_levels);
+    STAT_INT(&d, "deadlock",	    total.compact_deadlock);
+    STAT_INT(&d, "steps",	    steps);
+
+    return put_stat_dict(t, &d) && PL_unify(stats, t);
   }
-  if ( fid )
-    PL_close_foreign_frame(fid);
 
-  db_status(rval, handle);
-  return FALSE;				/* also on rval = 0! */
+  return TRUE;
 }
 
+#else /*DB46*/
+
+static foreign_t
+bdb_compact(term_t handle, term_t stats, term_t options)
+{ return db_status(EOPNOTSUPP, handle);	/* DB->compact() is 4.4 */
+}
+
+#endif /*DB46*/
+
+static foreign_t
+pl_bdb_compact2(term_t handle, term_t options)
+{ return bdb_compact(handle, 0, options);
+}
+
+
+static foreign_t
+pl_bdb_compact3(term_t handle, term_t stats, term_t options)
+{ return bdb_compact(handle, stats, options);
+}
 
-#define DO_DEL \
-	if ( del ) \
-	{ do \
-	  { if ( (rval=c->cursor->c_del(c->cursor, 0)) != 0 ) \
-	      return db_status(rval, handle); \
-	  } while(0); \
-	}
 
+/* bdb_truncate(+DB, -Count) removes all records from DB */
 
 static foreign_t
-pl_bdb_getdel(term_t handle, term_t key, term_t value, control_t ctx, int del)
+pl_bdb_truncate(term_t handle, term_t count)
 { dbh *db;
-  int rval = 0;
-  dbget_ctx *c = NULL;
-  fid_t fid = 0;
+  u_int32_t n = 0;
+  int rval;
 
-  switch( PL_foreign_control(ctx) )
-  { case PL_FIRST_CALL:
-      if ( !get_db(handle, &db) )
-	return FALSE;
+  if ( !get_db(handle, &db) )
+    return FALSE;
 
-      if ( (db->flags&DB_DUP) )		/* DB with duplicates */
-      { c = calloc(1, sizeof(*c));
+  close_cached_cursors(db);		/* truncate fails with open cursors */
+  NOSIG(rval=db->db->truncate(db->db, TheTXN, &n, 0));
+  if ( rval )
+    return db_status(rval, handle);
+  cache_write(db, top_transaction(), NULL);
 
-	c->db = db;
-	if ( (rval=db->db->cursor(db->db, TheTXN, &c->cursor, 0)) )
-	{ free(c);
-	  return db_status(rval, handle);
-	}
-	DEBUG(Sdprintf("Created cursor at %p\n", c->cursor));
-	if ( !get_dbt(key, db->key_type, &c->key) )
-	  return FALSE;
+  return PL_unify_uint64(count, n);
+}
 
-	rval = c->cursor->c_get(c->cursor, &c->key, &c->value, DB_SET);
-	if ( rval == 0 )
-	{ int rc;
 
-	  fid = PL_open_foreign_frame();
-	  rc = unify_dbt(value, db->value_type, &c->value);
-	  free_result_dbt(&c->value);
+		 /*******************************
+		 *	MAINTENANCE THREADS	*
+		 *******************************/
 
-	  if ( rc )
-	  { DO_DEL;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+An environment may run native threads that periodically checkpoint the
+transaction log, write dirty pages  from  the   cache  such  that a
+percentage of the pages is clean, and remove log files that are no
+longer needed. The threads are created by bdb_init/2 after the
+environment is opened and by bdb_maintenance/3.  They are not Prolog
+threads and only call Berkeley DB. A task sleeps on its condition
+variable until the interval expired or it is woken up by
+bdb_maintenance/3. bdb_close_env() stops and joins the threads before
+closing the environment.  The task  table   of  an  environment is
+protected by maint_mutex.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-	    PL_close_foreign_frame(fid);
-	    PL_retry_address(c);
-	  }
+typedef struct maint_task
+{ dbenvh       *env;			/* environment we work for */
+  maint_type	type;			/* MT_* */
+  pthread_t	thread;			/* the thread */
+  pthread_mutex_t mutex;		/* protects the fields below */
+  pthread_cond_t cond;			/* wakeup */
+  double	interval;		/* seconds between runs */
+  u_int32_t	arg1;			/* kbytes or percent */
+  u_int32_t	arg2;			/* minutes */
+  int		started;		/* thread was created */
+  int		stop;			/* request to stop */
+  int		run;			/* request to run now */
+  int		changed;		/* interval was changed */
+  uint64_t	runs;			/* # completed runs */
+  uint64_t	pages;			/* pages written (trickle) */
+  int		last_rval;		/* result of last run */
+} maint_task;
+
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *maint_names[MT_COUNT] =
+{ "checkpoint", "trickle", "log_archive"
+};
 
-	  PL_rewind_foreign_frame(fid);
-	  goto retry;
-	}
-	goto out;
-      } else				/* Unique DB */
-      { DBT k, v;
-	int rc;
 
-	if ( !get_dbt(key, db->key_type, &k) )
-	  return FALSE;
-	memset(&v, 0, sizeof(v));
-	if ( (db->env->flags&DB_THREAD) )
-	  v.flags = DB_DBT_MALLOC;
+static maint_task *
+new_maint_task(dbenvh *env, maint_type type)
+{ maint_task *m;
+
+  if ( (m=env->maint[type]) )
+    return m;
+  if ( (m=calloc(1, sizeof(*m))) )
+  { m->env  = env;
+    m->type = type;
+    if ( type == MT_TRICKLE )
+      m->arg1 = 10;			/* keep 10% of the pages clean */
+    pthread_mutex_init(&m->mutex, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    env->maint[type] = m;
+  }
 
-	if ( (rval=db->db->get(db->db, TheTXN, &k, &v, 0)) == 0 )
-	{ rc = unify_dbt(value, db->value_type, &v);
+  return m;
+}
 
-	  free_result_dbt(&v);
-	  if ( rc && del )
-	  { int flags = 0;
 
-	    rc = db_status(db->db->del(db->db, TheTXN, &k, flags), handle);
-	  }
-	} else
-	  rc = db_status(rval, handle);
+static int
+run_maint_task(maint_task *m, int *pages)
+{ DB_ENV *e = m->env->env;
+
+  *pages = 0;
+  switch(m->type)
+  { case MT_CHECKPOINT:
+      return e->txn_checkpoint(e, m->arg1, m->arg2, 0);
+    case MT_TRICKLE:
+      return e->memp_trickle(e, (int)m->arg1, pages);
+    case MT_ARCHIVE:
+      return e->log_archive(e, NULL, DB_ARCH_REMOVE);
+    default:
+      return EINVAL;
+  }
+}
 
-	free_dbt(&k, db->key_type);
 
-	return rc;
-      }
-    case PL_REDO:
-      c = PL_foreign_context_address(ctx);
-      db = c->db;
+static void *
+maint_thread(void *closure)
+{ maint_task *m = closure;
 
-    retry:
-      for(;;)
-      { rval = c->cursor->c_get(c->cursor, &c->k2, &c->value, DB_NEXT);
+  pthread_mutex_lock(&m->mutex);
+  while( !m->stop )
+  { struct timespec deadline;
+    double secs;
+    int rc = 0;
 
-	if ( rval == 0 && equal_dbt(&c->key, &c->k2) )
-	{ if ( !fid )
-	    fid = PL_open_foreign_frame();
-	  if ( unify_dbt(value, db->value_type, &c->value) )
-	  { DO_DEL;
-	    PL_close_foreign_frame(fid);
-	    PL_retry_address(c);
-	  }
-	  PL_rewind_foreign_frame(fid);
-	  continue;
-	}
-	break;
-      }
-      break;
-    case PL_PRUNED:
-      c = PL_foreign_context_address(ctx);
-      db = c->db;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    secs = (double)deadline.tv_nsec/1e9 + m->interval;
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec = (long)((secs-(double)(time_t)secs)*1e9);
+
+    while( !m->stop && !m->run && !m->changed && rc != ETIMEDOUT )
+      rc = pthread_cond_timedwait(&m->cond, &m->mutex, &deadline);
+    if ( m->stop )
       break;
-  }
+    if ( m->changed && !m->run )
+    { m->changed = FALSE;
+      continue;
+    }
+    m->run = m->changed = FALSE;
 
-out:
-  if ( c )
-  { if ( rval == 0 )
-      rval = c->cursor->c_close(c->cursor);
-    else
-      c->cursor->c_close(c->cursor);
-    DEBUG(Sdprintf("Destroyed cursor at %p\n", c->cursor));
-    free_dbt(&c->key, db->key_type);
-    free(c);
+    { int rval, pages;
+
+      pthread_mutex_unlock(&m->mutex);
+      rval = run_maint_task(m, &pages);
+      pthread_mutex_lock(&m->mutex);
+      m->runs++;
+      m->pages += pages;
+      m->last_rval = rval;
+    }
   }
-  if ( fid )
-    PL_close_foreign_frame(fid);
+  pthread_mutex_unlock(&m->mutex);
 
-  db_status(rval, handle);
-  return FALSE;				/* also on rval = 0! */
+  return NULL;
 }
 
 
-static foreign_t
-pl_bdb_get(term_t handle, term_t key, term_t value, control_t ctx)
-{ int rval;
+static int
+start_maint_task(maint_task *m)
+{ int rc;
 
-  NOSIG(rval = pl_bdb_getdel(handle, key, value, ctx, FALSE));
+  if ( m->started )
+    return 0;
+  if ( (rc=pthread_create(&m->thread, NULL, maint_thread, m)) == 0 )
+    m->started = TRUE;
 
-  return rval;
+  return rc;
 }
 
 
-static foreign_t
-pl_bdb_del3(term_t handle, term_t key, term_t value, control_t ctx)
-{ int rval;
+static void
+stop_maint_tasks(dbenvh *env)
+{ int i;
+
+  pthread_mutex_lock(&maint_mutex);
+  for(i=0; i<MT_COUNT; i++)
+  { maint_task *m;
+
+    if ( (m=env->maint[i]) )
+    { env->maint[i] = NULL;
+      if ( m->started )
+      { pthread_mutex_lock(&m->mutex);
+	m->stop = TRUE;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	pthread_join(m->thread, NULL);
+      }
+      pthread_mutex_destroy(&m->mutex);
+      pthread_cond_destroy(&m->cond);
+      free(m);
+    }
+  }
+  pthread_mutex_unlock(&maint_mutex);
+}
 
-  NOSIG(rval=pl_bdb_getdel(handle, key, value, ctx, TRUE));
 
-  return rval;
+static int
+get_maint_type(term_t t, maint_type *type)
+{ char *s;
+  int i;
+
+  if ( !PL_get_chars(t, &s, CVT_ATOM|CVT_EXCEPTION) )
+    return FALSE;
+  for(i=0; i<MT_COUNT; i++)
+  { if ( strcmp(s, maint_names[i]) == 0 )
+    { *type = i;
+      return TRUE;
+    }
+  }
+
+  return PL_domain_error("bdb_maintenance_task", t),FALSE;
 }
 
 
 static int
-bdb_close_env(dbenvh *env, int silent)
-{ int rc = TRUE;
+get_interval(term_t t, double *secs)
+{ if ( !PL_get_float_ex(t, secs) )
+    return FALSE;
+  if ( *secs <= 0.0 )
+    return PL_domain_error("positive_number", t);
 
-  if ( env->env )
-  { int rval = env->env->close(env->env, 0);
+  return TRUE;
+}
 
-    if ( silent )			/* do not throw exceptions */
-    { if ( rval )
-	Sdprintf("DB: ENV close failed: %s\n", db_strerror(rc));
-      rc = !rval;
-    } else
-    { rc = db_status_env(rval, env);
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+bdb_maintenance(+Env, +Task, +Action) controls a task.  Action is one of
+interval(Seconds), which starts the task  if needed, `run`, which runs
+it now, and `stop`.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+pl_bdb_maintenance(term_t environment, term_t task, term_t action)
+{ dbenvh *env;
+  maint_type type;
+  maint_task *m;
+  atom_t name;
+  size_t arity;
+  int rc = 0;
+
+  if ( !get_dbenv(environment, &env) ||
+       !get_maint_type(task, &type) )
+    return FALSE;
+  if ( !PL_get_name_arity(action, &name, &arity) )
+    return PL_type_error("bdb_maintenance_action", action);
+  if ( !env->env || !(env->flags&DB_THREAD) )
+    return PL_permission_error("maintain", "bdb_environment", environment);
+
+  pthread_mutex_lock(&maint_mutex);
+  if ( name == ATOM_interval && arity == 1 )
+  { term_t a = PL_new_term_ref();
+    double secs;
+
+    _PL_get_arg(1, action, a);
+    if ( !get_interval(a, &secs) )
+    { pthread_mutex_unlock(&maint_mutex);
+      return FALSE;
+    }
+    if ( !(m=new_maint_task(env, type)) )
+    { pthread_mutex_unlock(&maint_mutex);
+      return PL_resource_error("memory");
+    }
+    pthread_mutex_lock(&m->mutex);
+    m->interval = secs;
+    m->changed = TRUE;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->mutex);
+    rc = start_maint_task(m);
+  } else if ( (name == ATOM_run || name == ATOM_stop) && arity == 0 )
+  { if ( (m=env->maint[type]) && m->started )
+    { pthread_mutex_lock(&m->mutex);
+      if ( name == ATOM_run )
+	m->run = TRUE;
+      else
+	m->stop = TRUE;
+      pthread_cond_signal(&m->cond);
+      pthread_mutex_unlock(&m->mutex);
+      if ( name == ATOM_stop )
+      { pthread_join(m->thread, NULL);
+	env->maint[type] = NULL;
+	pthread_mutex_destroy(&m->mutex);
+	pthread_cond_destroy(&m->cond);
+	free(m);
+      }
     }
+  } else
+  { pthread_mutex_unlock(&maint_mutex);
+    return PL_domain_error("bdb_maintenance_action", action);
+  }
+  pthread_mutex_unlock(&maint_mutex);
 
-    env->env	= NULL;
-    env->flags  = 0;
-    env->thread = 0;
-    if ( env->home )
-    { free(env->home);
-      env->home = NULL;
+  if ( rc )
+    return PL_resource_error("threads");
+
+  return TRUE;
+}
+
+
+/* bdb_maintenance_status(+Env, -Dict) */
+
+static foreign_t
+pl_bdb_maintenance_status(term_t environment, term_t status)
+{ dbenvh *env;
+  stat_dict d, td;
+  term_t t = PL_new_term_ref();
+  int i, rc = TRUE;
+
+  if ( !get_dbenv(environment, &env) ||
+       !init_stat_dict(&d) )
+    return FALSE;
+
+  pthread_mutex_lock(&maint_mutex);
+  for(i=0; i<MT_COUNT && rc; i++)
+  { maint_task *m;
+
+    if ( (m=env->maint[i]) && m->started )
+    { pthread_mutex_lock(&m->mutex);
+      rc = ( init_stat_dict(&td) &&
+	     add_stat_float(&td, "interval", m->interval) &&
+	     add_stat_int(&td, "runs", (int64_t)m->runs) &&
+	     add_stat_int(&td, "last_error", m->last_rval) &&
+	     ( m->type != MT_TRICKLE ||
+	       ( add_stat_int(&td, "percent", m->arg1) &&
+		 add_stat_int(&td, "pages_written", (int64_t)m->pages) ) ) &&
+	     ( m->type != MT_CHECKPOINT ||
+	       ( add_stat_int(&td, "kbytes", m->arg1) &&
+		 add_stat_int(&td, "minutes", m->arg2) ) ) &&
+	     put_stat_dict(stat_value(&d, maint_names[i]), &td) );
+      pthread_mutex_unlock(&m->mutex);
     }
   }
+  pthread_mutex_unlock(&maint_mutex);
 
-  return rc;
+  rc = put_stat_dict(t, &d) && rc;
+
+  return rc && PL_unify(status, t);
 }
 
 
@@ -1517,6 +8395,18 @@ static db_flag dbenv_flags[] =
   { (char*)NULL,	0,		     0 }
 };
 
+/* Flags for DB_ENV->set_flags() */
+
+static db_flag dbenv_set_flags[] =
+{ { "txn_nosync",	DB_TXN_NOSYNC,	     0 },
+  { "txn_write_nosync",	DB_TXN_WRITE_NOSYNC, 0 },
+#ifdef DB_TXN_SNAPSHOT
+  { "multiversion",	DB_MULTIVERSION,     0 },
+  { "txn_snapshot",	DB_TXN_SNAPSHOT,     0 },
+#endif
+  { (char*)NULL,	0,		     0 }
+};
+
 #define F_ERROR       ((u_int32_t)-1)
 #define F_UNPROCESSED ((u_int32_t)-2)
 
@@ -1543,6 +8433,20 @@ lookup_flag(db_flag *fp, atom_t name, term_t arg)
 }
 
 
+static db_flag lk_detect_policies[] =
+{ { "default",		DB_LOCK_DEFAULT,     0 },
+  { "expire",		DB_LOCK_EXPIRE,	     0 },
+  { "maxlocks",		DB_LOCK_MAXLOCKS,    0 },
+  { "maxwrite",		DB_LOCK_MAXWRITE,    0 },
+  { "minlocks",		DB_LOCK_MINLOCKS,    0 },
+  { "minwrite",		DB_LOCK_MINWRITE,    0 },
+  { "oldest",		DB_LOCK_OLDEST,	     0 },
+  { "random",		DB_LOCK_RANDOM,	     0 },
+  { "youngest",		DB_LOCK_YOUNGEST,    0 },
+  { (char*)NULL,	0,		     0 }
+};
+
+
 static foreign_t
 bdb_init(term_t newenv, term_t option_list)
 { int rval;
@@ -1553,6 +8457,8 @@ bdb_init(term_t newenv, term_t option_list)
   char *home = NULL;
   char *config[MAXCONFIG];
   int nconf = 0;
+  uint64_t cache_size = 0;		/* mp_size(Bytes) */
+  int ncache = 0;			/* mp_ncache(Count) */
   dbenvh *env;
 
   if ( newenv )
@@ -1622,18 +8528,138 @@ bdb_init(term_t newenv, term_t option_list)
 	env->env->set_mp_mmapsize(env->env, v);
 	flags |= DB_INIT_MPOOL;
       } else if ( name == ATOM_mp_size ) /* mp_size */
-      { size_t v;
+      { int64_t v;
 
-	if ( !PL_get_size_ex(a, &v) )
-	  return FALSE;
-	env->env->set_cachesize(env->env, 0, v, 0);
+	if ( !PL_get_int64_ex(a, &v) )
+	  goto pl_error;
+	if ( v <= 0 )
+	{ PL_domain_error("positive_integer", a);
+	  goto pl_error;
+	}
+	cache_size = (uint64_t)v;
 	flags |= DB_INIT_MPOOL;
+      } else if ( name == ATOM_mp_ncache )
+      { if ( !PL_get_integer_ex(a, &ncache) )
+	  goto pl_error;
+	if ( ncache < 1 )
+	{ PL_domain_error("positive_integer", a);
+	  goto pl_error;
+	}
+      } else if ( name == ATOM_lg_bsize || name == ATOM_lg_max ||
+		  name == ATOM_lk_max_locks || name == ATOM_lk_max_lockers ||
+		  name == ATOM_lk_max_objects || name == ATOM_tx_max )
+      { DB_ENV *e = env->env;
+	u_int32_t v;
+
+	if ( !get_u32_ex(a, &v) )
+	  goto pl_error;
+	if ( name == ATOM_lg_bsize )
+	  rval = e->set_lg_bsize(e, v);
+	else if ( name == ATOM_lg_max )
+	  rval = e->set_lg_max(e, v);
+	else if ( name == ATOM_lk_max_locks )
+	  rval = e->set_lk_max_locks(e, v);
+	else if ( name == ATOM_lk_max_lockers )
+	  rval = e->set_lk_max_lockers(e, v);
+	else if ( name == ATOM_lk_max_objects )
+	  rval = e->set_lk_max_objects(e, v);
+	else
+	  rval = e->set_tx_max(e, v);
+	if ( rval )
+	  goto db_error;
+#ifdef DB47
+      } else if ( name == ATOM_mp_max_openfd )
+      { int v;
+
+	if ( !PL_get_integer_ex(a, &v) )
+	  goto pl_error;
+	if ( (rval=env->env->set_mp_max_openfd(env->env, v)) )
+	  goto db_error;
+#endif
       } else if ( name == ATOM_thread_count )
       { size_t v;
 
 	if ( !PL_get_size_ex(a, &v) )
 	  return FALSE;
 	env->env->set_thread_count(env->env, v);
+      } else if ( name == ATOM_lk_detect )
+      { atom_t policy;
+	u_int32_t v;
+
+	if ( !PL_get_atom_ex(a, &policy) )
+	  goto pl_error;
+	if ( (v=lookup_flag(lk_detect_policies, policy, 0)) == F_UNPROCESSED )
+	{ PL_domain_error("lk_detect", a);
+	  goto pl_error;
+	}
+	if ( (rval=env->env->set_lk_detect(env->env, v)) )
+	  goto db_error;
+      } else if ( name == ATOM_checkpoint || name == ATOM_trickle ||
+		  name == ATOM_log_archive )
+      { maint_type type = ( name == ATOM_checkpoint ? MT_CHECKPOINT :
+			    name == ATOM_trickle    ? MT_TRICKLE :
+						      MT_ARCHIVE );
+	maint_task *m;
+	double secs;
+
+	if ( !get_interval(a, &secs) )
+	  goto pl_error;
+	if ( !(m=new_maint_task(env, type)) )
+	{ PL_resource_error("memory");
+	  goto pl_error;
+	}
+	m->interval = secs;
+	flags |= DB_THREAD;
+      } else if ( name == ATOM_checkpoint_kbytes ||
+		  name == ATOM_checkpoint_minutes ||
+		  name == ATOM_trickle_percent )
+      { maint_task *m;
+	u_int32_t v;
+
+	if ( !get_u32_ex(a, &v) )
+	  goto pl_error;
+	if ( !(m=new_maint_task(env, name == ATOM_trickle_percent
+					? MT_TRICKLE : MT_CHECKPOINT)) )
+	{ PL_resource_error("memory");
+	  goto pl_error;
+	}
+	if ( name == ATOM_checkpoint_minutes )
+	  m->arg2 = v;
+	else
+	  m->arg1 = v;
+      } else if ( name == ATOM_log_auto_remove )
+      { int v;
+
+	if ( !PL_get_bool_ex(a, &v) )
+	  goto pl_error;
+#ifdef DB47
+	if ( (rval=env->env->log_set_config(env->env, DB_LOG_AUTO_REMOVE, v)) )
+	  goto db_error;
+#else
+	if ( (rval=env->env->set_flags(env->env, DB_LOG_AUTOREMOVE, v)) )
+	  goto db_error;
+#endif
+      } else if ( name == ATOM_group_commit )
+      { db_timeout_t v;
+
+	if ( !get_timeout(a, &v) )
+	  goto pl_error;
+	if ( !env->group_commit &&
+	     !(env->group_commit = new_group_commit((long)v)) )
+	{ PL_resource_error("memory");
+	  goto pl_error;
+	}
+	env->group_commit->window = (long)v;
+      } else if ( name == ATOM_lock_timeout || name == ATOM_txn_timeout )
+      { db_timeout_t v;
+
+	if ( !get_timeout(a, &v) )
+	  goto pl_error;
+	if ( (rval=env->env->set_timeout(env->env, v,
+					 name == ATOM_lock_timeout
+					   ? DB_SET_LOCK_TIMEOUT
+					   : DB_SET_TXN_TIMEOUT)) )
+	  goto db_error;
       } else if ( name == ATOM_home )	/* db_home */
       {	if ( !PL_get_file_name(a, &home,
 			       PL_FILE_OSPATH|PL_FILE_EXIST|PL_FILE_ABSOLUTE) )
@@ -1668,8 +8694,17 @@ bdb_init(term_t newenv, term_t option_list)
 	if ( !PL_get_nil_ex(a) )
 	  goto pl_error;
       } else
-      { u_int32_t fv = lookup_flag(dbenv_flags, name, a);
+      { u_int32_t fv;
+
+	if ( (fv=lookup_flag(dbenv_set_flags, name, a)) != F_UNPROCESSED )
+	{ if ( fv == F_ERROR )
+	    goto pl_error;
+	  if ( fv && (rval=env->env->set_flags(env->env, fv, 1)) )
+	    goto db_error;
+	  continue;
+	}
 
+	fv = lookup_flag(dbenv_flags, name, a);
 	switch(fv)
 	{ case F_ERROR:
 	    goto pl_error;
@@ -1689,6 +8724,26 @@ bdb_init(term_t newenv, term_t option_list)
   if ( !PL_get_nil_ex(options) )
     goto pl_error;
 
+  if ( cache_size || ncache )		/* cache size and regions */
+  { const uint64_t gb = 1024*1024*1024;
+
+#ifdef DB43
+    if ( !cache_size )
+    { u_int32_t gbytes, bytes;
+      int n;
+
+      if ( (rval=env->env->get_cachesize(env->env, &gbytes, &bytes, &n)) )
+	goto db_error;
+      cache_size = (uint64_t)gbytes*gb + bytes;
+    }
+#endif
+    if ( (rval=env->env->set_cachesize(env->env,
+				       (u_int32_t)(cache_size/gb),
+				       (u_int32_t)(cache_size%gb),
+				       ncache)) )
+      goto db_error;
+  }
+
   if ( (rval=env->env->open(env->env, home, flags, 0666)) != 0 )
     goto db_error;
   if ( newenv && !unify_dbenv(newenv, env) )
@@ -1699,6 +8754,18 @@ bdb_init(term_t newenv, term_t option_list)
   if ( !(flags&DB_THREAD) )
     env->thread = PL_thread_self();
 
+  { int i;				/* start maintenance threads */
+
+    for(i=0; i<MT_COUNT; i++)
+    { maint_task *m = env->maint[i];
+
+      if ( m && m->interval > 0.0 && start_maint_task(m) )
+      { PL_resource_error("threads");
+	goto pl_error;
+      }
+    }
+  }
+
   if ( !rval )
     return TRUE;
 
@@ -1797,21 +8864,69 @@ install_bdb4pl(void)
   PL_register_foreign("bdb_close",	       1, pl_bdb_close,		    0);
   PL_register_foreign("bdb_is_open",	       1, pl_bdb_is_open,	    0);
   PL_register_foreign("bdb_put",	       3, pl_bdb_put,		    0);
+  PL_register_foreign("bdb_put",	       4, pl_bdb_put4,		    0);
   PL_register_foreign("bdb_del",	       2, pl_bdb_del2,		    0);
   PL_register_foreign("bdb_del",	       3, pl_bdb_del3,		    NDET);
+  PL_register_foreign("bdb_del",	       4, pl_bdb_del4,		    NDET);
   PL_register_foreign("bdb_getall",	       3, pl_bdb_getall,	    0);
   PL_register_foreign("bdb_get",	       3, pl_bdb_get,		    NDET);
+  PL_register_foreign("bdb_get",	       4, pl_bdb_get4,		    NDET);
   PL_register_foreign("bdb_enum",	       3, pl_bdb_enum,		    NDET);
+  PL_register_foreign("bdb_enum_keys",	       2, pl_bdb_enum_keys,	    NDET);
+  PL_register_foreign("bdb_exists",	       2, pl_bdb_exists,	    0);
+  PL_register_foreign("bdb_count",	       3, pl_bdb_count,		    0);
+  PL_register_foreign("bdb_get_many",	       3, pl_bdb_get_many,	    0);
+  PL_register_foreign("bdb_get_partial",       5, pl_bdb_get_partial,	    0);
+  PL_register_foreign("bdb_put_partial",       5, pl_bdb_put_partial,	    0);
+  PL_register_foreign("bdb_put_many",	       3, pl_bdb_put_many,	    0);
+  PL_register_foreign("bdb_db_statistics",     2, pl_bdb_db_statistics2,    0);
+  PL_register_foreign("bdb_db_statistics",     3, pl_bdb_db_statistics3,    0);
+  PL_register_foreign("bdb_partition_keys",    3, pl_bdb_partition_keys,    0);
+  PL_register_foreign("bdb_associate",	       3, pl_bdb_associate,	    0);
+  PL_register_foreign("bdb_pget",	       4, pl_bdb_pget,		    NDET);
+  PL_register_foreign("bdb_enum_range",	       4, pl_bdb_enum_range,	    NDET);
+  PL_register_foreign("bdb_cursor_open",       3, pl_bdb_cursor_open,	    0);
+  PL_register_foreign("bdb_cursor_close",      1, pl_bdb_cursor_close,	    0);
+  PL_register_foreign("bdb_cursor_seek",       4, pl_bdb_cursor_seek,	    0);
+  PL_register_foreign("bdb_cursor_next",       3, pl_bdb_cursor_next,	    0);
+  PL_register_foreign("bdb_cursor_prev",       3, pl_bdb_cursor_prev,	    0);
+  PL_register_foreign("bdb_cursor_last",       3, pl_bdb_cursor_last,	    0);
   PL_register_foreign("bdb_init",	       1, pl_bdb_init1,		    0);
   PL_register_foreign("bdb_init",	       2, pl_bdb_init2,		    0);
   PL_register_foreign("bdb_close_environment", 1, pl_bdb_close_environment, 0);
   PL_register_foreign("bdb_is_open_env",       1, pl_bdb_is_open_env,	    0);
+  PL_register_foreign("bdb_env_statistics",    2, pl_bdb_env_statistics2,   0);
+  PL_register_foreign("bdb_env_statistics",    3, pl_bdb_env_statistics3,   0);
+  PL_register_foreign("bdb_maintenance",       3, pl_bdb_maintenance,	    0);
+  PL_register_foreign("bdb_maintenance_status", 2, pl_bdb_maintenance_status, 0);
+  PL_register_foreign("bdb_compact",	       2, pl_bdb_compact2,	    0);
+  PL_register_foreign("bdb_compact",	       3, pl_bdb_compact3,	    0);
+  PL_register_foreign("bdb_truncate",	       2, pl_bdb_truncate,	    0);
+  PL_register_foreign("bdb_append",	       3, pl_bdb_append,	    0);
+  PL_register_foreign("bdb_enqueue",	       3, pl_bdb_enqueue,	    0);
+  PL_register_foreign("bdb_dequeue",	       3, pl_bdb_dequeue3,	    0);
+  PL_register_foreign("bdb_dequeue",	       4, pl_bdb_dequeue4,	    0);
+#ifdef DB43
+  PL_register_foreign("bdb_sequence_open",     4, pl_bdb_sequence_open,	    0);
+  PL_register_foreign("bdb_sequence_next",     2, pl_bdb_sequence_next2,    0);
+  PL_register_foreign("bdb_sequence_next",     3, pl_bdb_sequence_next3,    0);
+  PL_register_foreign("bdb_sequence_close",    1, pl_bdb_sequence_close,    0);
+#endif
   PL_register_foreign("bdb_env_property",      2, pl_bdb_env_property,	    0);
   PL_register_foreign("bdb_transaction",       1, pl_bdb_transaction1,	    0);
   PL_register_foreign("bdb_transaction",       2, pl_bdb_transaction2,	    0);
+  PL_register_foreign("$bdb_transaction",      3, pl_bdb_transaction3,	    0);
+  PL_register_foreign("bdb_txn_begin",	       3, pl_bdb_txn_begin,	    0);
+  PL_register_foreign("bdb_txn_commit",	       1, pl_bdb_txn_commit1,	    0);
+  PL_register_foreign("bdb_txn_commit",	       2, pl_bdb_txn_commit,	    0);
+  PL_register_foreign("bdb_txn_abort",	       1, pl_bdb_txn_abort,	    0);
+  PL_register_foreign("bdb_enable_metrics",    1, pl_bdb_enable_metrics,    0);
+  PL_register_foreign("bdb_handle_metrics",    2, pl_bdb_handle_metrics2,   0);
+  PL_register_foreign("bdb_handle_metrics",    3, pl_bdb_handle_metrics3,   0);
   PL_register_foreign("bdb_version",           1, pl_bdb_version,	    0);
 
   pthread_key_create(&transaction_key, free_transaction_stack);
+  pthread_key_create(&buffers_key, free_thread_buffers);
   default_env.symbol = ATOM_default;
 }
 
@@ -1822,5 +8937,9 @@ uninstall(void)
   { pthread_key_delete(transaction_key);
     transaction_key = 0;
   }
+  if ( buffers_key )
+  { pthread_key_delete(buffers_key);
+    buffers_key = 0;
+  }
   bdb_close_env(&default_env, TRUE);
 }
@@ -56,6 +56,32 @@
 #endif
 #endif
 
+/* Consider anything >= DB4.7 as DB47 */
+#if DB_VERSION_MAJOR >= 4
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 7
+#define DB47 1
+#endif
+#endif
+
+/* Consider anything >= DB4.6 as DB46 */
+#if DB_VERSION_MAJOR >= 4
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 6
+#define DB46 1
+#endif
+#endif
+
+/* Consider anything >= DB4.8 as DB48 */
+#if DB_VERSION_MAJOR >= 4
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 8
+#define DB48 1
+#endif
+#endif
+
+/* Consider anything >= DB5.2 as DB52 */
+#if DB_VERSION_MAJOR > 5 || (DB_VERSION_MAJOR == 5 && DB_VERSION_MINOR >= 2)
+#define DB52 1
+#endif
+
 /* Consider anything >= DB4.1 as DB41 */
 #if DB_VERSION_MAJOR >= 4
 #if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 1
@@ -71,9 +97,53 @@ typedef enum
   D_ATOM,				/* an atom (length+cahsr) */
   D_CBLOB,				/* a C-blob (bytes) */
   D_CSTRING,				/* a C-string (0-terminated) */
-  D_CLONG				/* a C-long */
+  D_CLONG,				/* a C-long */
+  D_INT64,				/* ordered 64-bit integer */
+  D_FLOAT,				/* ordered double */
+  D_TERM_ORDERED,			/* a term in standard order */
+  D_TERM_DICT,				/* a term using an atom dictionary */
+  D_RECNO,				/* record number (recno, queue) */
+  D_HEAP_RID				/* heap record id */
 } dtype;
 
+#define METRIC_BUCKETS 32		/* log2(usec) latency buckets */
+
+typedef struct op_metrics
+{ uint64_t	count;			/* # operations */
+  uint64_t	total;			/* total time in nanoseconds */
+  uint64_t	max;			/* longest time in nanoseconds */
+  uint64_t	buckets[METRIC_BUCKETS]; /* bucket i: < 2^i usec */
+} op_metrics;
+
+typedef enum
+{ M_GET,				/* DB->get(), DB_SET, DB_GET_BOTH */
+  M_PUT,				/* DB->put() */
+  M_DEL,				/* DB->del(), DBC->c_del() */
+  M_CURSOR,				/* DBC->c_get() steps */
+  M_COUNT
+} db_op;
+
+typedef enum
+{ MT_CHECKPOINT,			/* DB_ENV->txn_checkpoint() */
+  MT_TRICKLE,				/* DB_ENV->memp_trickle() */
+  MT_ARCHIVE,				/* DB_ENV->log_archive() */
+  MT_COUNT
+} maint_type;
+
+struct maint_task;
+
+typedef enum
+{ C_NONE,				/* no compression */
+  C_PREFIX,				/* Berkeley DB prefix compression */
+  C_ZLIB				/* prefix keys, zlib large values */
+} compress_method;
+
+typedef struct compress_stats
+{ uint64_t	values;			/* # zlib compressed values */
+  uint64_t	raw_bytes;		/* their uncompressed size */
+  uint64_t	bytes;			/* their compressed size */
+} compress_stats;
+
 typedef struct
 { DB_ENV       *env;			/* the database environment */
 
@@ -82,9 +152,17 @@ typedef struct
   u_int32_t	flags;			/* flags used to create the env */
   int		thread;			/* associated thread */
   char	       *home;			/* Directory */
+  struct group_commit *group_commit;	/* group commit administration */
+  op_metrics	commit_metrics;		/* latency of commits */
+  struct maint_task *maint[MT_COUNT];	/* maintenance threads */
 } dbenvh;
 
-typedef struct
+struct dbcursor;
+struct cached_cursor;
+struct key_extractor;
+struct term_dict;
+
+typedef struct dbh
 { DB	       *db;			/* the database */
 
   atom_t	symbol;			/* <bdb>(...)  */
@@ -92,7 +170,20 @@ typedef struct
   u_int32_t	flags;			/* flags used to open the database */
   dtype		key_type;		/* type of the key */
   dtype		value_type;		/* type of the data */
+  DBTYPE	type;			/* access method */
   dbenvh       *env;			/* associated environment */
+  struct dbcursor *cursors;		/* open cursor objects */
+  int		cache_cursors;		/* cache a cursor per thread */
+  struct cached_cursor *cached_cursors;	/* cursors cached by threads */
+  struct dbh   *primary;		/* primary if we are a secondary */
+  atom_t	primary_symbol;		/* locked <bdb>(...) of primary */
+  struct key_extractor *extractor;	/* secondary key extraction */
+  op_metrics	metrics[M_COUNT];	/* latency per operation */
+  struct value_cache *vcache;		/* cache(Bytes) value cache */
+  struct term_dict *dict;		/* term_dict atom dictionary */
+  compress_method compress;		/* compress(Method) */
+  u_int32_t	compress_min;		/* zlib values of at least this size */
+  compress_stats compress_stats;	/* zlib compression statistics */
 } dbh;
 
 #endif /*DB4PL_H_INCLUDED*/
@@ -5,3 +5,4 @@
 #cmakedefine HAVE_DB_H
 #cmakedefine HAVE_SET_RPC_SERVER
 #cmakedefine HAVE_SET_SERVER
+#cmakedefine HAVE_ZLIB
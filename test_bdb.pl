@@ -38,9 +38,25 @@
           ]).
 :- autoload(library(bdb),
 	    [ bdb_open/4, bdb_put/3, bdb_enum/3, bdb_close/1,
-	      bdb_get/3, bdb_getall/3
+	      bdb_get/3, bdb_getall/3, bdb_get_many/3, bdb_del/3,
+	      bdb_exists/2, bdb_count/3, bdb_enum_keys/2,
+	      bdb_get_partial/5, bdb_put_partial/5, bdb_partition_keys/3,
+	      bdb_enum_range/4, bdb_associate/3, bdb_pget/4,
+	      bdb_db_statistics/2, bdb_enable_metrics/1, bdb_handle_metrics/3,
+	      bdb_compact/3, bdb_truncate/2, bdb_enqueue/3, bdb_dequeue/4,
+	      bdb_append/3, bdb_sequence_open/4, bdb_sequence_next/2,
+	      bdb_sequence_next/3, bdb_sequence_close/1,
+	      bdb_put_many/3, bdb_cursor_open/3, bdb_cursor_close/1,
+	      bdb_cursor_seek/4, bdb_cursor_next/3,
+	      bdb_init/2, bdb_close_environment/1, bdb_transaction/3,
+	      bdb_put/4, bdb_get/4, bdb_txn_begin/3, bdb_txn_commit/1,
+	      bdb_txn_abort/1, bdb_env_statistics/2, bdb_maintenance/3,
+	      bdb_maintenance_status/2, bdb_version/1
 	    ]).
-:- autoload(library(lists),[member/2]).
+:- autoload(library(lists),
+	    [member/2, append/3, reverse/2, min_list/2, max_list/2, numlist/3,
+	     nth1/3]).
+:- autoload(library(filesex), [delete_directory_and_contents/1]).
 :- autoload(library(plunit),[run_tests/1,begin_tests/1,end_tests/1]).
 
 
@@ -81,6 +97,19 @@ tmp_output(Base, File) :-
                        [ access(write)
                        ]).
 
+%!  test_env(+Options, -Dir, -Env) is det.
+%
+%   Create a transactional environment in a new temporary directory.
+
+test_env(Options, Dir, Env) :-
+    tmp_file(bdb_env, Dir),
+    make_directory(Dir),
+    bdb_init(Env, [home(Dir), create(true), init_txn(true)|Options]).
+
+free_test_env(Dir, Env) :-
+    bdb_close_environment(Env),
+    delete_directory_and_contents(Dir).
+
 test(loop,
      [ setup(tmp_output('test.db', DBFile)),
        cleanup(delete_existing_file(DBFile)),
@@ -116,5 +145,679 @@ test(duplicates,
                   bdb_put(DB, X, Y))),
     bdb_getall(DB, 5, Out),
     bdb_close(DB).
+test(count,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       [C5,C11,U1,U2] == [10,0,1,0]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [duplicates(true)]),
+    forall(between(1, 10, X),
+           forall(between(1, 10, Y),
+                  bdb_put(DB, X, Y))),
+    bdb_exists(DB, 5),
+    \+ bdb_exists(DB, 11),
+    bdb_count(DB, 5, C5),
+    bdb_count(DB, 11, C11),
+    bdb_close(DB),
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB2, []),
+    bdb_put(DB2, a, f(x)),
+    bdb_count(DB2, a, U1),
+    bdb_count(DB2, b, U2),
+    bdb_close(DB2).
+test(cache_cursors,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       [Vs,Nested,Rest] == [[a,b,c],[a-a,a-b,b-a,b-b],[b,c]]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB,
+             [ duplicates(true), cache_cursors(true),
+               key(atom), value(atom)
+             ]),
+    forall(member(V, [a,b,c]), bdb_put(DB, k, V)),
+    findall(V, bdb_get(DB, k, V), Vs),
+    findall(V1-V2, ( bdb_get(DB, k, V1), V1 \== c,
+                     bdb_get(DB, k, V2), V2 \== c
+                   ), Nested),
+    once(bdb_del(DB, k, a)),
+    bdb_getall(DB, k, Rest),
+    bdb_close(DB).
+test(dupsort,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       [Len,Min,Max] == [999,1,1000]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB,
+             [ dupsort(true), key(atom), value(c_long) ]),
+    forall(between(1, 1000, X), bdb_put(DB, k, X)),
+    bdb_put(DB, k, 10),
+    bdb_get(DB, k, 500),
+    \+ bdb_get(DB, k, 1001),
+    bdb_del(DB, k, 500),
+    \+ bdb_get(DB, k, 500),
+    bdb_getall(DB, k, Values),
+    length(Values, Len),
+    min_list(Values, Min),
+    max_list(Values, Max),
+    bdb_close(DB).
+
+test(enum_keys,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Keys == [1,2,3]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [duplicates(true)]),
+    forall(between(1, 3, X),
+           forall(between(1, 5, Y),
+                  bdb_put(DB, X, Y))),
+    findall(K, bdb_enum_keys(DB, K), Keys0),
+    msort(Keys0, Keys),
+    bdb_close(DB).
+test(partial,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       [Head,Tail,All] == ["head","body","HEAD,body"]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(atom), value(c_blob)]),
+    bdb_put(DB, k, "header,body"),
+    bdb_get_partial(DB, k, 0, 4, Head),
+    bdb_get_partial(DB, k, 7, 100, Tail),
+    bdb_put_partial(DB, k, 0, 6, "HEAD"),
+    bdb_get(DB, k, All),
+    bdb_close(DB).
+
+test(partition,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Keys == Expected
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(int64), value(int64)]),
+    numlist(1, 5000, Expected),
+    forall(member(X, Expected), bdb_put(DB, X, X)),
+    bdb_partition_keys(DB, 4, Ranges),
+    length(Ranges, Len),
+    Len >= 1, Len =< 4,
+    findall(K, ( member(R, Ranges),
+                 bdb_enum_range(DB, R, K, _)
+               ), Keys),
+    bdb_close(DB).
+
+test(get_many,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Pairs == [3-9, 5-25, 7-49]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(c_long), value(c_long)]),
+    forall(between(1, 10, X),
+           ( Y is X*X,
+             bdb_put(DB, X, Y)
+           )),
+    bdb_get_many(DB, [7, 3, 42, 5, 3], Pairs0),
+    msort(Pairs0, Pairs),
+    bdb_close(DB).
+
+test(put_many,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Pairs == PairsIn
+     ]) :-
+    delete_existing_file(DBFile),
+    findall(X-f(X), between(1, 1000, X), PairsIn),
+    reverse(PairsIn, Reversed),
+    bdb_open(DBFile, update, DB, [key(c_long)]),
+    bdb_put_many(DB, Reversed, [chunk(100)]),
+    findall(K-V, bdb_enum(DB, K, V), Pairs0),
+    msort(Pairs0, Pairs),
+    bdb_close(DB).
+
+test(cursor_prefix,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Keys == [ab, abc, abd]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(atom)]),
+    forall(member(K, [a, ab, abc, abd, b, ba]),
+           bdb_put(DB, K, true)),
+    bdb_cursor_open(DB, Cursor, []),
+    bdb_cursor_seek(Cursor, prefix(ab), K0, _),
+    cursor_keys(Cursor, K0, Keys),
+    bdb_cursor_close(Cursor),
+    bdb_close(DB).
+
+cursor_keys(Cursor, K0, [K0|T]) :-
+    (   bdb_cursor_next(Cursor, K1, _)
+    ->  cursor_keys(Cursor, K1, T)
+    ;   T = []
+    ).
+
+test(term_ordered,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Keys == Sorted
+     ]) :-
+    delete_existing_file(DBFile),
+    In = [b, 1, 2.0, "s", f(x), a, -5, g(a,b), f(a), 'aa\u0410p', [x], 1.0],
+    msort(In, Sorted),
+    bdb_open(DBFile, update, DB, [key(term_ordered)]),
+    forall(member(K, In), bdb_put(DB, K, true)),
+    findall(K, bdb_enum(DB, K, _), Keys),
+    bdb_close(DB).
+test(term_ordered_bigint,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Keys == Sorted
+     ]) :-
+    delete_existing_file(DBFile),
+    In = [ 9007199254740995, 9007199254740996.0, 9007199254740996,
+           9007199254740997, 9223372036854775807, 9.223372036854775808e18,
+           -9007199254740995, -9007199254740996.0,
+           -9223372036854775808, -9.223372036854775808e18
+         ],
+    msort(In, Sorted),
+    bdb_open(DBFile, update, DB, [key(term_ordered)]),
+    forall(member(K, In), bdb_put(DB, K, true)),
+    findall(K, bdb_enum(DB, K, _), Keys),
+    bdb_close(DB).
+
+test(associate,
+     [ setup(( tmp_output('test.db', DBFile),
+               tmp_output('index.db', IndexFile)
+             )),
+       cleanup(( delete_existing_file(DBFile),
+                 delete_existing_file(IndexFile)
+               )),
+       Pairs == [1-person(bob,nl), 3-person(carol,nl)]
+     ]) :-
+    delete_existing_file(DBFile),
+    delete_existing_file(IndexFile),
+    bdb_open(DBFile, update, DB, [key(c_long)]),
+    bdb_open(IndexFile, update, Index, [key(atom), dupsort(true)]),
+    bdb_associate(DB, Index, arg(2)),
+    bdb_put(DB, 1, person(bob, nl)),
+    bdb_put(DB, 2, person(alice, uk)),
+    bdb_put(DB, 3, person(carol, nl)),
+    bdb_put(DB, 4, person(dave, nl)),
+    bdb_del(DB, 4, _),
+    findall(K-V, bdb_pget(Index, nl, K, V), Pairs0),
+    msort(Pairs0, Pairs),
+    bdb_close(Index),
+    bdb_close(DB).
+
+test(db_statistics,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       NKeys == 100
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(c_long), value(c_long)]),
+    forall(between(1, 100, X), bdb_put(DB, X, X)),
+    bdb_db_statistics(DB, Stats),
+    NKeys = Stats.nkeys,
+    bdb_close(DB).
+
+test(metrics,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(( delete_existing_file(DBFile),
+                 bdb_enable_metrics(false)
+               )),
+       Counts == 10-0
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(c_long), value(c_long)]),
+    bdb_enable_metrics(true),
+    forall(between(1, 10, X), bdb_put(DB, X, X)),
+    bdb_handle_metrics(DB, M1, [clear(true)]),
+    bdb_handle_metrics(DB, M2, []),
+    Counts = M1.put.count-M2.put.count,
+    bdb_close(DB).
+
+test(compact,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Result == 500-[]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [key(c_long), value(c_long)]),
+    forall(between(1, 1000, X), bdb_put(DB, X, X)),
+    forall((between(1, 1000, X), X mod 2 =:= 0), bdb_del(DB, X, _)),
+    bdb_compact(DB, Stats, [fill_percent(80), free_space(true)]),
+    assertion(integer(Stats.pages_free)),
+    bdb_truncate(DB, Count),
+    findall(K, bdb_enum_keys(DB, K), Keys),
+    Result = Count-Keys,
+    bdb_close(DB).
+
+test(append,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Result == [1,2,3]-b-[1-a,3-c]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [type(recno)]),
+    findall(R, (member(V, [a,b,c]), bdb_append(DB, V, R)), RecNos),
+    bdb_get(DB, 2, B),
+    bdb_del(DB, 2, _),
+    findall(K-V, bdb_enum(DB, K, V), Pairs),
+    Result = RecNos-B-Pairs,
+    bdb_close(DB).
+
+test(sequence,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Values == [100,101,102,103,114]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, []),
+    bdb_sequence_open(DB, ids, Seq, [initial(100), cache(10)]),
+    findall(V, (between(1, 4, _), bdb_sequence_next(Seq, V)), Values0),
+    bdb_sequence_next(Seq, _, [delta(10)]),
+    bdb_sequence_next(Seq, V5),
+    bdb_sequence_close(Seq),
+    bdb_close(DB),
+    append(Values0, [V5], Values).
+
+test(value_cache,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Result == [a(1),a(1),b(2)]-1
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [cache(65536)]),
+    bdb_put(DB, k, a(1)),
+    bdb_get(DB, k, V1),
+    bdb_get(DB, k, V2),
+    bdb_put(DB, k, b(2)),
+    bdb_get(DB, k, V3),
+    bdb_handle_metrics(DB, M, []),
+    Result = [V1,V2,V3]-M.cache.hits,
+    bdb_close(DB).
+
+test(value_cache_secondary,
+     [ setup(( tmp_output('test.db', DBFile),
+               tmp_output('index.db', IndexFile)
+             )),
+       cleanup(( delete_existing_file(DBFile),
+                 delete_existing_file(IndexFile)
+               )),
+       Result == person(bob,nl)-deleted
+     ]) :-
+    delete_existing_file(DBFile),
+    delete_existing_file(IndexFile),
+    bdb_open(DBFile, update, DB, [key(c_long), cache(65536)]),
+    bdb_open(IndexFile, update, Index, [key(atom), dupsort(true)]),
+    bdb_associate(DB, Index, arg(2)),
+    bdb_put(DB, 1, person(bob, nl)),
+    bdb_get(DB, 1, V0),
+    bdb_del(Index, nl, _),
+    (   bdb_get(DB, 1, V1)
+    ->  true
+    ;   V1 = deleted
+    ),
+    Result = V0-V1,
+    bdb_close(Index),
+    bdb_close(DB).
+
+test(queue,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Values == [job(1),job(2),job(3)]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [type(queue), record_length(64)]),
+    forall(between(1, 3, X), bdb_enqueue(DB, job(X), _)),
+    dequeue_all(DB, Values),
+    bdb_close(DB).
+
+dequeue_all(DB, [H|T]) :-
+    bdb_dequeue(DB, _, H, [wait(false)]),
+    !,
+    dequeue_all(DB, T).
+dequeue_all(_, []).
+
+test(dequeue_empty,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Result == [false,false]
+     ]) :-
+    delete_existing_file(DBFile),
+    bdb_open(DBFile, update, DB, [type(queue), record_length(64)]),
+    findall(R,
+            ( member(Options, [[wait(false)], [timeout(0.05)]]),
+              (   bdb_dequeue(DB, _, _, Options)
+              ->  R = true
+              ;   R = false
+              )
+            ),
+            Result),
+    bdb_close(DB).
+test(dequeue_wait,
+     [ setup(test_env([thread(true)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Value-Status == job-exception(stop)
+     ]) :-
+    directory_file_path(Dir, 'queue.db', DBFile),
+    bdb_open(DBFile, update, DB,
+             [environment(Env), type(queue), record_length(64)]),
+    thread_create(( sleep(0.1), bdb_enqueue(DB, job, _) ), Producer, []),
+    bdb_dequeue(DB, _, Value, []),
+    thread_join(Producer, true),
+    thread_create(bdb_dequeue(DB, _, _, []), Consumer, []),
+    sleep(0.1),
+    thread_signal(Consumer, throw(stop)),
+    thread_join(Consumer, Status),
+    bdb_close(DB).
+
+test(term_dict,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       true(Terms =@= In)
+     ]) :-
+    delete_existing_file(DBFile),
+    In = [ f(X, _, X), [a,b|_], "str", 3.14, -42,
+           123456789012345678901234567890, g('\u0410', [], f()) ],
+    Opts = [database(terms), key(term_dict), value(term_dict)],
+    bdb_open(DBFile, update, DB0, Opts),
+    forall(nth1(I, In, V), bdb_put(DB0, k(I), V)),
+    bdb_close(DB0),
+    bdb_open(DBFile, read, DB, Opts),
+    findall(V, (nth1(I, In, _), bdb_get(DB, k(I), V)), Terms),
+    bdb_close(DB).
+
+test(term_dict_lookup,
+     [ setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       Result == [false,0,[k(a)-1]]
+     ]) :-
+    delete_existing_file(DBFile),
+    Opts = [database(terms), key(term_dict)],
+    bdb_open(DBFile, update, DB0, Opts),
+    bdb_put(DB0, k(a), 1),
+    bdb_close(DB0),
+    bdb_open(DBFile, read, DB, Opts),
+    (   bdb_get(DB, k(unknown), _)
+    ->  Get = true
+    ;   Get = false
+    ),
+    bdb_count(DB, unknown(x), Count),
+    bdb_get_many(DB, [k(a), k(unknown)], Pairs),
+    Result = [Get,Count,Pairs],
+    bdb_close(DB).
+
+test(compress,
+     [ condition(zlib_compression),
+       setup(tmp_output('test.db', DBFile)),
+       cleanup(delete_existing_file(DBFile)),
+       true(Values == In)
+     ]) :-
+    delete_existing_file(DBFile),
+    numlist(1, 100, Keys),
+    findall(I-V, (member(I, Keys), format(atom(V), '~`xt~w~200|', [I])), In),
+    Opts = [key(int64), value(atom), compress(zlib(64))],
+    bdb_open(DBFile, update, DB0, Opts),
+    forall(member(K-V, In), bdb_put(DB0, K, V)),
+    bdb_handle_metrics(DB0, Metrics, []),
+    bdb_close(DB0),
+    assertion(Metrics.compress.ratio > 1),
+    bdb_open(DBFile, read, DB, Opts),
+    findall(K-V, bdb_enum(DB, K, V), Values),
+    bdb_close(DB).
+
+%   Compression requires Berkeley DB 4.8 and a package built with zlib.
+
+zlib_compression :-
+    bdb_version(Version),
+    Version >= 40800,
+    tmp_output('zlib.db', File),
+    delete_existing_file(File),
+    catch(bdb_open(File, update, DB, [compress(zlib)]),
+          error(bdb(_, _, _), _), fail),
+    bdb_close(DB),
+    delete_existing_file(File).
+
+test(transaction_retry,
+     [ setup(test_env([lk_detect(youngest), lock_timeout(1.0)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == 3-value
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    flag(bdb_attempt, _, 0),
+    bdb_transaction(Env, deadlock_until(3, DB), [retry(5)]),
+    flag(bdb_attempt, Attempts, Attempts),
+    bdb_get(DB, key, Value),
+    Result = Attempts-Value,
+    bdb_close(DB).
+test(transaction_option,
+     [ setup(test_env([], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       error(domain_error(transaction_option, isolaton(snapshot)))
+     ]) :-
+    bdb_transaction(Env, true, [retry(2), isolaton(snapshot)]).
+test(transaction_retry_exhausted,
+     [ setup(test_env([lk_detect(youngest)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == 2-lock_deadlock-false
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    flag(bdb_attempt, _, 0),
+    catch(bdb_transaction(Env, deadlock_until(10, DB), [retry(2)]),
+          error(bdb(Code, _, _), _), true),
+    flag(bdb_attempt, Attempts, Attempts),
+    (   bdb_exists(DB, key)
+    ->  Exists = true
+    ;   Exists = false
+    ),
+    Result = Attempts-Code-Exists,
+    bdb_close(DB).
+
+test(deadlock_retry,
+     [ setup(test_env([thread(true), lk_detect(youngest)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == [true,true]-true
+     ]) :-
+    directory_file_path(Dir, 'a.db', FileA),
+    directory_file_path(Dir, 'b.db', FileB),
+    bdb_open(FileA, update, DBA, [environment(Env)]),
+    bdb_open(FileB, update, DBB, [environment(Env)]),
+    thread_create(swap_writer(Env, DBA, DBB, a), T1, []),
+    thread_create(swap_writer(Env, DBB, DBA, b), T2, []),
+    thread_join(T1, S1),
+    thread_join(T2, S2),
+    bdb_get(DBA, key, VA),
+    bdb_get(DBB, key, VB),
+    (   VA == VB
+    ->  Serialized = true
+    ;   Serialized = false
+    ),
+    bdb_env_statistics(Env, Stats),
+    assertion(Stats.lock.ndeadlocks > 0),
+    Result = [S1,S2]-Serialized,
+    bdb_close(DBA),
+    bdb_close(DBB).
+
+%   Update the records in First and Second in this order.  Two threads
+%   that use the opposite order deadlock.  Two databases are used as
+%   btrees lock pages, so two keys on the same page would not deadlock.
+
+swap_writer(Env, First, Second, Value) :-
+    bdb_transaction(Env,
+                    ( bdb_put(First, key, Value),
+                      sleep(0.1),
+                      bdb_put(Second, key, Value)
+                    ),
+                    [retry(20)]).
+
+%   Simulate a transaction that is chosen as deadlock victim until
+%   attempt N.  The put of earlier attempts must be rolled back.
+
+deadlock_until(N, DB) :-
+    flag(bdb_attempt, A0, A0+1),
+    bdb_put(DB, key, value),
+    (   A0+1 < N
+    ->  throw(error(bdb(lock_deadlock, 'simulated deadlock', DB), _))
+    ;   true
+    ).
+
+test(group_commit,
+     [ setup(test_env([thread(true), group_commit(0.005)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Count == 42
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    findall(Id,
+            ( between(1, 4, T),
+              thread_create(forall(between(1, 10, I),
+                                   bdb_transaction(Env, bdb_put(DB, T-I, I), [])),
+                            Id, [])
+            ),
+            Ids),
+    forall(member(Id, Ids), thread_join(Id, true)),
+    bdb_transaction(Env, bdb_put(DB, nosync, 1), [sync(nosync)]),
+    bdb_transaction(Env, bdb_put(DB, write_nosync, 1), [sync(write_nosync)]),
+    findall(K, bdb_enum(DB, K, _), Keys),
+    length(Keys, Count),
+    bdb_close(DB).
+test(txn_nosync,
+     [ setup(test_env([txn_nosync(true)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Value == 1
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    bdb_transaction(Env, bdb_put(DB, key, 1), []),
+    bdb_get(DB, key, Value),
+    bdb_close(DB).
+
+test(snapshot,
+     [ setup(test_env([lock_timeout(2.0)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == old-new
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env), multiversion(true)]),
+    bdb_put(DB, key, old),
+    bdb_txn_begin(Env, Txn, []),
+    bdb_put(DB, key, new, [txn(Txn)]),
+    bdb_transaction(Env, bdb_get(DB, key, V0), [isolation(snapshot)]),
+    bdb_txn_commit(Txn),
+    bdb_get(DB, key, V1),
+    Result = V0-V1,
+    bdb_close(DB).
+
+test(txn_thread,
+     [ setup(test_env([thread(true)], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Value == value
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    bdb_txn_begin(Env, Txn, []),
+    thread_create(bdb_put(DB, key, value, [txn(Txn)]), Id, []),
+    thread_join(Id, true),
+    bdb_txn_commit(Txn),
+    bdb_get(DB, key, Value),
+    bdb_close(DB).
+test(txn_interleave,
+     [ setup(test_env([], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == 1-[true,false]
+     ]) :-
+    directory_file_path(Dir, 'a.db', FileA),
+    directory_file_path(Dir, 'b.db', FileB),
+    bdb_open(FileA, update, DBA, [environment(Env)]),
+    bdb_open(FileB, update, DBB, [environment(Env)]),
+    bdb_txn_begin(Env, TA, []),
+    bdb_txn_begin(Env, TB, []),
+    bdb_put(DBA, key, 1, [txn(TA)]),
+    bdb_put(DBB, key, 2, [txn(TB)]),
+    bdb_get(DBA, key, V, [txn(TA)]),
+    bdb_txn_abort(TB),
+    bdb_txn_commit(TA),
+    findall(E, ( member(DB, [DBA,DBB]),
+                 (bdb_exists(DB, key) -> E = true ; E = false)
+               ), Exists),
+    Result = V-Exists,
+    bdb_close(DBA),
+    bdb_close(DBB).
+
+test(env_tuning,
+     [ setup(test_env([ mp_size(8388608), mp_ncache(2),
+                        lg_bsize(262144), lg_max(4194304),
+                        lk_max_locks(5000), lk_max_lockers(1000),
+                        lk_max_objects(5000), tx_max(100)
+                      ], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == [2,262144,5000,100]
+     ]) :-
+    bdb_env_statistics(Env, Stats),
+    Result = [ Stats.mpool.ncache, Stats.log.lg_bsize,
+               Stats.lock.maxlocks, Stats.txn.maxtxns
+             ].
+test(db_tuning,
+     [ setup(test_env([], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == [8192-4, 20]
+     ]) :-
+    directory_file_path(Dir, 'btree.db', BTFile),
+    directory_file_path(Dir, 'hash.db', HFile),
+    bdb_open(BTFile, update, BT,
+             [environment(Env), pagesize(8192), bt_minkey(4)]),
+    bdb_open(HFile, update, H,
+             [environment(Env), type(hash), h_ffactor(20), h_nelem(1000)]),
+    bdb_put(BT, key, value),
+    bdb_put(H, key, value),
+    bdb_db_statistics(BT, BTStats),
+    bdb_db_statistics(H, HStats),
+    Result = [BTStats.pagesize-BTStats.minkey, HStats.ffactor],
+    bdb_close(BT),
+    bdb_close(H).
+
+test(maintenance,
+     [ setup(test_env([ thread(true), checkpoint(60),
+                        trickle(60), trickle_percent(20)
+                      ], Dir, Env)),
+       cleanup(free_test_env(Dir, Env)),
+       Result == [0-0, [checkpoint,log_archive]]
+     ]) :-
+    directory_file_path(Dir, 'test.db', DBFile),
+    bdb_open(DBFile, update, DB, [environment(Env)]),
+    forall(between(1, 100, X), bdb_put(DB, X, X)),
+    bdb_maintenance(Env, checkpoint, run),
+    bdb_maintenance(Env, trickle, run),
+    wait_maintenance(Env, checkpoint, CP),
+    wait_maintenance(Env, trickle, TR),
+    bdb_maintenance(Env, trickle, stop),
+    bdb_maintenance(Env, log_archive, interval(60)),
+    bdb_maintenance_status(Env, Status),
+    findall(Task, get_dict(Task, Status, _), Tasks0),
+    msort(Tasks0, Tasks),
+    Result = [CP.last_error-TR.last_error, Tasks],
+    bdb_close(DB).
+
+%   Wait until the maintenance thread for Task has completed a run.
+
+wait_maintenance(Env, Task, TaskStatus) :-
+    wait_maintenance(Env, Task, 100, TaskStatus).
+
+wait_maintenance(Env, Task, _, TaskStatus) :-
+    bdb_maintenance_status(Env, Status),
+    TaskStatus = Status.get(Task),
+    TaskStatus.runs > 0,
+    !.
+wait_maintenance(Env, Task, N, TaskStatus) :-
+    N > 0,
+    sleep(0.05),
+    N1 is N-1,
+    wait_maintenance(Env, Task, N1, TaskStatus).
 
 :- end_tests(bdb).